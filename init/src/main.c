@@ -1,7 +1,14 @@
 #include <stdio.h>
+#include "timepage.h"
 
 int main(void)
 {
     printf("Hello, world!");
+
+    struct timespec now;
+    if (timepage_init() && timepage_gettime(CLOCK_MONOTONIC, &now) == 0)
+    {
+        printf(" Up for %ld.%09ld seconds.", (long)now.tv_sec, (long)now.tv_nsec);
+    }
     return 0;
 }
@@ -0,0 +1,46 @@
+#include "timepage.h"
+
+#include <time/timepage.h>
+#include <sys/auxv.h>
+#include <stdint.h>
+
+static const time_page_t* time_page = NULL;
+// only mapped if the clock can't be read from the TSC
+static const volatile uint64_t* hpet_counter = NULL;
+
+bool timepage_init(void)
+{
+    unsigned long address = getauxval(TIME_PAGE_AUXV_TYPE);
+    if (address == 0)
+    {
+        return false;
+    }
+
+    time_page = (const time_page_t*)address;
+    hpet_counter = (const volatile uint64_t*)(address + TIME_PAGE_HPET_OFFSET + TIME_PAGE_HPET_COUNTER);
+    return true;
+}
+
+int timepage_gettime(clockid_t clock, struct timespec* ts)
+{
+    if (time_page == NULL || (clock != CLOCK_MONOTONIC && clock != CLOCK_REALTIME))
+    {
+        return -1;
+    }
+
+    uint64_t nanos = 0;
+    int64_t offset = 0;
+    if (!time_page_read(time_page, &nanos, &offset))
+    {
+        nanos = time_page_hpet_nanos(*hpet_counter, time_page->hpet_period);
+    }
+
+    int64_t now = (int64_t)nanos;
+    if (clock == CLOCK_REALTIME)
+    {
+        now += offset;
+    }
+    ts->tv_sec = now / 1000000000;
+    ts->tv_nsec = now % 1000000000;
+    return 0;
+}
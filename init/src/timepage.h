@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdbool.h>
+#include <time.h>
+
+// reads the clock from the kernel's time page, without a syscall
+
+// find the time page in the auxiliary vector.  Returns false if the kernel
+// didn't map one.
+bool timepage_init(void);
+// like clock_gettime, for CLOCK_MONOTONIC and CLOCK_REALTIME.  Returns -1 if
+// the clock isn't one of those, or timepage_init hasn't succeeded.
+int timepage_gettime(clockid_t clock, struct timespec* ts);
@@ -2,6 +2,7 @@
 
 #include <stdbool.h>
 #include <cpu/msr.h>
+#include <scheduler/preempt.h>
 
 typedef void (*fpuSaveFn)(void*);
 typedef void (*fpuRestoreFn)(void*);
@@ -9,6 +10,8 @@ typedef void (*fpuRestoreFn)(void*);
 #define CPUID_XSAVE (1 << 26)
 #define CPUID_AVX (1 << 28)
 #define CPUID_AVX512 (1 << 16)
+// cpuid leaf 0xd, subleaf 1, eax
+#define CPUID_XSAVEOPT (1 << 0)
 
 static inline void set_kernel_gs_base(uint64_t ptr)
 {
@@ -54,6 +57,7 @@ static inline void wrxcr(uint32_t reg, uint64_t val)
 }
 
 void xsave(void* region);
+void xsaveopt(void* region);
 void xrstor(void* region);
 void fxsave(void* region);
 void fxrstor(void* region);
@@ -93,6 +97,27 @@ static inline bool cpu_interrupt_state()
     return (f & (1 << 9)) != 0;
 }
 
+// disables interrupts, returning whether they were enabled beforehand so that
+// the caller can put things back the way they were with cpu_interrupts_restore.
+// Preemption is disabled in between too, so that a reschedule which was
+// wanted in the meantime happens as soon as interrupts are back on.
+static inline bool cpu_interrupts_disable()
+{
+    bool ints = cpu_interrupt_state();
+    asm volatile ("cli" ::: "memory");
+    preempt_disable();
+    return ints;
+}
+
+static inline void cpu_interrupts_restore(bool ints)
+{
+    if (ints)
+    {
+        asm volatile ("sti" ::: "memory");
+    }
+    preempt_enable();
+}
+
 static inline uint64_t cpu_rdtsc()
 {
     uint32_t a = 0;
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// the most CPUs we'll bring up, so that a set of CPUs fits in a fixed size
+#define CPU_MAX 256
+#define CPUMASK_WORDS (CPU_MAX / 64)
+
+// a set of CPUs, by cpu_number
+typedef struct {
+    uint64_t bits[CPUMASK_WORDS];
+} cpumask_t;
+
+static inline void cpumask_clear_all(cpumask_t* mask)
+{
+    for (uint64_t i = 0; i < CPUMASK_WORDS; i++)
+    {
+        mask->bits[i] = 0;
+    }
+}
+
+static inline void cpumask_set_all(cpumask_t* mask)
+{
+    for (uint64_t i = 0; i < CPUMASK_WORDS; i++)
+    {
+        mask->bits[i] = UINT64_MAX;
+    }
+}
+
+static inline void cpumask_set(cpumask_t* mask, uint64_t cpu)
+{
+    if (cpu < CPU_MAX)
+    {
+        mask->bits[cpu / 64] |= (uint64_t)1 << (cpu % 64);
+    }
+}
+
+static inline void cpumask_clear(cpumask_t* mask, uint64_t cpu)
+{
+    if (cpu < CPU_MAX)
+    {
+        mask->bits[cpu / 64] &= ~((uint64_t)1 << (cpu % 64));
+    }
+}
+
+static inline bool cpumask_test(const cpumask_t* mask, uint64_t cpu)
+{
+    if (cpu >= CPU_MAX)
+    {
+        return false;
+    }
+    return (mask->bits[cpu / 64] & ((uint64_t)1 << (cpu % 64))) != 0;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <interrupt/idt.h>
+#include <stdint.h>
+
+typedef struct thread_s thread_t;
+
+#define CR0_TS (1 << 3)
+
+// XSAVE requires its save area to be aligned to 64 bytes
+#define FPU_STORAGE_ALIGN 64
+// how many save areas to carve out of fresh memory whenever the cache runs dry
+#define FPU_CACHE_REFILL 16
+
+// save areas come from their own cache, rather than whole pages each
+void* fpu_alloc_storage();
+void fpu_free_storage(void* storage);
+// fill in a save area with the state a new thread starts with
+void fpu_init_storage(void* storage);
+
+// FPU state is switched lazily: on a context switch, CR0.TS is set so that
+// the first FPU/SIMD instruction the new thread executes traps, and only
+// then is its state loaded.  Threads which never touch the FPU (which
+// includes almost every kernel thread) never pay for it.
+// both of these must be called with interrupts disabled
+void fpu_switch_out(thread_t* thread);
+void fpu_switch_in(thread_t* thread);
+// the (current) thread is going away, forget that its state is loaded
+// anywhere and give back its save area
+void fpu_release(thread_t* thread);
+// #NM handler
+void fpu_handle_unavailable(uint32_t num, cpu_status_t* status);
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cpu/cpumask.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// the kernel command line option listing CPUs to isolate at boot, e.g.
+// "isolcpus=2,4-7"
+#define ISOLATION_CMDLINE_OPTION "isolcpus="
+
+// An isolated CPU is taken out of general use so that whatever runs there
+// can do so without interruption (e.g busy-polling a NIC): only threads
+// which have been explicitly pinned to it run there, nothing is migrated to
+// or from it by load balancing, device interrupts are sent elsewhere, and
+// it doesn't take a scheduler tick unless its pinned threads have to share.
+
+// pick up isolcpus= from the command line, before the CPUs are brought up
+void isolation_parse_cmdline(const char* cmdline);
+// isolate the CPUs asked for on the command line, once they're all online
+void isolation_init();
+// isolate a CPU, or give it back for general use.  Returns false if the CPU
+// doesn't exist, or if isolating it would leave nowhere for everything else
+// to run.
+bool cpu_set_isolated(uint64_t cpu_number, bool isolated);
+// where interrupts meant for the CPU with this LAPIC id should go instead,
+// if it's isolated
+uint32_t isolation_irq_target(uint32_t lapic_id);
@@ -2,6 +2,20 @@
 
 #include <stdint.h>
 
+#define MSR_EFER 0xc0000080
+#define MSR_STAR 0xc0000081
+#define MSR_LSTAR 0xc0000082
+#define MSR_FMASK 0xc0000084
+
+// enables syscall/sysret
+#define EFER_SCE (1 << 0)
+
+#define RFLAGS_TF (1 << 8)
+#define RFLAGS_IF (1 << 9)
+#define RFLAGS_DF (1 << 10)
+#define RFLAGS_NT (1 << 14)
+#define RFLAGS_AC (1 << 18)
+
 static inline uint64_t rdmsr(uint32_t msr)
 {
     uint32_t eax = 0, edx = 0;
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cpu/smp.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Per-CPU data.  Each CPU has an area of its own, starting on a fresh page
+// so nothing in it shares a cache line with another CPU's, and GS points at
+// it whenever we're in the kernel.  The area starts with the CPU's
+// local_cpu_t, followed by a copy of the .percpu section.
+//
+// Fields of local_cpu_t are read and written with this_cpu_read and friends,
+// which compile to a single GS-relative instruction.  Since an interrupt
+// can't land half way through an instruction, they're safe to use with
+// preemption enabled, though of course the CPU may have changed by the next
+// one.  Anything that needs several accesses to the same CPU's data should
+// disable preemption (or interrupts) around them.
+//
+// Other per-CPU variables live in the .percpu section, defined with
+// DEFINE_PER_CPU.  The copy in the section itself is only a template for the
+// real ones, and must never be used directly: go through this_cpu_ptr or
+// per_cpu_ptr instead.  The kernel is position independent, so unlike the
+// fields of local_cpu_t, their offsets aren't known until it's linked, and
+// getting at them takes a couple more instructions.
+
+#define DEFINE_PER_CPU(type, name) __attribute__((section(".percpu"))) type name
+#define DECLARE_PER_CPU(type, name) extern type name
+
+// the template, from the linker script
+extern uint8_t percpu_start[];
+extern uint8_t percpu_end[];
+
+// never defined, so using one of these on something which isn't 1, 2, 4 or 8
+// bytes fails to link
+void percpu_bad_size();
+
+#define PERCPU_FIELD_SIZE(field) sizeof(((local_cpu_t*)0)->field)
+#define PERCPU_FIELD_TYPE(field) __typeof__(((local_cpu_t*)0)->field)
+
+#define this_cpu_read(field) ({ \
+    uint64_t __ret = 0; \
+    switch (PERCPU_FIELD_SIZE(field)) \
+    { \
+        case 1: asm volatile ("movzbq %%gs:%c1, %0" : "=r" (__ret) : "i" (offsetof(local_cpu_t, field))); break; \
+        case 2: asm volatile ("movzwq %%gs:%c1, %0" : "=r" (__ret) : "i" (offsetof(local_cpu_t, field))); break; \
+        case 4: asm volatile ("movl %%gs:%c1, %k0" : "=r" (__ret) : "i" (offsetof(local_cpu_t, field))); break; \
+        case 8: asm volatile ("movq %%gs:%c1, %0" : "=r" (__ret) : "i" (offsetof(local_cpu_t, field))); break; \
+        default: percpu_bad_size(); \
+    } \
+    (PERCPU_FIELD_TYPE(field))__ret; \
+})
+
+#define PERCPU_OP(op, field, val) do { \
+    uint64_t __val = (uint64_t)(val); \
+    switch (PERCPU_FIELD_SIZE(field)) \
+    { \
+        case 1: asm volatile (op "b %b1, %%gs:%c0" :: "i" (offsetof(local_cpu_t, field)), "ir" (__val) : "memory"); break; \
+        case 2: asm volatile (op "w %w1, %%gs:%c0" :: "i" (offsetof(local_cpu_t, field)), "ir" (__val) : "memory"); break; \
+        case 4: asm volatile (op "l %k1, %%gs:%c0" :: "i" (offsetof(local_cpu_t, field)), "ir" (__val) : "memory"); break; \
+        case 8: asm volatile (op "q %1, %%gs:%c0" :: "i" (offsetof(local_cpu_t, field)), "er" (__val) : "memory"); break; \
+        default: percpu_bad_size(); \
+    } \
+} while (0)
+
+#define this_cpu_write(field, val) PERCPU_OP("mov", field, val)
+// not atomic with respect to other CPUs, only to interrupts on this one
+#define this_cpu_add(field, val) PERCPU_OP("add", field, val)
+#define this_cpu_sub(field, val) PERCPU_OP("sub", field, val)
+
+// a pointer to this CPU's copy of a DEFINE_PER_CPU variable
+#define this_cpu_ptr(var) \
+    ((__typeof__(&(var)))((uint8_t*)&(var) + this_cpu_read(percpu_offset)))
+// a pointer to another CPU's copy
+#define per_cpu_ptr(var, cpu) \
+    ((__typeof__(&(var)))((uint8_t*)&(var) + local_cpus[cpu]->percpu_offset))
+
+// how much space each CPU's area needs
+uint64_t percpu_area_size();
+// set up a CPU's area, with a fresh copy of the .percpu section
+local_cpu_t* percpu_area_alloc(uint64_t cpu_number);
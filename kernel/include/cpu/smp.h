@@ -5,6 +5,11 @@
 #include <stdint.h>
 #include <macro.h>
 #include <limine.h>
+#include <scheduler/runqueue.h>
+#include <scheduler/event.h>
+#include <lock/rcu.h>
+#include <cpu/cpumask.h>
+#include <cpu/topology.h>
 
 #define ABORT_STACK_SIZE 128
 
@@ -25,16 +30,69 @@ typedef struct {
     uint32_t iopb;
 } __attribute__((packed)) task_state_segment_t;
 
-typedef struct {
+// Each CPU's own area, which GS points at in the kernel (see cpu/percpu.h).
+// Fields other CPUs write to, or read often, are kept on lines of their own,
+// so they don't drag the ones only this CPU uses back and forth with them.
+typedef struct local_cpu_s {
+    // these two are read at fixed offsets from GS by the syscall stub and
+    // get_current_thread, so they have to come first
     uint64_t cpu_number;
-    uint64_t zero;
+    // the thread running on this CPU, NULL while it's idle
+    thread_t* current_thread;
+    local_cpu_t* self;
+    // what to add to the address of a .percpu variable to find our copy
+    int64_t percpu_offset;
+    // somewhere for the syscall entry stub to put userland's stack pointer
+    // while it finds the kernel's
+    uint64_t user_rsp;
+    // the thread whose FPU state was last loaded into this CPU's registers
+    thread_t* fpu_owner;
+    // a thread which has exited but whose stacks we were still running on,
+    // to be freed once we're off them
+    thread_t* dying_thread;
+    thread_t* softirq_thread;
+    // the top of the stack the idle loop runs on, which unlike the
+    // scheduler's isn't an IST stack, see scheduler_await
+    uint64_t idle_stack;
+    // set while this CPU is running its bottom halves, see
+    // interrupt/softirq.c
+    bool in_softirq;
+    // the scheduler interrupt came in while in_softirq was set, and has to
+    // be sent again once it's clear
+    bool softirq_resched;
+    bool rcu_irq_from_idle;
     task_state_segment_t tss;
     uint32_t lapic_id;
     uint64_t lapic_timer_freq;
-    _Atomic uint64_t online;
+    cpu_topology_t topology;
+
+    // taken by whoever wakes a thread up onto this CPU
+    run_queue_t run_queue __attribute__((aligned(CACHE_LINE_SIZE)));
+
+    _Atomic uint64_t online __attribute__((aligned(CACHE_LINE_SIZE)));
     _Atomic bool is_idle;
-    int64_t last_run_queue_index;
-    uint64_t abort_stack[ABORT_STACK_SIZE];
+    // set while the CPU is running its only runnable thread with no
+    // scheduler tick armed
+    _Atomic bool tick_stopped;
+    // taken out of general use, see cpu/isolation.h
+    _Atomic bool isolated;
+
+    // bottom halves raised on this CPU which haven't run yet, one bit per
+    // softirq_t
+    _Atomic uint32_t softirq_pending __attribute__((aligned(CACHE_LINE_SIZE)));
+    // wakes softirq_thread when there's more work than fits on IRQ exit
+    event_t softirq_event;
+
+    // the latest grace period this CPU has been through a quiescent state
+    // in, see lock/rcu.c
+    _Atomic uint64_t rcu_qs_seq __attribute__((aligned(CACHE_LINE_SIZE)));
+    // set while idle, which counts as quiescent for as long as it lasts.
+    // Interrupts taken while idle clear it until they return.
+    _Atomic bool rcu_idle;
+    // callbacks queued on this CPU which are waiting for a grace period
+    rcu_head_t* _Atomic rcu_callbacks;
+
+    uint64_t abort_stack[ABORT_STACK_SIZE] __attribute__((aligned(CACHE_LINE_SIZE)));
     _Atomic bool aborted;
 } local_cpu_t;
 
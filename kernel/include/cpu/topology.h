@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+
+// CPUID leaf 0xb/0x1f level types
+#define TOPOLOGY_LEVEL_INVALID 0
+#define TOPOLOGY_LEVEL_SMT 1
+#define TOPOLOGY_LEVEL_CORE 2
+
+// where a CPU sits in the machine.  Every id is unique across the whole
+// system, so two CPUs share a core (or cache, or package) exactly when the
+// corresponding ids are equal.
+typedef struct {
+    uint32_t x2apic_id;
+    uint32_t package_id;
+    uint32_t core_id;
+    // which hardware thread of its core this is
+    uint32_t smt_id;
+    // the last level cache, which is what we care about when moving threads
+    // between CPUs
+    uint32_t llc_id;
+} cpu_topology_t;
+
+// fill in the topology of the CPU we're running on
+void topology_detect(cpu_topology_t* topology);
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <limine.h>
+#include <stdint.h>
+
+// Turning kernel addresses back into function names, using the symbol table
+// in the kernel's own ELF file, which the bootloader leaves in memory for us.
+
+// needs malloc, and the file must still be there afterwards
+void ksym_init(struct limine_file* kernel_file, uint64_t virtual_base);
+// the name of the function `addr` is in, and how far into it, or NULL if we
+// don't know (including if ksym_init hasn't been called)
+const char* ksym_lookup(uint64_t addr, uint64_t* offset);
@@ -8,6 +8,7 @@
 #include <resource/resource.h>
 #include <mem/pagemap.h>
 #include <macro.h>
+#include <uapi/time/timepage.h>
 
 #include <stdint.h>
 
@@ -54,17 +55,26 @@
 #define ELF_PTYPE_PHDR          6
 #define ELF_PTYPE_TLS           7
 
+#define ELF_SECTION_SYMTAB  2
+#define ELF_SECTION_STRTAB  3
+
+// the low nibble of elf_symbol_t.info
+#define ELF_SYMBOL_TYPE(info)   ((info) & 0xf)
+#define ELF_SYMBOL_FUNC         2
+
 // aux table values - adjust as needed
 #define ELF_AT_ENTRY 9
 #define ELF_AT_PHDR 3
 #define ELF_AT_PHENT 4
 #define ELF_AT_PHNUM 5
+// where the time page is mapped, see uapi/time/timepage.h
+#define ELF_AT_TIME_PAGE TIME_PAGE_AUXV_TYPE
 
 
 typedef struct {
     uint8_t ident[8]; //bytes 0-7 define the type of ELF file
     RESERVE_BYTES(8); // bytes 8-15 are reserved
-    uint8_t type;     // see ELF_TYPE macros
+    uint16_t type;    // see ELF_TYPE macros
     uint16_t machine; // see ELF_MACHINE macros
     uint32_t version;
     uint64_t ptr_entry;         // the program entry point (vaddr)
@@ -103,6 +113,15 @@ typedef struct {
     uint64_t entity_size;
 } __attribute__((packed)) elf_section_header_t;
 
+typedef struct {
+    uint32_t name;  // offset into the linked string table
+    uint8_t info;   // type and binding
+    uint8_t other;
+    uint16_t section_index;
+    uint64_t value;
+    uint64_t size;
+} __attribute__((packed)) elf_symbol_t;
+
 
 // as this is sometimes used to populate an aux vector,
 // the following translations may be helpful:
@@ -110,12 +129,16 @@ typedef struct {
 // AT_PHDR -> elf_info_t.headers_ptr
 // AT_PHENT -> elf_info_t.prog_header_entry_size
 // AT_PHNUM -> elf_info_t.num_headers
+// AT_TIME_PAGE -> TIME_PAGE_USER_ADDRESS, if elf_info_t.time_page_mapped
 typedef struct {
     uint64_t entry;
     uint64_t prog_headers_ptr;
     uint64_t prog_header_entry_size;
     uint64_t num_headers;
     char* ld_path;
+    // not filled in by elf_load: whether the loader managed to map the time
+    // page into the program's pagemap
+    bool time_page_mapped;
 } elf_info_t;
 
 /**
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <fs/fs.h>
+#include <lock/rcu.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The directory entry cache remembers what each name looked up in each
+// directory led to, once redirections (. and ..) and mountpoints have been
+// followed, so walking a path it's seen before costs a hash probe per
+// component.  It remembers misses too, so a path that keeps failing to
+// resolve doesn't keep going to the directory either.
+//
+// Entries are keyed by the directory's vfs_children_t rather than its node,
+// since hard links to a directory share it.  Lookups are RCU readers.
+// Anything that changes what a name leads to has to invalidate it: adding
+// and removing children does so, and mounting throws the whole cache away.
+//
+// Once there are DCACHE_MAX_ENTRIES, the least recently used entry goes to
+// make room for a new one.  Hits only mark their entry as used rather than
+// moving it, so they don't all fight over the lock, and eviction gives
+// marked entries a second go at the front of the list instead.
+
+#define DCACHE_HASH_BITS 12
+#define DCACHE_HASH_SIZE (1 << DCACHE_HASH_BITS)
+#define DCACHE_MAX_ENTRIES 8192
+// longer names are looked up in the directory every time
+#define DCACHE_NAME_MAX 48
+
+typedef struct dcache_entry_s dcache_entry_t;
+
+typedef struct dcache_entry_s {
+    vfs_children_t* dir;
+    uint64_t hash;
+    size_t length;
+    char name[DCACHE_NAME_MAX];
+    // NULL if there's nothing by that name
+    vfs_node_t* node;
+    _Atomic bool referenced;
+    // the hash chain, which is read under RCU
+    dcache_entry_t* _Atomic next;
+    // the LRU list, most recently used first.  Protected by the cache's
+    // lock.
+    dcache_entry_t* lru_prev;
+    dcache_entry_t* lru_next;
+    rcu_head_t rcu;
+} dcache_entry_t;
+
+// what `name` in the directory `dir` leads to, with redirections and
+// mountpoints followed but not symlinks, or NULL if there's nothing there.
+// `name` needn't be terminated.  Must be called inside an RCU reader section
+// or with vfs_lock held.
+vfs_node_t* dcache_lookup(vfs_node_t* dir, const char* name, size_t length, uint64_t hash);
+// forget whatever `name` in `dir` led to, after it's been changed
+void dcache_invalidate(vfs_children_t* dir, const char* name, size_t length, uint64_t hash);
+// forget everything
+void dcache_flush();
@@ -1,6 +1,7 @@
 #pragma once
 
-#include <lock/lock.h>
+#include <lock/mutex.h>
+#include <lock/rcu.h>
 #include <resource/resource.h>
 
 // number of filesystems that are included in the kernel source tree
@@ -28,17 +29,51 @@ typedef struct filesystem_s {
     void (*close)(filesystem_t* self);
 } filesystem_t;
 
+// how many slots a directory's hash table starts out with.  Always a power
+// of 2.
+#define VFS_CHILDREN_INITIAL_CAPACITY 8
+
+// a directory's children, hashed by name into an open-addressed table.
+// Entries go into a free slot while the table is less than 3/4 full, and
+// otherwise into a copy twice the size which replaces this one.  Removing
+// one leaves a marker in its slot for lookups to carry on past, rather than
+// emptying it.  So lookups can probe it as RCU readers without taking
+// vfs_lock.
+typedef struct {
+    rcu_head_t rcu;
+    size_t mask;
+    vfs_node_t* _Atomic slots[];
+} vfs_child_table_t;
+
+// the directory itself, which stays put while its table is replaced, so
+// hard links to it can share it
+typedef struct {
+    vfs_child_table_t* table;
+    // how many slots aren't empty, counting ones removed children have
+    // left.  Protected by vfs_lock.
+    size_t count;
+} vfs_children_t;
+
+// the registered filesystem drivers, indexed by hpr_fsid_t.  Replaced
+// wholesale when one is registered.
+typedef struct {
+    rcu_head_t rcu;
+    size_t count;
+    filesystem_t* filesystems[];
+} filesystem_table_t;
+
 typedef struct vfs_node_s {
     vfs_node_t* mountpoint;
     vfs_node_t* redir;
     resource_t* resource;
     filesystem_t* filesystem;
     char* name;
+    // cached for lookups, see vfs_name_hash
+    size_t name_length;
+    uint64_t name_hash;
     vfs_node_t* parent;
-    vfs_node_t* children;
-
-    // -1 means "not a directory", 0 is a directory with 0 children
-    int children_count; 
+    // NULL means "not a directory"
+    vfs_children_t* children;
 
     const char* symlink_target;
 } vfs_node_t;
@@ -52,13 +87,26 @@ typedef struct {
 void fs_init();
 vfs_node_t* vfs_create_node(filesystem_t* filesystem, vfs_node_t* parent, const char* name, bool dir);
 void vfs_add_child(vfs_node_t* parent, vfs_node_t* new_child);
+void vfs_remove_child(vfs_node_t* parent, vfs_node_t* child);
+// follow redirections and mountpoints, and symlinks if asked to
+vfs_node_t* reduce_node(vfs_node_t* node, bool follow_symlinks);
 void dir_create_dotentries(vfs_node_t* node, vfs_node_t* parent);
 path2node_return_t path2node(vfs_node_t* parent, const char* path);
 vfs_node_t* node_get_child(vfs_node_t* node, const char* child_name);
+// the same, for a name which isn't terminated, with its hash already worked
+// out
+vfs_node_t* node_get_child_hashed(vfs_node_t* node, const char* child_name, size_t length, uint64_t hash);
+uint64_t vfs_name_hash(const char* name, size_t length);
 
+// add a filesystem driver after the built in ones, returning its identifier
+hpr_fsid_t fs_register(filesystem_t* filesystem);
+// the driver registered as `fs_identifier`, or NULL if there isn't one
+filesystem_t* fs_get_filesystem(hpr_fsid_t fs_identifier);
 bool fs_mount(vfs_node_t* parent, const char* source, const char* target, hpr_fsid_t fs_identifier);
 vfs_node_t* fs_create(vfs_node_t* parent, const char* name, int mode);
 vfs_node_t* fs_symlink(vfs_node_t* parent, const char* dest, const char* target);
+// remove a name which isn't a directory
+bool fs_unlink(vfs_node_t* parent, const char* path);
 vfs_node_t* fs_get_node(vfs_node_t* parent, const char* path, bool follow_symlinks);
 
 static inline const char* fs_name(hpr_fsid_t fsid)
@@ -72,6 +120,6 @@ static inline const char* fs_name(hpr_fsid_t fsid)
 }
 
 // todo: extern these?
-// extern lock_t vfs_lock;
+extern mutex_t vfs_lock;
 extern vfs_node_t* vfs_root;
-extern filesystem_t** filesystems;
+extern filesystem_table_t* filesystems;
@@ -1,4 +1,75 @@
 #pragma once
 
+#include <scheduler/event.h>
+#include <time/timer.h>
+#include <lock/lock.h>
+#include <macro.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Futexes let userland build locks which only come into the kernel when
+// they're contended: a thread which finds the lock taken sleeps on the lock
+// word with FUTEX_WAIT, and whoever releases it wakes it with FUTEX_WAKE.
+//
+// Waiters are kept in a hash table keyed by the physical address of the
+// word, so two processes sharing a page wait on the same futex wherever
+// it's mapped.  That means FUTEX_PRIVATE_FLAG is accepted, but makes no
+// difference.
+
+// the operations, with the same numbers as Linux
+#define FUTEX_WAIT 0
+#define FUTEX_WAKE 1
+#define FUTEX_REQUEUE 3
+#define FUTEX_CMP_REQUEUE 4
+#define FUTEX_WAIT_BITSET 9
+#define FUTEX_WAKE_BITSET 10
+// flags or'd into the operation
+#define FUTEX_PRIVATE_FLAG 128
+#define FUTEX_CLOCK_REALTIME 256
+#define FUTEX_CMD_MASK (~(FUTEX_PRIVATE_FLAG | FUTEX_CLOCK_REALTIME))
+
+// matches any waiter
+#define FUTEX_BITSET_MATCH_ANY 0xffffffffu
+
+#define FUTEX_HASH_BITS 8
+#define FUTEX_HASH_SIZE (1 << FUTEX_HASH_BITS)
+
+typedef struct futex_waiter_s futex_waiter_t;
+
+// one chain of the hash table.  Each has its own line so that unrelated
+// futexes don't fight over their locks.
+typedef struct {
+    lock_t lock;
+    futex_waiter_t* head;
+    futex_waiter_t* tail;
+} __attribute__((aligned(CACHE_LINE_SIZE))) futex_bucket_t;
+
+// lives on the waiting thread's stack
+typedef struct futex_waiter_s {
+    // the physical address of the futex word
+    uint64_t key;
+    uint32_t bitset;
+    // the bucket we're on, which changes if we're requeued
+    futex_bucket_t* _Atomic bucket;
+    bool queued;
+    // triggered (with the bucket locked) by whoever takes us off the bucket
+    // to wake us up
+    event_t woken;
+    hpr_timer_t timeout;
+    futex_waiter_t* next;
+    futex_waiter_t* prev;
+} futex_waiter_t;
+
 void futex_init();
 
+// the kernel side of each operation, which return a count or 0, or a
+// negative error number.  `deadline` is on the monotonic clock, 0 for none.
+int64_t futex_wait(uint32_t* uaddr, uint32_t val, uint64_t deadline, uint32_t bitset);
+int64_t futex_wake(uint32_t* uaddr, uint32_t count, uint32_t bitset);
+// wake up to `wake` waiters on uaddr, and move up to `requeue` more over to
+// wait on uaddr2 instead.  If `check` is set, nothing happens unless uaddr
+// still holds `val`.
+int64_t futex_requeue(uint32_t* uaddr, uint32_t* uaddr2, uint32_t wake, uint32_t requeue, bool check, uint32_t val);
+
+// futex(2).  Returns -1 and sets errno on failure.
+int64_t syscall_futex(uint32_t* uaddr, int op, uint32_t val, const timespec_t* timeout, uint32_t* uaddr2, uint32_t val3);
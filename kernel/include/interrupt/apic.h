@@ -13,5 +13,8 @@ void lapic_eoi();
 void lapic_send_ipi(uint8_t lapic_id, uint8_t vector);
 
 // todo: move IOAPIC functions to a different file?
+// interrupts are never delivered to isolated CPUs, see cpu/isolation.h
 void io_apic_set_irq_redirect(uint32_t lapic_id, uint8_t vector, uint8_t irq, bool status);
+// re-program every redirection, after a CPU has been isolated or given back
+void io_apic_reroute();
 
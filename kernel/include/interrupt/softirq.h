@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+
+// Bottom halves: work an interrupt handler raises so that it can be done on
+// the way out of the interrupt instead of in the handler itself.  They're
+// per-CPU, so they run on the CPU that raised them.  Interrupts are enabled
+// while they run, but they're never preempted or nested: an interrupt which
+// comes in meanwhile leaves its own bottom halves to the ones already
+// running, and the scheduler waits until they've finished.  Anything they
+// share with interrupt handlers or threads must still be locked with
+// interrupts disabled.
+//
+// If they keep getting raised faster than they can be handled, the rest is
+// left to a per-CPU thread so that threads still get some time.
+
+// in the order they run
+typedef enum {
+    SOFTIRQ_TIMER,
+    SOFTIRQ_NET_RX,
+    SOFTIRQ_NET_TX,
+    SOFTIRQ_COUNT,
+} softirq_t;
+
+// how many times to go round all the bottom halves on the way out of an
+// interrupt before handing over to the softirq thread
+#define SOFTIRQ_MAX_RESTART 10
+
+typedef void (*softirq_handler_t)();
+
+void softirq_register(softirq_t softirq, softirq_handler_t handler);
+// start the per-CPU softirq threads, once the scheduler is up
+void softirq_init();
+// raise a bottom half from an interrupt handler (or anywhere else with
+// interrupts disabled).  It runs when the interrupt returns.
+void softirq_raise_irqoff(softirq_t softirq);
+// raise a bottom half from a thread, which has the softirq thread run it
+void softirq_raise(softirq_t softirq);
+// run whatever bottom halves have been raised on this CPU.  Called with
+// interrupts disabled, on the way out of every interrupt, and enables them
+// while the handlers run.
+void softirq_run_pending();
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <scheduler/event.h>
+#include <resource/resource.h>
+#include <lock/lock.h>
+#include <macro.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// I/O rings let a process queue up a batch of reads, writes and polls and
+// hand them all to the kernel with one syscall, or with none at all,
+// instead of paying for a trip into the kernel each.
+//
+// The process and the kernel share one mapping, holding a submission queue
+// (SQ) of ioring_sqe_t, which the process fills, and a completion queue (CQ)
+// of ioring_cqe_t, which the kernel fills.  Each queue has a head, moved on
+// by whoever takes entries off it, and a tail, moved on by whoever puts
+// them on.  Both are free running, and wrap around into the entries with
+// the queue's mask.  Whoever puts an entry on writes it before storing the
+// tail with release semantics, and whoever takes it off loads the tail with
+// acquire semantics before reading it.
+//
+// ioring_enter takes whatever's on the SQ and can then wait for
+// completions.  With IORING_SETUP_SQPOLL, a kernel thread watches the SQ
+// instead, so submitting is just a store to the tail.  Once it's gone
+// sq_idle_millis without finding anything, the thread sets
+// IORING_SQ_NEED_WAKEUP and sleeps until ioring_enter is called with
+// IORING_ENTER_SQ_WAKEUP.  The process must check the flag after storing
+// the tail with a full barrier between the two, or it can miss it.
+//
+// Reads and writes are carried out as soon as they're taken off the SQ, by
+// whoever takes them, and block as they would in read() and write().  Poll
+// first where that matters.  Polls complete once any of the bits asked for
+// (or POLLERR or POLLHUP) turn up in the resource's status, and are checked
+// by ioring_enter and the SQ thread.
+
+#define IORING_MAX_ENTRIES 4096
+
+// the operations
+#define IORING_OP_NOP 0
+#define IORING_OP_READ 1
+#define IORING_OP_WRITE 2
+#define IORING_OP_POLL 3
+
+// ioring_params_t.flags
+#define IORING_SETUP_SQPOLL (1 << 0)
+
+// ioring_shared_t.sq_flags
+#define IORING_SQ_NEED_WAKEUP (1 << 0)
+
+// ioring_enter's flags
+#define IORING_ENTER_GETEVENTS (1 << 0)
+#define IORING_ENTER_SQ_WAKEUP (1 << 1)
+
+// in ioring_sqe_t.offset, to read or write at the file's position and move
+// it along, like read() and write() do
+#define IORING_OFFSET_CURRENT UINT64_MAX
+
+// how often waiters look at the status of resources they're polling even if
+// nothing's been triggered, in case a change slipped by while they weren't
+// waiting yet
+#define IORING_POLL_RECHECK_NANOS 10000000
+
+typedef struct {
+    uint8_t opcode;
+    uint8_t flags;
+    // IORING_OP_POLL: the POLL* bits to wait for
+    uint16_t poll_events;
+    int32_t fd;
+    uint64_t offset;
+    // the buffer to read into or write from
+    uint64_t addr;
+    uint32_t len;
+    uint32_t reserved;
+    // handed back untouched in the completion
+    uint64_t user_data;
+    uint64_t pad[3];
+} ioring_sqe_t;
+
+typedef struct {
+    uint64_t user_data;
+    // what the operation would have returned, or a negative errno.  Polls
+    // return the bits which were set.
+    int64_t result;
+} ioring_cqe_t;
+
+_Static_assert(sizeof(ioring_sqe_t) == 64, "ioring_sqe_t should fill a cache line");
+
+// the start of the shared mapping.  The fields each side writes are on
+// lines of their own, so the two don't keep taking them off each other.
+typedef struct {
+    // written by the process
+    _Atomic uint32_t sq_tail __attribute__((aligned(CACHE_LINE_SIZE)));
+    _Atomic uint32_t cq_head;
+    // written by the kernel
+    _Atomic uint32_t sq_head __attribute__((aligned(CACHE_LINE_SIZE)));
+    _Atomic uint32_t sq_flags;
+    _Atomic uint32_t cq_tail;
+    // completions which were dropped because the CQ was full.  The kernel
+    // won't take entries off the SQ unless it has room for them to
+    // complete, so this only goes up if the process moves cq_head backwards.
+    _Atomic uint32_t cq_overflow;
+    // set up once and never changed
+    uint32_t sq_entries __attribute__((aligned(CACHE_LINE_SIZE)));
+    uint32_t sq_mask;
+    uint32_t cq_entries;
+    uint32_t cq_mask;
+    // where the entries are, from the start of the mapping
+    uint64_t sq_offset;
+    uint64_t cq_offset;
+} ioring_shared_t;
+
+// passed to ioring_setup
+typedef struct {
+    // in: how many SQ entries are wanted, rounded up to a power of 2.
+    // out: how many there are.
+    uint32_t sq_entries;
+    // out: there are twice as many CQ entries
+    uint32_t cq_entries;
+    uint32_t flags;
+    // IORING_SETUP_SQPOLL: how long the thread goes without work before it
+    // sleeps
+    uint32_t sq_idle_millis;
+    // out: where the ring is mapped, and how big it is
+    uint64_t address;
+    uint64_t size;
+} ioring_params_t;
+
+typedef struct process_s process_t;
+typedef struct thread_s thread_t;
+
+// a poll which wasn't ready when it was submitted
+typedef struct ioring_poll_s {
+    // holds a reference until the poll completes
+    resource_t* resource;
+    uint16_t events;
+    uint64_t user_data;
+    struct ioring_poll_s* next;
+} ioring_poll_t;
+
+typedef struct ioring_s {
+    process_t* process;
+    uint32_t flags;
+    // the shared mapping, through the kernel's map of physical memory
+    ioring_shared_t* shared;
+    ioring_sqe_t* sqes;
+    ioring_cqe_t* cqes;
+    uint64_t phys;
+    uint64_t size;
+    // held while taking entries off the SQ
+    lock_t sq_lock;
+    // held while putting entries on the CQ
+    lock_t cq_lock;
+    // taken off the SQ but not completed yet, each with a CQ entry set
+    // aside.  Protected by cq_lock.
+    uint32_t inflight;
+    // triggered for every completion
+    event_t cq_event;
+    lock_t polls_lock;
+    ioring_poll_t* polls;
+    // IORING_SETUP_SQPOLL
+    thread_t* sq_thread;
+    event_t sq_event;
+    uint64_t sq_idle_nanos;
+} ioring_t;
+
+// returns the ring's id, which the process passes to ioring_enter
+int64_t syscall_ioring_setup(ioring_params_t* params);
+// take up to `to_submit` entries off the SQ, then with
+// IORING_ENTER_GETEVENTS wait until there are at least `min_complete` on the
+// CQ.  Returns how many were submitted.
+int64_t syscall_ioring_enter(uint64_t id, uint32_t to_submit, uint32_t min_complete, uint32_t flags);
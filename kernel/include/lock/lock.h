@@ -1,14 +1,83 @@
 #pragma once
 
+#include <macro.h>
 #include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 
+// Spinlocks come in two kinds:
+//
+// lock_t is a ticket lock: waiters are served in the order they arrived,
+// and it's as small and cheap as a spinlock gets when uncontended.  All of
+// its waiters spin on the same cache line though, so every release costs a
+// round of cache misses on every waiting CPU.
+//
+// mcs_lock_t is a queued (MCS) lock: each waiter brings an mcs_node_t
+// (usually on its stack) and spins on that, so a release only touches the
+// next waiter's line.  Use it for locks which many CPUs fight over.
+//
+// Neither disables interrupts.  A lock that's also taken from an interrupt
+// handler or a bottom half must always be taken with interrupts disabled,
+// e.g with the _irqsave variants, or the handler can spin forever on a lock
+// held by the code it interrupted.
+
+#ifdef COTTAGE_LOCKSTAT
+typedef struct lockstat_site_s lockstat_site_t;
+
+// what the current holder needs to account for how long it held the lock,
+// see lock/lockstat.h
 typedef struct {
-    _Atomic bool is_locked;
+    lockstat_site_t* site;
+    uint64_t acquired_at;
+} lockstat_hold_t;
+#endif
+
+typedef struct {
+    // tickets are handed out from `next`, and the lock belongs to whoever
+    // holds the ticket in `owner`.  All zeroes is unlocked.
+    _Atomic uint32_t next;
+    _Atomic uint32_t owner;
     uint64_t caller;
+#ifdef COTTAGE_LOCKSTAT
+    lockstat_hold_t stat;
+#endif
 } lock_t;
 
+typedef struct mcs_node_s {
+    struct mcs_node_s* _Atomic next;
+    // cleared by the previous holder when it hands the lock over to us
+    _Atomic bool waiting;
+} __attribute__((aligned(CACHE_LINE_SIZE))) mcs_node_t;
+
+typedef struct {
+    // the last waiter in the queue, or the holder if nobody's waiting.  NULL
+    // if the lock is free.
+    mcs_node_t* _Atomic tail;
+    uint64_t caller;
+#ifdef COTTAGE_LOCKSTAT
+    lockstat_hold_t stat;
+#endif
+} mcs_lock_t;
+
+// holding a lock disables preemption, see scheduler/preempt.h
 void lock_acquire(lock_t* lock);
 void lock_release(lock_t* lock);
+// these leave the preemption count alone, for locks which are released in a
+// different context to the one they were taken in (e.g by the scheduler,
+// on the far side of a context switch)
+void lock_acquire_raw(lock_t* lock);
+void lock_release_raw(lock_t* lock);
+// take the lock if it's free, without waiting.  Returns whether we got it,
+// in which case it's released with lock_release as usual.
 bool lock_test_and_acquire(lock_t* lock);
+// disable interrupts and take the lock, returning whether interrupts were
+// enabled, to be handed back to lock_release_irqrestore
+bool lock_acquire_irqsave(lock_t* lock);
+void lock_release_irqrestore(lock_t* lock, bool ints);
+
+// `node` must stay put until the matching release
+void mcs_lock_acquire(mcs_lock_t* lock, mcs_node_t* node);
+void mcs_lock_release(mcs_lock_t* lock, mcs_node_t* node);
+bool mcs_lock_test_and_acquire(mcs_lock_t* lock, mcs_node_t* node);
+bool mcs_lock_acquire_irqsave(mcs_lock_t* lock, mcs_node_t* node);
+void mcs_lock_release_irqrestore(mcs_lock_t* lock, mcs_node_t* node, bool ints);
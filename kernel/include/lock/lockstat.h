@@ -0,0 +1,61 @@
+#pragma once
+
+#include <lock/lock.h>
+#include <macro.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Lock contention statistics, for finding out which locks are worth
+// splitting up.  Only built in with COTTAGE_LOCKSTAT, otherwise all of this
+// compiles away to nothing.
+//
+// Every lock_t and mcs_lock_t acquisition is counted against the place it
+// was taken from: how many times, how many of those had to wait, for how
+// long, and how long the lock was then held for.  Times are in TSC cycles.
+// /dev/lockstat lists every call site, the longest total wait first, and
+// writing anything to it starts the counts again.
+
+// how many call sites we keep track of.  Acquisitions from any more are
+// only counted as dropped.
+#define LOCKSTAT_SITE_BITS 10
+#define LOCKSTAT_SITES (1 << LOCKSTAT_SITE_BITS)
+
+#ifdef COTTAGE_LOCKSTAT
+
+#include <cpu/cpu.h>
+
+typedef struct lockstat_site_s {
+    // where the lock was taken from, 0 if this slot is free
+    _Atomic uint64_t caller;
+    // the last lock taken from here, which is usually the only one
+    _Atomic uint64_t lock;
+    _Atomic uint64_t acquisitions;
+    _Atomic uint64_t contended;
+    _Atomic uint64_t wait_cycles;
+    _Atomic uint64_t wait_max;
+    _Atomic uint64_t hold_cycles;
+    _Atomic uint64_t hold_max;
+} __attribute__((aligned(CACHE_LINE_SIZE))) lockstat_site_t;
+
+// called by the lock once it has been taken.  `start` is when we started
+// waiting for it.
+void lockstat_acquired(lockstat_hold_t* hold, void* lock, uint64_t caller, uint64_t start, bool contended);
+// called by the lock just before it's released
+void lockstat_released(lockstat_hold_t* hold);
+
+#define LOCKSTAT_NOW() cpu_rdtsc()
+#define LOCKSTAT_ACQUIRED(l, caller, start, contended) \
+    lockstat_acquired(&(l)->stat, (l), (caller), (start), (contended))
+#define LOCKSTAT_RELEASED(l) lockstat_released(&(l)->stat)
+
+#else
+
+#define LOCKSTAT_NOW() 0
+#define LOCKSTAT_ACQUIRED(l, caller, start, contended) ((void)(start), (void)(contended))
+#define LOCKSTAT_RELEASED(l) ((void)0)
+
+#endif
+
+// create /dev/lockstat, if we're collecting statistics
+void lockstat_init();
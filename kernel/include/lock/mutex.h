@@ -0,0 +1,35 @@
+#pragma once
+
+#include <scheduler/waitqueue.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct thread_s thread_t;
+
+// how many times a waiter spins on a running owner before going to sleep
+#define MUTEX_SPIN_MAX 4096
+
+// A mutex is a lock which puts its waiters to sleep rather than letting them
+// spin, for critical sections which may take a while (copying pages,
+// allocating memory, ...).  While the owner is running on another CPU it's
+// likely to let go soon, so a waiter spins on it for as long as that stays
+// true, and only sleeps once the owner has stopped running, it has spun
+// MUTEX_SPIN_MAX times, or the scheduler wants its CPU back.
+//
+// Mutexes may only be taken by threads, and never with interrupts disabled
+// or a spinlock held.  All zeroes is unlocked.
+typedef struct {
+    // the thread holding the mutex, NULL if it's free
+    thread_t* _Atomic owner;
+    // threads on (or about to go on) the wait queue, so that releasing an
+    // uncontended mutex doesn't have to touch it
+    _Atomic uint64_t sleepers;
+    wait_queue_t waiters;
+} mutex_t;
+
+void mutex_acquire(mutex_t* mutex);
+void mutex_release(mutex_t* mutex);
+// take the mutex if it's free, without waiting.  Returns whether we got it.
+bool mutex_test_and_acquire(mutex_t* mutex);
+bool mutex_is_held(mutex_t* mutex);
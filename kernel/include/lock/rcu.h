@@ -0,0 +1,68 @@
+#pragma once
+
+#include <scheduler/preempt.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Read-copy-update, for data which is looked up far more often than it
+// changes.  Readers take no locks and write nothing shared: they just mark
+// the section in which they're using the data with rcu_read_lock and
+// rcu_read_unlock.  Writers (still kept apart from each other by an
+// ordinary lock) never change anything a reader might be looking at.
+// Instead they build a new copy, publish it with rcu_assign_pointer, and
+// free the old one only once every reader which might have seen it has
+// finished, with call_rcu or synchronize_rcu.
+//
+// Reader sections run with preemption disabled, so they mustn't sleep.  A
+// CPU which context switches, goes idle, or is caught by the scheduler tick
+// outside of one has therefore finished with everything it read before, and
+// once every CPU has done so since an update, the old copy can go.  That
+// wait is a grace period.
+
+typedef struct rcu_head_s rcu_head_t;
+typedef void (*rcu_callback_t)(rcu_head_t* head);
+
+// embed one of these in anything that will be freed with call_rcu
+typedef struct rcu_head_s {
+    rcu_head_t* next;
+    rcu_callback_t func;
+} rcu_head_t;
+
+// how often the grace period thread looks to see if every CPU has been
+// through a quiescent state
+#define RCU_GP_POLL_MILLIS 1
+// after this many polls, CPUs which have had nothing to make them pass
+// through the scheduler (e.g running a thread with the tick stopped) are
+// sent one
+#define RCU_GP_KICK_POLLS 10
+
+static inline void rcu_read_lock()
+{
+    preempt_disable();
+}
+
+static inline void rcu_read_unlock()
+{
+    preempt_enable();
+}
+
+// read a pointer published with rcu_assign_pointer, inside a reader section
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_CONSUME)
+// publish a pointer, after everything it points to has been filled in
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+// start the grace period thread, once the scheduler is up
+void rcu_init();
+// have func(head) called, from a thread, once every reader section that
+// started before now has finished.  Can be called from anywhere once the
+// scheduler is up, interrupt handlers included.
+void call_rcu(rcu_head_t* head, rcu_callback_t func);
+// wait for a whole grace period.  Threads only.
+void synchronize_rcu();
+
+// the scheduler's and interrupt stubs' side of things, see lock/rcu.c
+typedef struct local_cpu_s local_cpu_t;
+void rcu_note_qs(local_cpu_t* cpu);
+void rcu_idle_enter(local_cpu_t* cpu);
+void rcu_irq_enter();
+void rcu_irq_exit();
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <scheduler/waitqueue.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct thread_s thread_t;
+
+// A reader-writer semaphore lets any number of readers in at once, or a
+// single writer.  Like a mutex, anyone who has to wait for it sleeps, and
+// so the same rules apply: threads only, and never with interrupts disabled
+// or a spinlock held.
+//
+// Once a writer is waiting, new readers queue up behind it rather than
+// keeping it out forever.  That means a reader mustn't take the semaphore
+// again while it already has it for reading, or it can deadlock against a
+// writer that turned up in between.  All zeroes is unlocked.
+typedef struct {
+    // RWSEM_WRITER if a writer has it, otherwise RWSEM_READER times the
+    // number of readers
+    _Atomic uint64_t count;
+    // writers asleep (or about to be) waiting for their turn
+    _Atomic uint64_t writers_waiting;
+    _Atomic uint64_t sleepers;
+    // the writer holding it, so other writers know whether to spin
+    thread_t* _Atomic owner;
+    wait_queue_t waiters;
+} rwsem_t;
+
+#define RWSEM_WRITER ((uint64_t)1)
+#define RWSEM_READER ((uint64_t)2)
+
+void rwsem_acquire_read(rwsem_t* sem);
+void rwsem_release_read(rwsem_t* sem);
+void rwsem_acquire_write(rwsem_t* sem);
+void rwsem_release_write(rwsem_t* sem);
+// these don't wait, they return whether they got the semaphore
+bool rwsem_test_and_acquire_read(rwsem_t* sem);
+bool rwsem_test_and_acquire_write(rwsem_t* sem);
+// turn a write hold into a read hold, letting other readers in without
+// giving anyone else the chance to write in between
+void rwsem_downgrade(rwsem_t* sem);
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <lock/lock.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// A sequence count lets readers go without taking any lock at all, for data
+// which is read far more often than it's written.  The writer bumps the
+// count to an odd number before changing anything and back to an even one
+// afterwards; a reader notes the count before reading and checks it didn't
+// change afterwards, and if it did, reads everything again:
+//
+//     uint32_t seq;
+//     do {
+//         seq = seqcount_read_begin(&thing->seq);
+//         copy = thing->value;
+//     } while (seqcount_read_retry(&thing->seq, seq));
+//
+// Readers can see torn data, so they mustn't act on anything they've read
+// until the retry check passes, or follow pointers out of it.  A bare
+// seqcount_t needs its writers kept apart by something else; seqlock_t
+// comes with a spinlock to do that.
+typedef _Atomic uint32_t seqcount_t;
+
+typedef struct {
+    seqcount_t seq;
+    lock_t lock;
+} seqlock_t;
+
+static inline uint32_t seqcount_read_begin(seqcount_t* seq)
+{
+    uint32_t start;
+    // an odd count means a write is under way
+    while ((start = atomic_load_explicit(seq, memory_order_acquire)) & 1)
+    {
+        asm volatile ( "pause" ::: "memory" );
+    }
+    return start;
+}
+
+static inline bool seqcount_read_retry(seqcount_t* seq, uint32_t start)
+{
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(seq, memory_order_relaxed) != start;
+}
+
+static inline void seqcount_write_begin(seqcount_t* seq)
+{
+    atomic_fetch_add_explicit(seq, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static inline void seqcount_write_end(seqcount_t* seq)
+{
+    atomic_thread_fence(memory_order_release);
+    atomic_fetch_add_explicit(seq, 1, memory_order_relaxed);
+}
+
+static inline uint32_t seqlock_read_begin(seqlock_t* sl)
+{
+    return seqcount_read_begin(&sl->seq);
+}
+
+static inline bool seqlock_read_retry(seqlock_t* sl, uint32_t start)
+{
+    return seqcount_read_retry(&sl->seq, start);
+}
+
+// a reader spinning on the count can't be allowed to interrupt the writer it's
+// waiting for, so if the data is ever read from an interrupt handler it must
+// be written with the _irqsave variants
+void seqlock_write_lock(seqlock_t* sl);
+void seqlock_write_unlock(seqlock_t* sl);
+bool seqlock_write_lock_irqsave(seqlock_t* sl);
+void seqlock_write_unlock_irqrestore(seqlock_t* sl, bool ints);
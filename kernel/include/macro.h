@@ -1,12 +1,20 @@
 #pragma once
 
 #include <panic.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #define STRINGIFY_DETAIL(x) #x
 #define STRINGIFY(x) STRINGIFY_DETAIL(x)
 
 #define CHECKPOINT panic("reached checkpoint in " __FILE__ ":" STRINGIFY(__LINE__));
 
+// keep data written by different CPUs this far apart, so they don't fight
+// over the same line
+#define CACHE_LINE_SIZE 64
+
 #define RESERVE_BITS(x) uint64_t :x
 #define RESERVE_BYTES(x) RESERVE_BITS(x * 8)
 
+// get a pointer to the structure that contains <ptr> as its field <member>
+#define CONTAINER_OF(ptr, type, member) ((type*)((uint8_t*)(ptr) - offsetof(type, member)))
@@ -1,6 +1,6 @@
 #pragma once
 
-#include <lock/lock.h>
+#include <lock/rwsem.h>
 
 #include <stdbool.h>
 #include <stdint.h>
@@ -14,7 +14,9 @@ typedef struct {
     void* top_level;
     void** mmap_ranges;
     size_t mmap_range_count;
-    lock_t lock;
+    // protects the mmap ranges.  It's held across copying a whole address
+    // space on fork, so waiters sleep rather than spin.
+    rwsem_t lock;
 } pagemap_t;
 
 // couple of helper functions to map multi-page regions
@@ -2,6 +2,8 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <lock/rcu.h>
 
 // flags
 // is the device enabled?
@@ -48,6 +50,14 @@ typedef struct
     network_device_t* device;
 } network_device_descriptor_t;
 
+// every registered device, replaced with a bigger copy when one's added
+typedef struct
+{
+    rcu_head_t rcu;
+    size_t count;
+    network_device_descriptor_t devices[];
+} network_device_table_t;
+
 // registers device <device> with identifier <identifier>,
 // identifier will be used to name the /dev file, so must be a
 // compliant filename without any special characters
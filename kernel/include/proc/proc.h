@@ -8,11 +8,13 @@
 #include <stdint.h>
 #include <interrupt/idt.h>
 #include <lock/lock.h>
+#include <lock/rcu.h>
+#include <scheduler/runqueue.h>
 
 // todo: make configurable at runtime?
 #define PROC_MAX_FDS 256
 #define PROC_MAX_EVENTS 32
-#define PROC_TIMERS 4096
+#define PROC_MAX_IORINGS 8
 
 // this kind of doesn't matter but if you keep it to a single byte,
 // it can allow some optimisations 
@@ -59,7 +61,40 @@ typedef struct thread_s {
     // thread id
     uint64_t tid;
     // is the thread currently queued for running?
-    bool is_in_queue;
+    _Atomic bool is_in_queue;
+    // the scheduling class which decides when we get to run
+    sched_class_t* sched_class;
+    sched_policy_t policy;
+    // when we were last put on a CPU, and how long we've spent on one in
+    // total (in nanoseconds)
+    uint64_t exec_start;
+    uint64_t sum_exec_runtime;
+    // used by the fair and deadline classes to sit in their timelines
+    rb_node_t run_node;
+    // fair class state, see scheduler/fair.c
+    int nice;
+    uint64_t weight;
+    uint64_t vruntime;
+    // real-time class state, see scheduler/rt.c
+    int rt_priority;
+    thread_t* rt_next;
+    thread_t* rt_prev;
+    // deadline class state, see scheduler/deadline.c
+    uint64_t dl_runtime;
+    uint64_t dl_deadline;
+    uint64_t dl_period;
+    uint64_t dl_abs_deadline;
+    int64_t dl_remaining;
+    // the run queue of the CPU we're queued on or running on, NULL if neither
+    _Atomic(run_queue_t*) run_queue;
+    // the cpu we last ran on, used to place wakeups somewhere cache-hot
+    _Atomic uint64_t last_cpu;
+    // the CPUs we're allowed to run on.  Changed with the run queue we're
+    // attached to locked, see scheduler_set_affinity
+    cpumask_t affinity;
+    // set once the affinity has been asked for explicitly, rather than
+    // being the default, which is what lets us onto isolated CPUs
+    bool pinned;
     lock_t lock;
     process_t* process;
     cpu_status_t cpu_state;
@@ -67,10 +102,24 @@ typedef struct thread_s {
     uint64_t fs_base;
     uint64_t pf_stack;
     uint64_t cr3;
+    // NULL until the thread first uses the FPU (user threads get one
+    // straight away), see cpu/fpu.c
     void* fpu_storage;
-    lock_t yield_await;
+    // the CPU whose registers were last loaded with our FPU state
+    uint64_t fpu_cpu;
+    // where the context was saved when the thread last stopped running:
+    // a full interrupt frame in cpu_state (CONTEXT_FRAME), or the
+    // callee-saved registers on its own stack at switch_rsp (CONTEXT_STACK)
+    uint64_t context_kind;
+    uint64_t switch_rsp;
     uint64_t timeslice;
-    uint64_t which_event;
+    // see scheduler/preempt.h
+    uint64_t preempt_count;
+    // the scheduler wanted to switch away from us while preempt_count was
+    // raised
+    _Atomic bool need_resched;
+    // which of the events/wait queues we were blocked on woke us up
+    _Atomic uint64_t which_event;
     void* exit_value;
     event_t exited;
     uint64_t sigentry;
@@ -83,6 +132,9 @@ typedef struct thread_s {
     void* signalfds[PROC_MAX_SIGNAL_FDS_PER_THREAD];
     event_t attached_events[PROC_MAX_EVENTS];
     uint64_t attached_events_index;
+    // mutex waiters look at their owner under RCU, so an exited thread is
+    // freed through this
+    rcu_head_t rcu;
 } thread_t;
 
 typedef struct process_s {
@@ -94,6 +146,12 @@ typedef struct process_s {
     size_t thread_count;
     lock_t fds_lock;
     void* fds[PROC_MAX_FDS];
+    // set up with ioring_setup, and indexed by the id it returns.  Slots
+    // are claimed with a compare-and-swap.
+    struct ioring_s* _Atomic iorings[PROC_MAX_IORINGS];
+    // where our syscalls are recorded while we're being traced, see
+    // sys/systrace.h.  Read under RCU.
+    struct systrace_ring_s* systrace;
     struct process_t* children[PROC_MAX_CHILD_PROCESSES];
     // anonymous mmap calls will place memory at this location
     uint64_t mmap_anon_non_fixed_base;
@@ -101,12 +159,23 @@ typedef struct process_s {
     void* cwd;
     event_t event;
     uint64_t status;
-    uint8_t itimers[PROC_TIMERS];
     char* name;
+    // processes[] is read under RCU, so the process is freed through this
+    // once it's been taken out
+    rcu_head_t rcu;
 } process_t;
 
 // global variables
+// indexed by pid.  Slots are claimed with a compare-and-swap and looked up
+// as RCU readers, see proc_find.
 extern _Atomic(process_t*) processes[PROC_MAX_PROCESSES];
 
 thread_t* get_current_thread();
 uint64_t proc_allocate_pid(process_t* process);
+// give the process's pid back, and free the process once nobody can be
+// looking at it through processes[] any more.  Everything else the process
+// owns must already have been torn down.
+void proc_release_pid(process_t* process);
+// look a process up by pid.  Must be called inside an RCU reader section,
+// and the process is only guaranteed to stay around until it ends.
+process_t* proc_find(uint64_t pid);
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// an intrusive red-black tree.  Embed an rb_node_t in whatever structure you
+// want to keep sorted, and use CONTAINER_OF (see macro.h) to get back from
+// the node to your structure.  The tree never allocates memory.
+
+typedef struct rb_node_s {
+    struct rb_node_s* parent;
+    struct rb_node_s* left;
+    struct rb_node_s* right;
+    bool red;
+} rb_node_t;
+
+typedef struct {
+    rb_node_t* root;
+    // cached so that finding the smallest element is O(1)
+    rb_node_t* leftmost;
+} rb_tree_t;
+
+// should return true if a sorts before b.  Nodes which compare equal are
+// inserted after the existing ones, so equal keys come out in FIFO order.
+typedef bool (*rb_less_fn)(const rb_node_t* a, const rb_node_t* b);
+
+void rb_insert(rb_tree_t* tree, rb_node_t* node, rb_less_fn less);
+void rb_erase(rb_tree_t* tree, rb_node_t* node);
+rb_node_t* rb_next(const rb_node_t* node);
+rb_node_t* rb_prev(const rb_node_t* node);
+rb_node_t* rb_last(const rb_tree_t* tree);
+
+static inline rb_node_t* rb_first(const rb_tree_t* tree)
+{
+    return tree->leftmost;
+}
+
+static inline bool rb_empty(const rb_tree_t* tree)
+{
+    return tree->root == NULL;
+}
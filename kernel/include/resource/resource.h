@@ -1,16 +1,28 @@
 #pragma once
 
 #include <scheduler/event.h>
+#include <lock/mutex.h>
 #include <stat/stat.h>
 
+// readiness bits kept in resource_t.status, with the same values as
+// poll()'s.  Resources which can block keep them up to date, triggering
+// `event` whenever they change.
+#define POLLIN 0x01
+#define POLLOUT 0x04
+#define POLLERR 0x08
+#define POLLHUP 0x10
+
 typedef struct resource_s resource_t;
 
 typedef struct resource_s {
     stat_t stat;
     _Atomic int refcount;
-    lock_t lock;
+    // held by the filesystem while it reads or changes the contents, which
+    // can take a while
+    mutex_t lock;
     event_t event;
-    int status;
+    // POLL* bits
+    _Atomic int status;
     bool can_mmap;
 
     // function pointers
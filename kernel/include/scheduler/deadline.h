@@ -0,0 +1,28 @@
+#pragma once
+
+#include <scheduler/runqueue.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// the smallest runtime we'll accept, anything less is swamped by the cost of
+// the context switch
+#define DL_MIN_RUNTIME 10000
+// bandwidths are fixed point fractions of one CPU
+#define DL_BW_SHIFT 20
+#define DL_BW_ONE (1ull << DL_BW_SHIFT)
+// how much of each CPU deadline threads are allowed to reserve between them,
+// the rest is left for everyone else so that the system stays usable
+#define DL_BW_LIMIT (DL_BW_ONE * 95 / 100)
+// never hand out a slice shorter than this (in microseconds), even if the
+// thread has less runtime than that left
+#define DL_MIN_TIMESLICE 50
+
+extern sched_class_t dl_sched_class;
+
+// admission control: reserve the bandwidth (runtime / period) for a new
+// deadline thread.  Returns false if the parameters are nonsense, or if
+// accepting them would mean we can no longer guarantee every deadline
+// thread its runtime.
+bool dl_admit(const sched_attr_t* attr);
+// give back the bandwidth reserved by a deadline thread which is exiting
+void dl_release(thread_t* thread);
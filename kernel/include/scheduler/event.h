@@ -1,22 +1,31 @@
 #pragma once
 
-#include <lock/lock.h>
+#include <scheduler/waitqueue.h>
+#include <stdbool.h>
 #include <stdint.h>
 
-#define EVT_MAX_LISTENERS 32
+// the most events a thread can wait on at once
+#define EVENT_MAX_AWAIT 32
 
+// an event is something threads can block on until another thread (or an
+// interrupt handler) triggers it.  Triggers that happen while nobody is
+// waiting are counted in `pending`, and consumed by the next waiters.
 typedef struct {
-    void* thread;
-    uint64_t which;
-} event_listener_t;
-
-typedef struct {
-    lock_t lock;
+    // waiters.lock protects pending too
+    wait_queue_t waiters;
     uint64_t pending;
-    uint64_t listeners_index;
-    event_listener_t listeners[EVT_MAX_LISTENERS];
 } event_t;
 
+// wait for any one of `count` events to be triggered, and return the index of
+// the one that was.  If `block` is false, only pending triggers are consumed,
+// and -1 is returned if there aren't any.  -1 is also returned if the thread
+// was woken up by something other than the events (e.g a signal).
+int64_t event_await(event_t** events, uint64_t count, bool block);
+// wake every thread waiting on the event, and return how many there were.
+// If nobody is waiting, the trigger is remembered for the next waiter,
+// unless `drop` is set.
 uint64_t event_trigger(event_t* event, bool drop);
+// same as event_trigger, but only wakes the longest waiting thread
+uint64_t event_trigger_one(event_t* event, bool drop);
 
 extern _Atomic uint64_t waiting_event_count;
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <scheduler/runqueue.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define FAIR_NICE_MIN (-20)
+#define FAIR_NICE_MAX 19
+// the weight of a thread at nice 0, everything else is relative to this
+#define FAIR_NICE_0_WEIGHT 1024
+
+typedef struct {
+    // every runnable thread should get to run once within this period
+    uint64_t latency_ns;
+    // no thread is ever given a slice shorter than this, no matter how many
+    // threads are runnable.  Once there are more than latency / granularity
+    // threads, the period stretches instead.
+    uint64_t min_granularity_ns;
+    // a waking thread has to be this far behind the running thread (in
+    // virtual time) before it is allowed to preempt it
+    uint64_t wakeup_granularity_ns;
+} fair_tunables_t;
+
+extern sched_class_t fair_sched_class;
+extern fair_tunables_t fair_tunables;
+
+// returns false (and changes nothing) if the tunables don't make sense
+bool fair_set_tunables(fair_tunables_t tunables);
+uint64_t fair_nice_to_weight(int nice);
+// change the weight of a thread that's in the fair class.  If the thread is
+// runnable, the caller must hold the lock of the run queue it belongs to.
+void fair_reweight(run_queue_t* rq, thread_t* thread, int nice);
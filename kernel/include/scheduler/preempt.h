@@ -0,0 +1,32 @@
+#pragma once
+
+#include <lock/lock.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Kernel code can be preempted by the scheduler interrupt at any point,
+// except while the running thread's preemption count is raised.  Holding a
+// spinlock or having interrupts disabled with cpu_interrupts_disable raises
+// it, and anything else which mustn't be switched away from half way
+// through can raise it directly.  If the scheduler wants the CPU while the
+// count is raised, it sets need_resched instead, and the thread gives the
+// CPU up as soon as the count drops back to zero.
+//
+// The count is kept in the running thread rather than in the CPU: it then
+// travels with the thread when it switches, and can be changed without
+// first pinning down which CPU we're on.  Before the scheduler is up, and
+// while a CPU isn't running a thread, none of this does anything.
+
+void preempt_disable();
+void preempt_enable();
+// for when the caller is about to give up the CPU anyway
+void preempt_enable_no_resched();
+uint64_t preempt_count();
+
+// a preemption point for long-running loops: gives up the CPU if something
+// else should be running
+void cond_resched();
+// the same, for a loop which holds `lock`: it's dropped while the other
+// thread runs, so the caller must be able to cope with things changing
+// under it.  Returns true if the lock was dropped.
+bool cond_resched_lock(lock_t* lock);
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <scheduler/runqueue.h>
+
+// how long a SCHED_POLICY_RR thread runs before giving way to others of the
+// same priority, in microseconds
+#define RT_RR_TIMESLICE 100000
+// SCHED_POLICY_FIFO threads don't have a timeslice, but we still check in
+// every so often in case a higher priority thread has turned up
+#define RT_FIFO_TIMESLICE 1000000
+
+extern sched_class_t rt_sched_class;
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <lock/lock.h>
+#include <cpu/cpumask.h>
+#include <rbtree/rbtree.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct thread_s thread_t;
+typedef struct run_queue_s run_queue_t;
+typedef struct sched_class_s sched_class_t;
+
+// lower numbers run first, see sched_class_t
+#define SCHED_PRIORITY_DEADLINE 0
+#define SCHED_PRIORITY_RT 1
+#define SCHED_PRIORITY_FAIR 2
+#define SCHED_PRIORITY_IDLE 3
+
+// static priorities for the real-time policies.  Higher numbers win.
+#define SCHED_RT_PRIORITY_MIN 1
+#define SCHED_RT_PRIORITY_MAX 99
+
+typedef enum {
+    // time-shared with everything else according to nice value
+    SCHED_POLICY_NORMAL,
+    // real-time, runs until it blocks or something more important comes along
+    SCHED_POLICY_FIFO,
+    // real-time, round-robins with other threads of the same priority
+    SCHED_POLICY_RR,
+    // earliest deadline first, with a guaranteed runtime every period
+    SCHED_POLICY_DEADLINE,
+} sched_policy_t;
+
+// how a thread wants to be scheduled.  Only the fields relevant to the
+// policy are looked at, apart from `affinity` which applies to them all.
+typedef struct {
+    sched_policy_t policy;
+    // SCHED_POLICY_NORMAL
+    int nice;
+    // SCHED_POLICY_FIFO and SCHED_POLICY_RR
+    int rt_priority;
+    // SCHED_POLICY_DEADLINE: the thread will get `runtime_ns` of CPU time
+    // within `deadline_ns` of the start of every `period_ns`
+    uint64_t runtime_ns;
+    uint64_t deadline_ns;
+    uint64_t period_ns;
+    // the CPUs the thread may run on, or NULL for any of them
+    const cpumask_t* affinity;
+} sched_attr_t;
+
+// flags for run_queue_enqueue
+// the thread is becoming runnable after having been blocked
+#define RQ_ENQUEUE_WAKEUP (1 << 0)
+// the thread has never run before
+#define RQ_ENQUEUE_NEW (1 << 1)
+
+// a scheduling class decides the order in which its own threads run.  Every
+// thread belongs to exactly one class, and classes are consulted in order of
+// `priority` (lowest first) when picking the next thread, so a runnable
+// thread in a higher class always beats one in a lower class.
+//
+// a class' "runnable set" is everything queued in it, plus the currently
+// running thread if that belongs to the class.
+typedef struct sched_class_s {
+    const char* name;
+    int priority;
+    // add a thread to the runnable set
+    void (*enqueue)(run_queue_t* rq, thread_t* thread, int flags);
+    // remove a thread from the runnable set (it may be rq->current)
+    void (*dequeue)(run_queue_t* rq, thread_t* thread);
+    // take the next thread to run out of the queue, or return NULL
+    thread_t* (*pick_next)(run_queue_t* rq);
+    // the running thread is being switched away from, but is still runnable
+    void (*put_prev)(run_queue_t* rq, thread_t* thread);
+    // remove and return a queued (not running) thread that CPU `cpu` can
+    // take off our hands, or NULL if there's nothing worth moving (or
+    // allowed to move there)
+    thread_t* (*steal)(run_queue_t* rq, uint64_t cpu);
+    // should `thread`, which has just been enqueued, preempt rq->current?
+    // only called when both belong to this class
+    bool (*check_preempt)(run_queue_t* rq, thread_t* thread);
+    // fix up per-queue bookkeeping when a thread moves between CPUs.  May be NULL.
+    void (*migrate)(thread_t* thread, run_queue_t* from, run_queue_t* to);
+    // how long (in microseconds) the thread should run before we look again
+    uint64_t (*timeslice)(run_queue_t* rq, thread_t* thread);
+} sched_class_t;
+
+// per-CPU state for the fair scheduling class
+typedef struct {
+    // runnable threads ordered by vruntime, not including the running thread
+    rb_tree_t timeline;
+    // monotonically increasing floor of the vruntimes on this queue, used to
+    // place threads which are new, waking, or migrating from another CPU
+    _Atomic uint64_t min_vruntime;
+    // sum of the weights of the runnable set
+    uint64_t total_weight;
+    uint64_t nr_running;
+} fair_run_queue_t;
+
+// per-CPU state for the real-time class: a FIFO list for each priority level
+typedef struct {
+    // bit n is set if queues[n] has anything in it
+    uint64_t bitmap[2];
+    struct {
+        thread_t* head;
+        thread_t* tail;
+    } queues[SCHED_RT_PRIORITY_MAX + 1];
+    uint64_t nr_running;
+} rt_run_queue_t;
+
+// per-CPU state for the deadline class
+typedef struct {
+    // runnable threads ordered by absolute deadline, not including the
+    // running thread
+    rb_tree_t timeline;
+    uint64_t nr_running;
+} dl_run_queue_t;
+
+// every CPU owns one of these.  Threads sit in here while they are ready to
+// run, and are kept in per-class structures which never allocate memory, so
+// picking the next thread is cheap and there is no cap on the number of
+// threads we can have in the system.
+typedef struct run_queue_s {
+    lock_t lock;
+    // number of runnable threads, including the one that's running.
+    // read without the lock by other CPUs when load balancing, so it is
+    // only ever a hint to them
+    _Atomic uint64_t nr_running;
+    thread_t* current;
+    // the priority of the class rq->current belongs to, or
+    // SCHED_PRIORITY_IDLE if we're not running anything.  Like nr_running,
+    // only a hint for other CPUs.
+    _Atomic int current_priority;
+    dl_run_queue_t dl;
+    rt_run_queue_t rt;
+    fair_run_queue_t fair;
+} run_queue_t;
+
+// all of these expect the caller to be holding rq->lock
+void run_queue_enqueue(run_queue_t* rq, thread_t* thread, int flags);
+void run_queue_dequeue(run_queue_t* rq, thread_t* thread);
+void run_queue_put_prev(run_queue_t* rq, thread_t* thread);
+thread_t* run_queue_pick_next(run_queue_t* rq);
+thread_t* run_queue_steal(run_queue_t* rq, uint64_t cpu);
+bool run_queue_check_preempt(run_queue_t* rq, thread_t* thread);
@@ -2,13 +2,21 @@
 
 #include <proc/proc.h>
 #include <elf/elf.h>
+#include <cpu/smp.h>
 
 
 void scheduler_init();
 void scheduler_await();
 void scheduler_dequeue_and_die();
 bool scheduler_dequeue_thread(thread_t* thread);
-void scheduler_yield(bool save_context);
+// change the nice value (-20 to 19) of a thread in the fair scheduling class
+void scheduler_set_nice(thread_t* thread, int nice);
+// restrict a thread to a set of CPUs, moving it if it's somewhere it's no
+// longer allowed.  Returns false if none of the CPUs exist.
+bool scheduler_set_affinity(thread_t* thread, const cpumask_t* mask);
+// give up the CPU right away.  The thread keeps running later if it's still
+// (or is once again) in a run queue.
+void scheduler_yield();
 process_t* scheduler_new_process(process_t* old_process, pagemap_t* pagemap);
 thread_t* new_user_thread(
     process_t* process,
@@ -23,8 +31,12 @@ thread_t* new_user_thread(
     elf_info_t elf_info,
     bool autoenqueue
 );
-thread_t* new_kernel_thread(void* ip, void* arg, bool autoenqueue);
+// attr may be NULL for the default (fair) policy.  Returns NULL if the
+// scheduling parameters are rejected.
+thread_t* new_kernel_thread(void* ip, void* arg, bool autoenqueue, const sched_attr_t* attr);
 bool enqueue_thread(thread_t* thread, bool by_signal);
+// a timer has been armed on `cpu` which is due before any of its others
+void scheduler_kick_timer(local_cpu_t* cpu);
 
 extern _Atomic uint8_t scheduler_vector;
 extern _Atomic bool scheduler_ready;
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// how a thread's context was saved when it was switched away from.
+// an interrupt frame (cpu_status_t) in thread->cpu_state, when it was
+// preempted from the scheduler interrupt
+#define CONTEXT_FRAME 0
+// the callee-saved registers and flags, pushed on the thread's own stack at
+// thread->switch_rsp, when it gave up the CPU by calling into the scheduler
+#define CONTEXT_STACK 1
+
+// push the callee-saved registers and flags, store the stack pointer in
+// *save_rsp, then leave the stack, release the ticket lock whose owner is
+// *unlock and resume the context at load_rsp.  Returns once something
+// resumes the saved context.
+void context_switch(uint64_t* save_rsp, _Atomic uint32_t* unlock, uint64_t load_rsp, uint64_t load_kind);
+// resume a context without saving the current one
+__attribute__((noreturn)) void context_resume(uint64_t load_rsp, uint64_t load_kind);
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <lock/lock.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct thread_s thread_t;
+
+// thread->which_event holds this while the thread is waiting and nobody has
+// woken it up yet
+#define WAIT_NOT_WOKEN UINT64_MAX
+
+// a waiting thread puts one of these (usually on its own stack) on every
+// queue it's waiting on
+typedef struct wait_queue_entry_s {
+    thread_t* thread;
+    // handed back to the thread in thread->which_event if this is the entry
+    // that wakes it up
+    uint64_t which;
+    bool queued;
+    struct wait_queue_entry_s* next;
+    struct wait_queue_entry_s* prev;
+} wait_queue_entry_t;
+
+// a list of threads which are blocked, waiting for something to happen.
+// Blocked threads aren't in any run queue, so they cost nothing until
+// they're woken up.
+typedef struct {
+    lock_t lock;
+    wait_queue_entry_t* head;
+    wait_queue_entry_t* tail;
+} wait_queue_t;
+
+// all of these expect the caller to be holding wq->lock
+void wait_queue_add(wait_queue_t* wq, wait_queue_entry_t* entry);
+void wait_queue_remove(wait_queue_t* wq, wait_queue_entry_t* entry);
+// wake up to `max` waiters, in the order they started waiting, and return how
+// many were woken.  Threads which have already been woken by some other
+// queue they were waiting on are skipped.
+uint64_t wait_queue_wake(wait_queue_t* wq, uint64_t max);
+// block the current thread until it's woken through this queue.  wq->lock is
+// dropped while asleep, and held again on return.
+void wait_queue_wait(wait_queue_t* wq);
+
+// mark the current thread as about to block.  Once this is called, the
+// thread will stop running at its next yield unless something wakes it up
+// first, so it must be called *before* checking whatever condition is being
+// waited for, otherwise a wakeup could be lost.
+void wait_prepare(thread_t* thread);
+// undo wait_prepare, if it turns out the thread doesn't need to block
+void wait_cancel(thread_t* thread);
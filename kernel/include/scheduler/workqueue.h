@@ -0,0 +1,82 @@
+#pragma once
+
+#include <scheduler/event.h>
+#include <time/timer.h>
+#include <lock/lock.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Workqueues run deferred work in kernel threads, so unlike bottom halves
+// (see interrupt/softirq.h) the work is free to block and take sleeping
+// locks.  Each workqueue either hands its work to a pool of workers pinned
+// to the CPU that queued it, or (with WORKQUEUE_UNBOUND) to a single pool
+// whose workers run wherever the scheduler puts them.
+
+// how many workers each per-CPU pool gets
+#define WORKQUEUE_PERCPU_WORKERS 2
+
+#define WORKQUEUE_UNBOUND (1 << 0)
+
+typedef struct work_s work_t;
+typedef struct worker_pool_s worker_pool_t;
+typedef struct workqueue_s workqueue_t;
+
+typedef void (*work_fn_t)(work_t* work);
+
+// embed this in whatever the work needs, and use CONTAINER_OF to get back to
+// it from `fn`
+typedef struct work_s {
+    work_fn_t fn;
+    work_t* next;
+    // set from queueing until the worker picks the work up, so it can't be
+    // queued twice.  Once it's running it can be queued again.
+    _Atomic bool pending;
+    // the pool it's queued on, or NULL while it's on its way there
+    worker_pool_t* _Atomic pool;
+} work_t;
+
+// delayed work goes to the pool of whichever CPU its timer fires on.  It
+// must be cancelled with workqueue_cancel_delayed, not workqueue_cancel.
+typedef struct {
+    work_t work;
+    hpr_timer_t timer;
+    workqueue_t* wq;
+} delayed_work_t;
+
+typedef struct worker_pool_s {
+    // taken with interrupts disabled, since timers queue from the timer
+    // bottom half
+    lock_t lock;
+    work_t* head;
+    work_t* tail;
+    event_t more_work;
+    // -1 for the unbound pool
+    int64_t cpu;
+} worker_pool_t;
+
+typedef struct workqueue_s {
+    const char* name;
+    uint64_t flags;
+    // one per CPU, or just the one if unbound
+    worker_pool_t** pools;
+} workqueue_t;
+
+void work_init(work_t* work, work_fn_t fn);
+void delayed_work_init(delayed_work_t* dwork, work_fn_t fn);
+
+void workqueue_init();
+workqueue_t* workqueue_create(const char* name, uint64_t flags);
+// returns false if the work was already pending
+bool workqueue_queue(workqueue_t* wq, work_t* work);
+bool workqueue_queue_on(workqueue_t* wq, work_t* work, uint64_t cpu);
+// queue the work once `nanos` have passed
+bool workqueue_queue_delayed(workqueue_t* wq, delayed_work_t* dwork, uint64_t nanos);
+// take pending work back off its queue.  Returns false if it wasn't pending,
+// in which case it may still be running.
+bool workqueue_cancel(work_t* work);
+bool workqueue_cancel_delayed(delayed_work_t* dwork);
+
+// for work which doesn't need a queue of its own
+extern workqueue_t* system_wq;
+extern workqueue_t* system_unbound_wq;
@@ -0,0 +1,14 @@
+#pragma once
+
+// error numbers handed back to userland in thread->errno.  The values are
+// Linux's, since that's what the C libraries we build against expect.
+#define EINTR 4
+#define EIO 5
+#define EBADF 9
+#define EAGAIN 11
+#define ENOMEM 12
+#define EFAULT 14
+#define EBUSY 16
+#define EINVAL 22
+#define ENOSYS 38
+#define ETIMEDOUT 110
@@ -1,4 +1,52 @@
 #pragma once
 
+// syscall numbers, indexes into syscall_table
+#define SYSCALL_KLOG 0
+#define SYSCALL_FUTEX 1
+#define SYSCALL_IORING_SETUP 2
+#define SYSCALL_IORING_ENTER 3
+#define SYSCALL_NUM_ENTRIES 4
+
+// where the entry stub finds what it needs, as offsets from GS and into the
+// current thread.  Checked against the structs in sys/syscall.c.
+#define SYSCALL_PERCPU_CURRENT_THREAD 8
+#define SYSCALL_PERCPU_USER_RSP 32
+#define SYSCALL_THREAD_ERRNO 16
+#define SYSCALL_THREAD_KERNEL_STACK 24
+
+// the end of the lower half.  A return address at or past this can't be
+// returned to with sysret, see sys/syscall_entry.S
+#define SYSCALL_USER_ADDRESS_LIMIT 0x0000800000000000
+
+#ifndef __ASSEMBLER__
+
+#include <stdint.h>
+
+// what the entry stub saves on the thread's kernel stack, lowest address
+// first.  The callee-saved registers are left to the C code.
+typedef struct {
+    // the arguments, in the order they're passed
+    uint64_t rdi;
+    uint64_t rsi;
+    uint64_t rdx;
+    uint64_t r10;
+    uint64_t r8;
+    uint64_t r9;
+    // the syscall number
+    uint64_t rax;
+    // where syscall left userland's rip and rflags
+    uint64_t rcx;
+    uint64_t r11;
+    uint64_t rsp;
+} syscall_frame_t;
+
+// handlers take up to six arguments, and return their result.  On failure
+// they return -1 and set the thread's errno, which goes back to userland in
+// rdx.
+extern void* syscall_table[SYSCALL_NUM_ENTRIES];
+
+// the SYSCALL instruction's entry point
 void syscall_entry();
 void syscall_init();
+
+#endif
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <sys/syscall.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+// Syscall tracing, for finding out which syscalls a workload spends its
+// time in without having to attach a debugger.  There are two parts, which
+// are switched on separately:
+//
+// - statistics: how many times each syscall was made, how many failed, and
+//   a histogram of how long they took, with a bucket per power of 2 TSC
+//   cycles.  They're counted per CPU, so syscalls on different CPUs don't
+//   share any lines, and added up when /dev/syscallstat is read.  Writing
+//   "1" to it starts counting from zero, and "0" stops.
+//
+// - a strace-like record of every syscall a process makes, with its
+//   arguments, result and how long it took.  Each traced process has a ring
+//   of its own, which /dev/systrace's SYSTRACE_IOCTL_TRACE and
+//   SYSTRACE_IOCTL_UNTRACE ioctls (taking the pid) set up and take down.
+//   Reading /dev/systrace hands out whole systrace_record_t from all of
+//   them, waiting until there's at least one.  If a ring fills up before
+//   it's read, records are dropped rather than overwriting older ones, and
+//   once the ring has been emptied a record with the number
+//   SYSTRACE_DROPPED says how many, in its result.
+//
+// While neither is switched on, the syscall entry stub only pays for
+// checking syscall_trace_active.
+
+#define SYSTRACE_HISTOGRAM_BUCKETS 48
+#define SYSTRACE_RING_ENTRIES 256
+#define SYSTRACE_MAX_TRACED 16
+
+// stands in for the records which didn't fit
+#define SYSTRACE_DROPPED UINT64_MAX
+
+#define SYSTRACE_IOCTL_TRACE 0x7301
+#define SYSTRACE_IOCTL_UNTRACE 0x7302
+
+typedef struct {
+    uint64_t pid;
+    uint64_t tid;
+    uint64_t number;
+    uint64_t args[6];
+    int64_t result;
+    uint64_t errno;
+    // TSC cycles spent in the handler
+    uint64_t cycles;
+} systrace_record_t;
+
+// one syscall's counts on one CPU.  Syscall numbers which aren't in the
+// table are all counted in the last one.
+typedef struct {
+    uint64_t calls;
+    uint64_t errors;
+    uint64_t cycles;
+    uint64_t cycles_max;
+    // how many took less than 2^i cycles (and at least 2^(i-1))
+    uint64_t histogram[SYSTRACE_HISTOGRAM_BUCKETS];
+} systrace_counters_t;
+
+typedef struct {
+    systrace_counters_t syscalls[SYSCALL_NUM_ENTRIES + 1];
+} systrace_cpu_t;
+
+// non-zero while either part is switched on, which sends syscalls through
+// syscall_trace_dispatch instead of straight to their handlers
+extern _Atomic uint8_t syscall_trace_active;
+
+// called by the entry stub, with errno already cleared
+int64_t syscall_trace_dispatch(syscall_frame_t* frame);
+
+// create /dev/syscallstat and /dev/systrace
+void systrace_init();
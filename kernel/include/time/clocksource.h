@@ -0,0 +1,38 @@
+#pragma once
+
+#include <uapi/time/timepage.h>
+#include <mem/pagemap.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// The monotonic clock is the TSC, scaled to nanoseconds, as long as the CPU
+// promises it ticks at a constant rate whatever the power state (invariant
+// TSC).  Otherwise every read has to go out to the HPET, which is hundreds of
+// times slower.
+//
+// The TSC is calibrated against the HPET once at boot, and the conversion is
+// published in the time page (see uapi/time/timepage.h) under a sequence
+// count, so that readers never see half of an update.  Userland reads the
+// same page.
+
+// how long to count TSC ticks against the HPET for
+#define CLOCKSOURCE_CALIBRATION_NANOS 50000000
+
+// calibrate the TSC, once the HPET is up and before any other CPUs are
+void clocksource_init();
+// nanoseconds since the HPET was switched on
+uint64_t clocksource_read_nanos();
+// nanoseconds since the epoch
+int64_t clocksource_read_realtime();
+void clocksource_set_realtime(int64_t nanos);
+// whether the LAPIC timer can be given a TSC value to fire at, instead of a
+// count to run down
+bool clocksource_have_tsc_deadline();
+// how many TSC ticks there are in `nanos` nanoseconds, or 0 if the TSC hasn't
+// been calibrated
+uint64_t clocksource_nanos_to_tsc(uint64_t nanos);
+// map the time page (and the HPET) read-only into a user pagemap, at
+// TIME_PAGE_USER_ADDRESS
+bool clocksource_map_time_page(pagemap_t* pagemap);
+
+extern uint64_t tsc_frequency;
@@ -2,10 +2,12 @@
 
 #include <stdint.h>
 
+// we don't take any interrupts from the PIT, it's only used as a known
+// reference frequency when calibrating other timers
+
 #define PIT_DIVIDEND ((uint64_t)1193182)
 
 void pit_set_reload_value(uint16_t val);
 uint16_t pit_get_current_count();
-void pit_init();
 void pit_set_frequency(uint64_t freq);
 
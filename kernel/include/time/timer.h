@@ -1,10 +1,13 @@
 #pragma once
 
 #include <acpispec/tables.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <scheduler/event.h>
 
-#define TIMER_FREQUENCY 1000LL
+// returned by timer_next_deadline when no timers are armed
+#define TIMER_NO_DEADLINE UINT64_MAX
 
 typedef struct {
     acpi_header_t header;
@@ -38,10 +41,37 @@ typedef struct {
     int64_t tv_nsec;
 } timespec_t;
 
-typedef struct {
-    timespec_t when;
+// Armed timers are kept in a hierarchical timer wheel, one per CPU.  The
+// wheel has TIMER_WHEEL_LEVELS levels of 64 buckets each, and every level is
+// 8 times coarser than the one below it, so arming or disarming a timer is
+// constant time however many there are.  The price is precision: a timer goes
+// off on a bucket boundary at or after its deadline, up to an eighth of the
+// time it was armed for late.
+//
+// Level 0 buckets are 2^TIMER_WHEEL_TICK_SHIFT nanoseconds (about a
+// microsecond) wide, so the top level reaches a couple of minutes out.
+#define TIMER_WHEEL_TICK_SHIFT 10
+#define TIMER_WHEEL_LEVELS 8
+
+typedef struct hpr_timer_s hpr_timer_t;
+typedef struct timer_base_s timer_base_t;
+
+typedef struct hpr_timer_s {
+    // nanoseconds on the monotonic clock
+    uint64_t deadline;
+    // how much later than `deadline` the timer is allowed to go off, so that
+    // it can share a wakeup with other timers due around the same time
+    uint64_t slack;
     event_t event;
-    uint64_t index;
+    // if set, called when the timer fires instead of triggering `event`.  It
+    // runs in the timer bottom half, so it mustn't block.
+    void (*callback)(hpr_timer_t* timer);
+    // the wheel we're armed on, or NULL
+    timer_base_t* _Atomic base;
+    // where we are in it
+    uint32_t bucket;
+    hpr_timer_t* next;
+    hpr_timer_t** pprev;
     bool fired;
 } hpr_timer_t;
 
@@ -50,7 +80,28 @@ void hpet_init();
 void sleep(uint32_t millis);
 uint64_t get_ticks_per_second();
 uint64_t get_ticks();
-void timer_handler();
-
-extern timespec_t monotonic_clock;
-extern timespec_t realtime_clock;
+uint64_t hpet_get_nanos();
+// femtoseconds per HPET tick
+uint64_t hpet_get_period();
+// the physical address of the HPET's registers
+uint64_t hpet_get_address();
+uint64_t timer_get_nanos();
+timespec_t timer_get_monotonic();
+timespec_t timer_get_realtime();
+// the monotonic time at which the next timer on this CPU is due, or
+// TIMER_NO_DEADLINE.  Must be called with interrupts disabled.
+uint64_t timer_next_deadline();
+// trigger the timer's event once the monotonic clock reaches `deadline`
+// (give or take its slack), re-arming it if it's already armed.  The timer
+// goes on this CPU's wheel, or a housekeeping CPU's if this one is
+// isolated, and must stay alive until it has fired or been disarmed.
+void timer_arm(hpr_timer_t* timer, uint64_t deadline);
+// returns false if the timer has already fired (or was never armed).  Once
+// it returns, the timer is no longer being touched, so it can go out of
+// scope: if it's firing on another CPU, this waits until it's done.
+bool timer_disarm(hpr_timer_t* timer);
+// fire any timers on this CPU whose deadline has passed.  This is the timer
+// bottom half, raised by the scheduler interrupt.
+void timer_run_expired();
+// hand all of a CPU's timers to a housekeeping CPU, when it's isolated
+void timer_migrate(uint64_t cpu_number);
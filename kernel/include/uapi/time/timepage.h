@@ -0,0 +1,103 @@
+#pragma once
+
+// The time page is how userland reads the clock without a syscall.  The
+// kernel keeps the clocksource parameters in it (see time/clocksource.h),
+// and maps it read-only into every program, at the address given by the
+// TIME_PAGE_AUXV_TYPE auxiliary vector entry.  If the clock can't be read
+// from the TSC, the HPET's registers are mapped read-only on the page after
+// it.
+//
+// Like everything under uapi/, this header is shared with userland, which
+// only gets this directory on its include path.  It mustn't use anything
+// from the rest of the kernel.
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TIME_PAGE_USER_ADDRESS 0x60000000000
+#define TIME_PAGE_HPET_OFFSET 0x1000
+// where the HPET's main counter is, within its registers
+#define TIME_PAGE_HPET_COUNTER 0xf0
+// the auxiliary vector entry carrying TIME_PAGE_USER_ADDRESS, picked to be
+// well clear of anything the System V ABI defines
+#define TIME_PAGE_AUXV_TYPE 0x1000
+
+#define TIME_PAGE_SHIFT 32
+
+typedef struct {
+    // odd while the kernel is changing the parameters.  Readers retry if it's
+    // odd, or has changed by the time they've finished reading.
+    _Atomic uint32_t seq;
+    // false if the HPET has to be read instead of the TSC
+    uint32_t use_tsc;
+    // nanos = nanos_base + ((tsc - tsc_base) * mult) >> TIME_PAGE_SHIFT
+    uint64_t tsc_base;
+    uint64_t nanos_base;
+    uint64_t mult;
+    // added to the monotonic clock to get the wall clock time
+    int64_t realtime_offset;
+    // femtoseconds per HPET tick
+    uint64_t hpet_period;
+} time_page_t;
+
+static inline uint64_t time_page_rdtsc()
+{
+    uint32_t a = 0;
+    uint32_t d = 0;
+    // rdtsc on its own can be run early, ahead of whatever we're timing
+    asm volatile (
+        "lfence\n"
+        "rdtsc"
+        :   "=a" (a),
+            "=d" (d)
+        :
+        : "memory"
+    );
+    return (uint64_t)a | ((uint64_t)d << 32);
+}
+
+// the period is in femtoseconds per tick.  Split the multiplication up so it
+// can't overflow for a few centuries, without needing 128-bit division.
+static inline uint64_t time_page_hpet_nanos(uint64_t ticks, uint64_t period)
+{
+    return (ticks / 1000000) * period + ((ticks % 1000000) * period) / 1000000;
+}
+
+// read the monotonic clock in nanoseconds, and the offset from it to the wall
+// clock.  Returns false (and leaves `nanos` alone) if the clock has to be
+// read from the HPET instead.
+static inline bool time_page_read(const time_page_t* page, uint64_t* nanos, int64_t* realtime_offset)
+{
+    for (;;)
+    {
+        uint32_t seq = atomic_load_explicit(&page->seq, memory_order_acquire);
+        if (seq & 1)
+        {
+            asm volatile ("pause" ::: "memory");
+            continue;
+        }
+
+        bool use_tsc = page->use_tsc;
+        int64_t offset = page->realtime_offset;
+        uint64_t now = 0;
+        if (use_tsc)
+        {
+            uint64_t delta = time_page_rdtsc() - page->tsc_base;
+            now = page->nanos_base + (uint64_t)(((unsigned __int128)delta * page->mult) >> TIME_PAGE_SHIFT);
+        }
+
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&page->seq, memory_order_relaxed) != seq)
+        {
+            continue;
+        }
+
+        if (use_tsc)
+        {
+            *nanos = now;
+        }
+        *realtime_offset = offset;
+        return use_tsc;
+    }
+}
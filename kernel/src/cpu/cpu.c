@@ -17,6 +17,19 @@ void xsave(void* region)
     );
 }
 
+// like xsave, but skips components which haven't been modified since the
+// last xrstor from the same area, or which are in their initial state
+void xsaveopt(void* region)
+{
+    asm volatile (
+        "xsaveopt (%0)"
+        : : "r" (region),
+        "a" (0xffffffff),
+        "d" (0xffffffff)
+        : "memory"
+    );
+}
+
 void xrstor(void* region)
 {
     asm volatile (
@@ -0,0 +1,186 @@
+#include <cpu/fpu.h>
+#include <cpu/cpu.h>
+#include <cpu/smp.h>
+#include <proc/proc.h>
+#include <mem/pagemap.h>
+#include <mem/pmm.h>
+#include <mem/align.h>
+#include <lock/lock.h>
+#include <panic.h>
+#include <string.h>
+
+// offsets into the legacy (fxsave) region, which is also the start of the
+// xsave region
+#define FPU_FCW_OFFSET 0
+#define FPU_MXCSR_OFFSET 24
+// the xsave header comes straight after the legacy region
+#define FPU_XSTATE_BV_OFFSET 512
+#define FPU_XSTATE_X87 (1 << 0)
+#define FPU_XSTATE_SSE (1 << 1)
+
+typedef struct fpu_free_area_s {
+    struct fpu_free_area_s* next;
+} fpu_free_area_t;
+
+static lock_t fpu_cache_lock;
+static fpu_free_area_t* fpu_cache_free = NULL;
+
+static uint64_t fpu_area_size()
+{
+    return align_up(fpu_storage_size, FPU_STORAGE_ALIGN);
+}
+
+// the caller must hold fpu_cache_lock
+static void fpu_cache_refill()
+{
+    uint64_t size = fpu_area_size();
+    uint64_t pages = div_roundup(size * FPU_CACHE_REFILL, PAGE_SIZE);
+    uint64_t base = (uint64_t)pmm_alloc(pages) + HIGHER_HALF;
+
+    // pages are aligned much more strictly than we need, and the area size is
+    // a multiple of the alignment, so every area comes out aligned
+    for (uint64_t offset = 0; offset + size <= pages * PAGE_SIZE; offset += size)
+    {
+        fpu_free_area_t* area = (fpu_free_area_t*)(base + offset);
+        area->next = fpu_cache_free;
+        fpu_cache_free = area;
+    }
+}
+
+void* fpu_alloc_storage()
+{
+    bool ints = cpu_interrupts_disable();
+    lock_acquire(&fpu_cache_lock);
+
+    if (fpu_cache_free == NULL)
+    {
+        fpu_cache_refill();
+    }
+
+    fpu_free_area_t* area = fpu_cache_free;
+    fpu_cache_free = area->next;
+
+    lock_release(&fpu_cache_lock);
+    cpu_interrupts_restore(ints);
+
+    memset(area, 0, fpu_storage_size);
+    return area;
+}
+
+void fpu_free_storage(void* storage)
+{
+    if (storage == NULL)
+    {
+        return;
+    }
+
+    bool ints = cpu_interrupts_disable();
+    lock_acquire(&fpu_cache_lock);
+
+    fpu_free_area_t* area = storage;
+    area->next = fpu_cache_free;
+    fpu_cache_free = area;
+
+    lock_release(&fpu_cache_lock);
+    cpu_interrupts_restore(ints);
+}
+
+void fpu_init_storage(void* storage)
+{
+    uint8_t* area = storage;
+
+    // reference for the bit layout: http://web.archive.org/web/20190506231051/https://software.intel.com/en-us/articles/x87-and-sse-floating-point-assists-in-ia-32-flush-to-zero-ftz-and-denormals-are-zero-daz/
+    // we want to mask the following exceptions:
+    //      - invalid operand
+    //      - denormal operand
+    //      - divide by zero
+    //      - overflow
+    //      - underflow
+    //      - precision
+    //  (basically, all exceptions get masked)
+    // bits 6 and 7 are unused
+    // bits 8 and 9 refer to the precision control,
+    // and the upper bits for controlling infinity and rounding are left alone
+    *(uint16_t*)(area + FPU_FCW_OFFSET) = 0b1100111111;
+
+    // references:
+    // - https://help.totalview.io/previous_releases/2019/html/index.html#page/Reference_Guide/Intelx86MXSCRRegister.html
+    // the MXCSR control/status register is used for SSE operations.  The
+    // bitmask is just to basically reset everything and mask all the
+    // exceptions.
+    *(uint32_t*)(area + FPU_MXCSR_OFFSET) = 0b1111110000000;
+
+    // with xsave, components not marked as present in the header are loaded
+    // in their initial state, which would ignore the control word above
+    if (fpu_save != fxsave)
+    {
+        *(uint64_t*)(area + FPU_XSTATE_BV_OFFSET) = FPU_XSTATE_X87 | FPU_XSTATE_SSE;
+    }
+}
+
+void fpu_switch_out(thread_t* thread)
+{
+    uint64_t cr0 = read_cr0();
+
+    // TS is only ever clear while a thread's own state is in the registers,
+    // so if it's still set the thread hasn't touched the FPU and there's
+    // nothing to save
+    if ((cr0 & CR0_TS) == 0)
+    {
+        fpu_save(thread->fpu_storage);
+        write_cr0(cr0 | CR0_TS);
+    }
+}
+
+void fpu_switch_in(thread_t* thread)
+{
+    local_cpu_t* cpu = cpu_get_current();
+
+    // if nothing else has used the FPU on this CPU since the thread last
+    // did, its state is still sitting in the registers
+    if (cpu->fpu_owner == thread && thread->fpu_cpu == cpu->cpu_number)
+    {
+        asm volatile ("clts" ::: "memory");
+    }
+}
+
+void fpu_release(thread_t* thread)
+{
+    local_cpu_t* cpu = cpu_get_current();
+    if (cpu->fpu_owner == thread)
+    {
+        cpu->fpu_owner = NULL;
+        // the registers may still be live, and we won't be switching away
+        // from this thread in the usual way
+        write_cr0(read_cr0() | CR0_TS);
+    }
+    // make sure no other CPU thinks it still has our state loaded, in case
+    // the memory gets reused for another thread
+    thread->fpu_cpu = (uint64_t)-1;
+
+    fpu_free_storage(thread->fpu_storage);
+    thread->fpu_storage = NULL;
+}
+
+void fpu_handle_unavailable(__attribute__((unused)) uint32_t num, __attribute__((unused)) cpu_status_t* status)
+{
+    asm volatile ("clts" ::: "memory");
+
+    thread_t* thread = get_current_thread();
+    if (thread == NULL)
+    {
+        panic("FPU used with no thread running");
+    }
+
+    // kernel threads don't get a save area until they actually need one
+    if (thread->fpu_storage == NULL)
+    {
+        thread->fpu_storage = fpu_alloc_storage();
+        fpu_init_storage(thread->fpu_storage);
+    }
+
+    local_cpu_t* cpu = cpu_get_current();
+    fpu_restore(thread->fpu_storage);
+    cpu->fpu_owner = thread;
+    thread->fpu_cpu = cpu->cpu_number;
+}
@@ -0,0 +1,166 @@
+#include <cpu/isolation.h>
+#include <cpu/smp.h>
+#include <cpu/cpu.h>
+#include <interrupt/apic.h>
+#include <scheduler/scheduler.h>
+#include <time/timer.h>
+#include <lock/lock.h>
+#include <klog/klog.h>
+#include <string.h>
+
+static cpumask_t isolation_boot_mask;
+// serialises isolating and un-isolating CPUs, so that we can't end up with
+// every CPU isolated
+static lock_t isolation_lock;
+
+static bool isolation_is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static uint64_t isolation_parse_number(const char** s)
+{
+    uint64_t n = 0;
+    while (isolation_is_digit(**s))
+    {
+        n = n * 10 + (uint64_t)(**s - '0');
+        (*s)++;
+    }
+    return n;
+}
+
+void isolation_parse_cmdline(const char* cmdline)
+{
+    cpumask_clear_all(&isolation_boot_mask);
+    if (cmdline == NULL)
+    {
+        return;
+    }
+
+    size_t option_len = strlen(ISOLATION_CMDLINE_OPTION);
+    const char* s = cmdline;
+    while (*s != '\0')
+    {
+        // options are separated by spaces
+        if ((s == cmdline || s[-1] == ' ') && strncmp(s, ISOLATION_CMDLINE_OPTION, option_len) == 0)
+        {
+            break;
+        }
+        s++;
+    }
+    if (*s == '\0')
+    {
+        return;
+    }
+    s += option_len;
+
+    // a comma separated list of CPU numbers and ranges
+    while (isolation_is_digit(*s))
+    {
+        uint64_t first = isolation_parse_number(&s);
+        uint64_t last = first;
+        if (*s == '-')
+        {
+            s++;
+            last = isolation_parse_number(&s);
+        }
+        for (uint64_t cpu = first; cpu <= last && cpu < CPU_MAX; cpu++)
+        {
+            cpumask_set(&isolation_boot_mask, cpu);
+        }
+        if (*s != ',')
+        {
+            break;
+        }
+        s++;
+    }
+}
+
+void isolation_init()
+{
+    for (uint64_t i = 0; i < cpu_count; i++)
+    {
+        if (cpumask_test(&isolation_boot_mask, i) && !cpu_set_isolated(i, true))
+        {
+            klog("isolation", "Not isolating CPU %d, nothing would be left to run everything else", i);
+        }
+    }
+}
+
+bool cpu_set_isolated(uint64_t cpu_number, bool isolated)
+{
+    if (cpu_number >= cpu_count)
+    {
+        return false;
+    }
+    local_cpu_t* cpu = local_cpus[cpu_number];
+
+    bool ints = cpu_interrupts_disable();
+    lock_acquire(&isolation_lock);
+
+    if (isolated)
+    {
+        bool have_housekeeping = false;
+        for (uint64_t i = 0; i < cpu_count; i++)
+        {
+            if (i != cpu_number && !atomic_load(&local_cpus[i]->isolated))
+            {
+                have_housekeeping = true;
+                break;
+            }
+        }
+        if (!have_housekeeping)
+        {
+            lock_release(&isolation_lock);
+            cpu_interrupts_restore(ints);
+            return false;
+        }
+    }
+
+    atomic_store(&cpu->isolated, isolated);
+    lock_release(&isolation_lock);
+
+    klog("isolation", "CPU %d is %s", cpu_number, isolated ? "isolated" : "no longer isolated");
+
+    io_apic_reroute();
+    if (isolated)
+    {
+        timer_migrate(cpu_number);
+    }
+
+    // let the scheduler there move off anything that isn't pinned (or take
+    // back its tick)
+    if (atomic_load(&scheduler_ready))
+    {
+        lapic_send_ipi(cpu->lapic_id, scheduler_vector);
+    }
+
+    cpu_interrupts_restore(ints);
+    return true;
+}
+
+uint32_t isolation_irq_target(uint32_t lapic_id)
+{
+    local_cpu_t* fallback = NULL;
+    for (uint64_t i = 0; i < cpu_count; i++)
+    {
+        if (local_cpus[i]->lapic_id == lapic_id)
+        {
+            if (!atomic_load(&local_cpus[i]->isolated))
+            {
+                return lapic_id;
+            }
+        }
+        else if (fallback == NULL && !atomic_load(&local_cpus[i]->isolated))
+        {
+            fallback = local_cpus[i];
+        }
+    }
+
+    if (fallback == NULL)
+    {
+        // either we don't know this CPU, or everything's isolated
+        return lapic_id;
+    }
+    return fallback->lapic_id;
+}
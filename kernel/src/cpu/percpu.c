@@ -0,0 +1,40 @@
+#include <cpu/percpu.h>
+#include <mem/pmm.h>
+#include <mem/align.h>
+#include <panic.h>
+#include <string.h>
+
+// the .percpu copy goes straight after the local_cpu_t.  The linker script
+// lines the template up on a cache line, so this keeps everything in it at
+// the same alignment.
+static uint64_t percpu_header_size()
+{
+    return align_up(sizeof(local_cpu_t), CACHE_LINE_SIZE);
+}
+
+uint64_t percpu_area_size()
+{
+    return align_up(percpu_header_size() + (percpu_end - percpu_start), PAGE_SIZE);
+}
+
+local_cpu_t* percpu_area_alloc(uint64_t cpu_number)
+{
+    // whole pages, so the area doesn't share any lines with whatever else
+    // malloc would have put next to it
+    void* phys = pmm_alloc(percpu_area_size() / PAGE_SIZE);
+    if (phys == NULL)
+    {
+        panic("Out of memory for CPU %d's per-CPU area", cpu_number);
+    }
+
+    uint8_t* area = (uint8_t*)phys + HIGHER_HALF;
+    uint8_t* copy = area + percpu_header_size();
+    memcpy(copy, percpu_start, percpu_end - percpu_start);
+
+    // pmm_alloc has zeroed the rest
+    local_cpu_t* cpu = (local_cpu_t*)area;
+    cpu->cpu_number = cpu_number;
+    cpu->self = cpu;
+    cpu->percpu_offset = copy - percpu_start;
+    return cpu;
+}
@@ -1,4 +1,5 @@
 #include <cpu/smp.h>
+#include <cpu/percpu.h>
 #include <stddef.h>
 #include <klog/klog.h>
 #include <stdatomic.h>
@@ -8,10 +9,12 @@
 #include <mem/pagemap.h>
 #include <mem/vmm.h>
 #include <mem/pmm.h>
+#include <cpu/fpu.h>
 #include <math/si.h>
 #include <cpu/msr.h>
 #include <sys/syscall.h>
 #include <cpu/cpu.h>
+#include <cpu/topology.h>
 #include <scheduler/scheduler.h>
 #include <interrupt/apic.h>
 #include <time/pit.h>
@@ -34,20 +37,26 @@ void smp_init(struct limine_smp_response* smp_response)
     struct limine_smp_info** smp_info_array = smp_response->cpus;
     bsp_lapic_id = smp_response->bsp_lapic_id;
 
-    local_cpus = (local_cpu_t**) malloc(sizeof(local_cpu_t*) * smp_response->cpu_count);
     cpu_count = smp_response->cpu_count;
+    if (cpu_count > CPU_MAX)
+    {
+        // the rest just stay parked
+        klog("smp", "Only bringing up the first %d CPUs", CPU_MAX);
+        cpu_count = CPU_MAX;
+    }
+    local_cpus = (local_cpu_t**) malloc(sizeof(local_cpu_t*) * cpu_count);
 
-    for (uint64_t i = 0; i < smp_response->cpu_count; i++)
+    for (uint64_t i = 0; i < cpu_count; i++)
     {
         klog("smp", "Bringing cpu %d online", i);
-        local_cpu_t* local_cpu = malloc(sizeof(local_cpu_t));
+        local_cpu_t* local_cpu = percpu_area_alloc(i);
         local_cpus[i] = local_cpu;
 
         struct limine_smp_info* smp_info = smp_info_array[i];
 
         smp_info->extra_argument = (uint64_t)local_cpu;
 
-        local_cpu->cpu_number = i;
+        local_cpu->run_queue.current_priority = SCHED_PRIORITY_IDLE;
 
         // don't stall the current CPU, we still need it to finish booting!
         if (smp_info->lapic_id == smp_response->bsp_lapic_id)
@@ -94,20 +103,28 @@ void cpu_init(struct limine_smp_info* smp_info)
     uint64_t* sched_stack = (uint64_t*)((uint64_t)sched_stack_phys + stack_size + HIGHER_HALF);
     local_cpu->tss.ist1 = (uint64_t) sched_stack;
 
+    // idling on the scheduler's stack would leave anything that interrupts
+    // the idle loop there too, to be trampled by the next scheduler interrupt
+    void* idle_stack_phys = pmm_alloc(stack_size / PAGE_SIZE);
+    local_cpu->idle_stack = (uint64_t)idle_stack_phys + stack_size + HIGHER_HALF;
+
     // TODO: a lot of magic numbers in this code, which was ported from VINIX.
     // gotta figure out what they're doing and move them to macros
 
     // enable syscall
-    uint64_t efer = rdmsr(0xc0000080);
-    efer |= 1;
-    wrmsr(0xc0000080, efer);
-    wrmsr(0xc0000081, 0x0033002800000000);
+    uint64_t efer = rdmsr(MSR_EFER);
+    efer |= EFER_SCE;
+    wrmsr(MSR_EFER, efer);
+    // the kernel's segments start at 0x28, and sysret finds userland's 16
+    // (code) and 8 (stack) bytes past 0x33
+    wrmsr(MSR_STAR, 0x0033002800000000);
 
     // entry address
-    wrmsr(0xc0000082, (uint64_t)((void*)syscall_entry));
+    wrmsr(MSR_LSTAR, (uint64_t)((void*)syscall_entry));
 
-    // flags mask
-    wrmsr(0x00000084, (uint64_t)~((uint32_t)0x002));
+    // flags cleared on entry.  Interrupts stay off until the entry stub is
+    // on the kernel stack.
+    wrmsr(MSR_FMASK, RFLAGS_TF | RFLAGS_IF | RFLAGS_DF | RFLAGS_NT | RFLAGS_AC);
 
     // enable PAT (write-combining/write-protect)
     uint64_t pat_msr = rdmsr(0x277);
@@ -115,8 +132,9 @@ void cpu_init(struct limine_smp_info* smp_info)
     pat_msr |= ((uint64_t) 0x0105) << 32;
     wrmsr(0x277, pat_msr);
 
-    set_gs_base((uint64_t) &local_cpu->cpu_number);
-    set_kernel_gs_base((uint64_t) &local_cpu->cpu_number);
+    // from here on, GS always points at our area while we're in the kernel
+    set_gs_base((uint64_t) local_cpu);
+    set_kernel_gs_base((uint64_t) local_cpu);
 
     // enable sse/sse2
     uint64_t cr0 = read_cr0();
@@ -185,6 +203,16 @@ void cpu_init(struct limine_smp_info* smp_info)
         fpu_storage_size = (uint64_t) c;
         fpu_save = xsave;
         fpu_restore = xrstor;
+
+        success = cpu_id(0xd, 1, &a, &b, &c, &d);
+        if (success && ((a & CPUID_XSAVEOPT) != 0))
+        {
+            if (cpu_number == 0)
+            {
+                klog("fpu", "Using xsaveopt");
+            }
+            fpu_save = xsaveopt;
+        }
     }
     else
     {
@@ -197,11 +225,16 @@ void cpu_init(struct limine_smp_info* smp_info)
         fpu_restore = fxrstor;
     }
 
+    // nobody's FPU state is loaded yet, so trap the first time it's used
+    write_cr0(read_cr0() | CR0_TS);
+
     lapic_enable(0xff);
     asm volatile ( "sti" );
 
     lapic_timer_calibrate(local_cpu);
 
+    topology_detect(&local_cpu->topology);
+
     klog("smp", "CPU %d online!", cpu_number);
 
     atomic_fetch_add(&local_cpu->online, 1);
@@ -215,17 +248,13 @@ void cpu_init(struct limine_smp_info* smp_info)
 
 local_cpu_t* cpu_get_current()
 {
-    bool ints = cpu_interrupt_state();
-    if(ints)
+    // with preemption enabled, we could be moved to another CPU as soon as
+    // we've read it
+    if (cpu_interrupt_state() && preempt_count() == 0)
     {
-        klog("smp", "Attempted to get current CPU struct without disabling interrupts");
+        klog("smp", "Attempted to get current CPU struct without disabling interrupts or preemption");
         panic("Fetching current CPU without disabling interrupts is dangerous!");
     }
 
-    uint64_t cpu_number = 0;
-    asm volatile (
-        "movq %%gs:[0], %0"
-        : "=r" (cpu_number)
-    );
-    return local_cpus[cpu_number];
+    return this_cpu_read(self);
 }
@@ -0,0 +1,130 @@
+#include <cpu/topology.h>
+#include <cpu/cpu.h>
+#include <klog/klog.h>
+
+#include <stdbool.h>
+
+// CPUID leaf 1
+#define CPUID_HTT (1 << 28)
+// CPUID leaf 4 / 0x8000001d cache types
+#define CACHE_TYPE_NULL 0
+// don't trust CPUID (or a hypervisor) to ever end a list of levels/caches
+#define TOPOLOGY_MAX_SUBLEAVES 16
+
+// number of bits needed to give `count` things a unique id each
+static uint32_t topology_bits(uint32_t count)
+{
+    uint32_t bits = 0;
+    while (((uint32_t)1 << bits) < count)
+    {
+        bits++;
+    }
+    return bits;
+}
+
+// walk the levels of an extended topology leaf (0xb or 0x1f), which give us
+// how many bits of the x2APIC id each level takes up.  Returns false if the
+// leaf isn't supported.
+static bool topology_walk_leaf(uint32_t leaf, uint32_t* x2apic_id, uint32_t* smt_shift, uint32_t* package_shift)
+{
+    uint32_t a = 0, b = 0, c = 0, d = 0;
+    if (!cpu_id(leaf, 0, &a, &b, &c, &d) || b == 0)
+    {
+        return false;
+    }
+
+    *x2apic_id = d;
+    *smt_shift = 0;
+    *package_shift = 0;
+    for (uint32_t subleaf = 0; subleaf < TOPOLOGY_MAX_SUBLEAVES; subleaf++)
+    {
+        cpu_id(leaf, subleaf, &a, &b, &c, &d);
+        uint32_t type = (c >> 8) & 0xff;
+        if (type == TOPOLOGY_LEVEL_INVALID)
+        {
+            break;
+        }
+
+        uint32_t shift = a & 0x1f;
+        if (type == TOPOLOGY_LEVEL_SMT)
+        {
+            *smt_shift = shift;
+        }
+        // whatever the outermost level is (core, module, tile, die), the
+        // bits above it are the package
+        *package_shift = shift;
+    }
+    return true;
+}
+
+// how many bits of the APIC id are shared by CPUs on the same last level
+// cache, from the deterministic cache parameters leaf (4 on Intel,
+// 0x8000001d on AMD).  Returns false if the leaf isn't supported.
+static bool topology_llc_shift(uint32_t leaf, uint32_t* llc_shift)
+{
+    uint32_t a = 0, b = 0, c = 0, d = 0;
+    uint32_t best_level = 0;
+    for (uint32_t subleaf = 0; subleaf < TOPOLOGY_MAX_SUBLEAVES; subleaf++)
+    {
+        if (!cpu_id(leaf, subleaf, &a, &b, &c, &d))
+        {
+            break;
+        }
+        if ((a & 0x1f) == CACHE_TYPE_NULL)
+        {
+            break;
+        }
+
+        uint32_t level = (a >> 5) & 0x7;
+        if (level > best_level)
+        {
+            best_level = level;
+            *llc_shift = topology_bits(((a >> 14) & 0xfff) + 1);
+        }
+    }
+    return best_level != 0;
+}
+
+void topology_detect(cpu_topology_t* topology)
+{
+    uint32_t a = 0, b = 0, c = 0, d = 0;
+    uint32_t x2apic_id = 0;
+    uint32_t smt_shift = 0;
+    uint32_t package_shift = 0;
+
+    // 0x1f is a superset of 0xb which knows about dies and modules, so
+    // prefer it where it's available
+    if (!topology_walk_leaf(0x1f, &x2apic_id, &smt_shift, &package_shift)
+        && !topology_walk_leaf(0xb, &x2apic_id, &smt_shift, &package_shift))
+    {
+        // very old CPU, all we can find out is how many logical CPUs share
+        // the package, so treat each one as its own core
+        cpu_id(1, 0, &a, &b, &c, &d);
+        x2apic_id = b >> 24;
+        if (d & CPUID_HTT)
+        {
+            package_shift = topology_bits((b >> 16) & 0xff);
+        }
+    }
+
+    uint32_t llc_shift = package_shift;
+    if (!topology_llc_shift(4, &llc_shift))
+    {
+        topology_llc_shift(0x8000001d, &llc_shift);
+    }
+    // a cache can't be shared across packages, whatever CPUID tells us
+    if (llc_shift > package_shift)
+    {
+        llc_shift = package_shift;
+    }
+
+    topology->x2apic_id = x2apic_id;
+    topology->package_id = x2apic_id >> package_shift;
+    topology->core_id = x2apic_id >> smt_shift;
+    topology->smt_id = x2apic_id & (((uint32_t)1 << smt_shift) - 1);
+    topology->llc_id = x2apic_id >> llc_shift;
+
+    klog("topology", "x2APIC %d: package %d, core %d, thread %d, LLC %d",
+        topology->x2apic_id, topology->package_id, topology->core_id,
+        topology->smt_id, topology->llc_id);
+}
@@ -0,0 +1,132 @@
+#include <debug/ksym.h>
+#include <elf/elf.h>
+#include <klog/klog.h>
+#include <mem/malloc.h>
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    uint64_t addr;
+    uint64_t size;
+    const char* name;
+} ksym_t;
+
+// every function, sorted by address
+static ksym_t* ksyms = NULL;
+static uint64_t ksym_count = 0;
+
+static int ksym_compare(const void* a, const void* b)
+{
+    uint64_t addr_a = ((const ksym_t*)a)->addr;
+    uint64_t addr_b = ((const ksym_t*)b)->addr;
+    return addr_a < addr_b ? -1 : addr_a > addr_b;
+}
+
+// the symbols are at their link addresses, which the bootloader may have
+// moved us from
+static uint64_t ksym_link_base(uint8_t* file, elf_header_t* header)
+{
+    uint64_t base = UINT64_MAX;
+    for (uint64_t i = 0; i < header->prog_header_num_entries; i++)
+    {
+        elf_program_header_t* ph = (elf_program_header_t*)(file + header->program_header_offset
+            + header->prog_header_entry_size * i);
+        if (ph->type == ELF_PTYPE_LOAD && ph->vaddr < base)
+        {
+            base = ph->vaddr;
+        }
+    }
+    return base;
+}
+
+void ksym_init(struct limine_file* kernel_file, uint64_t virtual_base)
+{
+    uint8_t* file = kernel_file->address;
+    elf_header_t* header = (elf_header_t*)file;
+    if (memcmp(header->ident, "\x7f" "ELF", 4) != 0)
+    {
+        klog("ksym", "Kernel file isn't an ELF file, no symbols");
+        return;
+    }
+
+    elf_section_header_t* symtab = NULL;
+    for (uint64_t i = 0; i < header->sect_header_num_entries; i++)
+    {
+        elf_section_header_t* sh = (elf_section_header_t*)(file + header->section_header_offset
+            + header->sect_header_entry_size * i);
+        if (sh->type == ELF_SECTION_SYMTAB)
+        {
+            symtab = sh;
+            break;
+        }
+    }
+    if (symtab == NULL || symtab->link >= header->sect_header_num_entries)
+    {
+        klog("ksym", "Kernel has been stripped, no symbols");
+        return;
+    }
+
+    elf_section_header_t* strtab = (elf_section_header_t*)(file + header->section_header_offset
+        + header->sect_header_entry_size * symtab->link);
+    const char* names = (const char*)(file + strtab->offset);
+    elf_symbol_t* symbols = (elf_symbol_t*)(file + symtab->offset);
+    uint64_t symbol_count = symtab->size / sizeof(elf_symbol_t);
+    uint64_t slide = virtual_base - ksym_link_base(file, header);
+
+    uint64_t count = 0;
+    for (uint64_t i = 0; i < symbol_count; i++)
+    {
+        if (ELF_SYMBOL_TYPE(symbols[i].info) == ELF_SYMBOL_FUNC && symbols[i].value != 0)
+            count++;
+    }
+
+    ksyms = malloc(sizeof(ksym_t) * count);
+    for (uint64_t i = 0; i < symbol_count; i++)
+    {
+        elf_symbol_t* sym = &symbols[i];
+        if (ELF_SYMBOL_TYPE(sym->info) != ELF_SYMBOL_FUNC || sym->value == 0)
+            continue;
+
+        // the names stay in the file, which is never freed
+        ksyms[ksym_count++] = (ksym_t){
+            .addr = sym->value + slide,
+            .size = sym->size,
+            .name = names + sym->name,
+        };
+    }
+    qsort(ksyms, ksym_count, sizeof(ksym_t), ksym_compare);
+
+    klog("ksym", "Loaded %d kernel symbols", ksym_count);
+}
+
+const char* ksym_lookup(uint64_t addr, uint64_t* offset)
+{
+    if (ksym_count == 0 || addr < ksyms[0].addr)
+    {
+        return NULL;
+    }
+
+    // find the last function starting at or before addr
+    uint64_t lo = 0;
+    uint64_t hi = ksym_count;
+    while (hi - lo > 1)
+    {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (ksyms[mid].addr <= addr)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    ksym_t* sym = &ksyms[lo];
+    // a size of 0 usually means an assembly label, which runs up to wherever
+    // the next one starts
+    if (sym->size != 0 && addr >= sym->addr + sym->size)
+    {
+        return NULL;
+    }
+    *offset = addr - sym->addr;
+    return sym->name;
+}
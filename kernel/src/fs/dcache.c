@@ -0,0 +1,203 @@
+#include <fs/dcache.h>
+#include <lock/lock.h>
+#include <macro.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+static dcache_entry_t* _Atomic dcache_buckets[DCACHE_HASH_SIZE];
+
+// held while entries are added or taken out.  Lookups don't take it.
+static lock_t dcache_lock;
+static dcache_entry_t* dcache_lru_head = NULL;
+static dcache_entry_t* dcache_lru_tail = NULL;
+static size_t dcache_count = 0;
+// bumped by every invalidation.  A lookup which missed only adds what it
+// found if this hasn't moved since it started, or it could put back
+// something that was invalidated while it was looking.
+static _Atomic uint64_t dcache_seq = 0;
+
+static dcache_entry_t* _Atomic* dcache_bucket(vfs_children_t* dir, uint64_t hash)
+{
+    uint64_t key = hash ^ ((uint64_t)dir >> 4);
+    return &dcache_buckets[(key * 0x9e3779b97f4a7c15ull) >> (64 - DCACHE_HASH_BITS)];
+}
+
+static void dcache_entry_free(rcu_head_t* head)
+{
+    free(CONTAINER_OF(head, dcache_entry_t, rcu));
+}
+
+// all of these expect dcache_lock to be held
+static void dcache_lru_unlink(dcache_entry_t* entry)
+{
+    if (entry->lru_prev != NULL)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        dcache_lru_head = entry->lru_next;
+    if (entry->lru_next != NULL)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        dcache_lru_tail = entry->lru_prev;
+}
+
+static void dcache_lru_push(dcache_entry_t* entry)
+{
+    entry->lru_prev = NULL;
+    entry->lru_next = dcache_lru_head;
+    if (dcache_lru_head != NULL)
+        dcache_lru_head->lru_prev = entry;
+    else
+        dcache_lru_tail = entry;
+    dcache_lru_head = entry;
+}
+
+static void dcache_remove(dcache_entry_t* entry)
+{
+    dcache_entry_t* _Atomic* link = dcache_bucket(entry->dir, entry->hash);
+    while (atomic_load_explicit(link, memory_order_relaxed) != entry)
+    {
+        link = &atomic_load_explicit(link, memory_order_relaxed)->next;
+    }
+    // readers already on the entry can carry on down the chain from it
+    atomic_store_explicit(link, atomic_load_explicit(&entry->next, memory_order_relaxed), memory_order_release);
+    dcache_lru_unlink(entry);
+    dcache_count--;
+    call_rcu(&entry->rcu, dcache_entry_free);
+}
+
+// make room by taking out the least recently used entry, giving the ones
+// which have been used since they were last looked at here another go
+static void dcache_evict()
+{
+    while (dcache_lru_tail != NULL)
+    {
+        dcache_entry_t* entry = dcache_lru_tail;
+        if (atomic_exchange_explicit(&entry->referenced, false, memory_order_relaxed))
+        {
+            dcache_lru_unlink(entry);
+            dcache_lru_push(entry);
+            continue;
+        }
+        dcache_remove(entry);
+        return;
+    }
+}
+
+static bool dcache_matches(dcache_entry_t* entry, vfs_children_t* dir, const char* name, size_t length, uint64_t hash)
+{
+    return entry->dir == dir && entry->hash == hash && entry->length == length
+        && memcmp(entry->name, name, length) == 0;
+}
+
+static void dcache_insert(vfs_children_t* dir, const char* name, size_t length, uint64_t hash,
+    vfs_node_t* node, uint64_t seq)
+{
+    dcache_entry_t* entry = malloc(sizeof(dcache_entry_t));
+    if (entry == NULL)
+    {
+        return;
+    }
+    entry->dir = dir;
+    entry->hash = hash;
+    entry->length = length;
+    memcpy(entry->name, name, length);
+    entry->node = node;
+
+    lock_acquire(&dcache_lock);
+    dcache_entry_t* _Atomic* bucket = dcache_bucket(dir, hash);
+    bool stale = atomic_load(&dcache_seq) != seq;
+    // someone else may have looked the same name up in the meantime
+    for (dcache_entry_t* other = atomic_load_explicit(bucket, memory_order_relaxed);
+        other != NULL && !stale;
+        other = atomic_load_explicit(&other->next, memory_order_relaxed))
+    {
+        stale = dcache_matches(other, dir, name, length, hash);
+    }
+    if (stale)
+    {
+        lock_release(&dcache_lock);
+        free(entry);
+        return;
+    }
+
+    if (dcache_count >= DCACHE_MAX_ENTRIES)
+    {
+        dcache_evict();
+    }
+    atomic_store_explicit(&entry->next, atomic_load_explicit(bucket, memory_order_relaxed), memory_order_relaxed);
+    atomic_store_explicit(bucket, entry, memory_order_release);
+    dcache_lru_push(entry);
+    dcache_count++;
+    lock_release(&dcache_lock);
+}
+
+vfs_node_t* dcache_lookup(vfs_node_t* dir, const char* name, size_t length, uint64_t hash)
+{
+    vfs_children_t* children = dir->children;
+    if (children == NULL)
+    {
+        // not a directory
+        return NULL;
+    }
+
+    rcu_read_lock();
+    for (dcache_entry_t* entry = rcu_dereference(*dcache_bucket(children, hash));
+        entry != NULL;
+        entry = rcu_dereference(entry->next))
+    {
+        if (dcache_matches(entry, children, name, length, hash))
+        {
+            if (!atomic_load_explicit(&entry->referenced, memory_order_relaxed))
+            {
+                atomic_store_explicit(&entry->referenced, true, memory_order_relaxed);
+            }
+            // nodes are never freed, so this is still good once we're out
+            vfs_node_t* node = entry->node;
+            rcu_read_unlock();
+            return node;
+        }
+    }
+
+    uint64_t seq = atomic_load(&dcache_seq);
+    vfs_node_t* node = node_get_child_hashed(dir, name, length, hash);
+    if (node != NULL)
+    {
+        node = reduce_node(node, false);
+    }
+    rcu_read_unlock();
+
+    if (length <= DCACHE_NAME_MAX)
+    {
+        dcache_insert(children, name, length, hash, node, seq);
+    }
+    return node;
+}
+
+void dcache_invalidate(vfs_children_t* dir, const char* name, size_t length, uint64_t hash)
+{
+    lock_acquire(&dcache_lock);
+    atomic_fetch_add(&dcache_seq, 1);
+    dcache_entry_t* entry = atomic_load_explicit(dcache_bucket(dir, hash), memory_order_relaxed);
+    while (entry != NULL)
+    {
+        dcache_entry_t* next = atomic_load_explicit(&entry->next, memory_order_relaxed);
+        if (dcache_matches(entry, dir, name, length, hash))
+        {
+            dcache_remove(entry);
+        }
+        entry = next;
+    }
+    lock_release(&dcache_lock);
+}
+
+void dcache_flush()
+{
+    lock_acquire(&dcache_lock);
+    atomic_fetch_add(&dcache_seq, 1);
+    while (dcache_lru_head != NULL)
+    {
+        dcache_remove(dcache_lru_head);
+    }
+    lock_release(&dcache_lock);
+}
@@ -73,9 +73,9 @@ vfs_node_t* devtmpfs_create_node(filesystem_t* _self, vfs_node_t* parent, const
     new_resource->resource.stat.mode = mode;
     new_resource->resource.stat.nlink = 1;
 
-    new_resource->resource.stat.accessed_time = realtime_clock;
-    new_resource->resource.stat.created_time = realtime_clock;
-    new_resource->resource.stat.modified_time = realtime_clock;
+    new_resource->resource.stat.accessed_time = timer_get_realtime();
+    new_resource->resource.stat.created_time = timer_get_realtime();
+    new_resource->resource.stat.modified_time = timer_get_realtime();
     
     new_node->resource = (resource_t*)new_resource;
 
@@ -98,9 +98,9 @@ vfs_node_t* devtmpfs_symlink(filesystem_t* _self, vfs_node_t* parent, const char
     new_resource->resource.stat.mode = STAT_IFLNK | 0777;
     new_resource->resource.stat.nlink = 1;
 
-    new_resource->resource.stat.accessed_time = realtime_clock;
-    new_resource->resource.stat.created_time = realtime_clock;
-    new_resource->resource.stat.modified_time = realtime_clock;
+    new_resource->resource.stat.accessed_time = timer_get_realtime();
+    new_resource->resource.stat.created_time = timer_get_realtime();
+    new_resource->resource.stat.modified_time = timer_get_realtime();
 
     new_node->resource = (resource_t*) new_resource;
 
@@ -128,16 +128,18 @@ void devtmpfs_close(filesystem_t* self)
 
 void devtmpfs_add_device(resource_t* device, const char* name)
 {
-    vfs_node_t* new_node = vfs_create_node(filesystems[FS_DEVTMPFS], devtmpfs_root, name, false);
+    vfs_node_t* new_node = vfs_create_node(fs_get_filesystem(FS_DEVTMPFS), devtmpfs_root, name, false);
 
     new_node->resource = device;
     new_node->resource->stat.device = devtmpfs_dev_id;
     new_node->resource->stat.inode = devtmpfs_inode_counter++;
     new_node->resource->stat.nlink = 1;
 
-    new_node->resource->stat.accessed_time = realtime_clock;
-    new_node->resource->stat.created_time = realtime_clock;
-    new_node->resource->stat.modified_time = realtime_clock;
+    new_node->resource->stat.accessed_time = timer_get_realtime();
+    new_node->resource->stat.created_time = timer_get_realtime();
+    new_node->resource->stat.modified_time = timer_get_realtime();
 
+    mutex_acquire(&vfs_lock);
     vfs_add_child(devtmpfs_root, new_node);
+    mutex_release(&vfs_lock);
 }
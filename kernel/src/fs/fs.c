@@ -1,68 +1,214 @@
 #include <fs/fs.h>
 #include <fs/tmpfs.h>
 #include <fs/devtmpfs.h>
-#include <lock/lock.h>
+#include <fs/dcache.h>
+#include <lock/mutex.h>
+#include <lock/rcu.h>
 #include <klog/klog.h>
 #include <debug/debug.h>
+#include <macro.h>
 
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 
-lock_t vfs_lock;
+// held while the tree or the filesystem table is changed.  Lookups don't
+// take it, they're RCU readers.  Creating a node can go as far as
+// allocating its storage, so waiters sleep rather than spin.
+mutex_t vfs_lock;
 vfs_node_t* vfs_root;
-filesystem_t** filesystems;
-size_t num_filesystems;
+filesystem_table_t* filesystems;
+
+// left in a slot whose child has been removed.  Lookups carry on past it,
+// since whatever they're after may have been put further along.
+#define VFS_CHILD_REMOVED ((vfs_node_t*)1)
+
+static path2node_return_t path_walk(vfs_node_t* parent, const char* path, bool want_basename);
+
+static vfs_child_table_t* vfs_child_table_alloc(size_t capacity)
+{
+    vfs_child_table_t* table = malloc(sizeof(vfs_child_table_t) + sizeof(vfs_node_t*) * capacity);
+    table->mask = capacity - 1;
+    return table;
+}
+
+static void vfs_child_table_free(rcu_head_t* head)
+{
+    free(CONTAINER_OF(head, vfs_child_table_t, rcu));
+}
+
+static void filesystem_table_free(rcu_head_t* head)
+{
+    free(CONTAINER_OF(head, filesystem_table_t, rcu));
+}
 
 vfs_node_t* vfs_create_node(filesystem_t* filesystem, vfs_node_t* parent, const char* name, bool dir)
 {
     vfs_node_t* node = malloc(sizeof(vfs_node_t));
 
     // copy the name into the name field, so we know this node "owns" its own memory
-    node->name = malloc(strlen(name)+1);
-    memcpy(node->name, name, strlen(name));
+    node->name_length = strlen(name);
+    node->name_hash = vfs_name_hash(name, node->name_length);
+    node->name = malloc(node->name_length + 1);
+    memcpy(node->name, name, node->name_length);
 
     node->parent = parent;
     node->mountpoint = NULL;
     node->redir = NULL;
     node->children = NULL;
-    node->children_count = -1;
     node->resource = malloc(sizeof(resource_t));
     node->filesystem = filesystem;
 
     if(dir)
     {
-        // pre-allocate the first child -- adding children should always
-        // populate the current node, and pre-allocate the next node 
-        node->children = malloc(sizeof(vfs_node_t));
-        node->children_count = 0;
+        node->children = malloc(sizeof(vfs_children_t));
+        node->children->table = vfs_child_table_alloc(VFS_CHILDREN_INITIAL_CAPACITY);
     }
 
 
     return node;
 }
 
+// FNV-1a
+uint64_t vfs_name_hash(const char* name, size_t length)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= (uint8_t)name[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// put a node in the first free slot along its probe sequence, which may be
+// one a removed child left.  There must be one.  Returns true if it was
+// empty.
+static bool vfs_child_table_insert(vfs_child_table_t* table, vfs_node_t* node)
+{
+    size_t i = node->name_hash & table->mask;
+    for (;;)
+    {
+        vfs_node_t* slot = atomic_load_explicit(&table->slots[i], memory_order_relaxed);
+        if (slot == NULL || slot == VFS_CHILD_REMOVED)
+        {
+            // readers stop at the first empty slot, so the node has to be
+            // filled in before it's seen
+            atomic_store_explicit(&table->slots[i], node, memory_order_release);
+            return slot == NULL;
+        }
+        i = (i + 1) & table->mask;
+    }
+}
+
 void vfs_add_child(vfs_node_t* parent, vfs_node_t* new_child)
 {
-    // the last node is already pre-allocated for us, so just copy the new child in
-    parent->children[parent->children_count] = *new_child;
-    parent->children_count++;
-    // pre-allocate the next child
-    parent->children = realloc(parent->children, sizeof(vfs_node_t*) * (parent->children_count + 1));
+    vfs_children_t* children = parent->children;
+    vfs_child_table_t* table = children->table;
+    size_t capacity = table->mask + 1;
+
+    // keeping a quarter of the slots empty keeps the probe sequences short
+    if ((children->count + 1) * 4 > capacity * 3)
+    {
+        size_t live = 0;
+        for (size_t i = 0; i < capacity; i++)
+        {
+            vfs_node_t* node = atomic_load_explicit(&table->slots[i], memory_order_relaxed);
+            live += node != NULL && node != VFS_CHILD_REMOVED;
+        }
+        // if it's mostly removed children, the same size will do
+        size_t new_capacity = (live + 1) * 2 > capacity ? capacity * 2 : capacity;
+
+        // readers may be probing the old table, so it can only be freed
+        // once they're done
+        vfs_child_table_t* bigger = vfs_child_table_alloc(new_capacity);
+        for (size_t i = 0; i < capacity; i++)
+        {
+            vfs_node_t* node = atomic_load_explicit(&table->slots[i], memory_order_relaxed);
+            if (node != NULL && node != VFS_CHILD_REMOVED)
+            {
+                vfs_child_table_insert(bigger, node);
+            }
+        }
+        rcu_assign_pointer(children->table, bigger);
+        call_rcu(&table->rcu, vfs_child_table_free);
+        table = bigger;
+        children->count = live;
+    }
+
+    if (vfs_child_table_insert(table, new_child))
+    {
+        children->count++;
+    }
+    dcache_invalidate(children, new_child->name, new_child->name_length, new_child->name_hash);
+}
+
+void vfs_remove_child(vfs_node_t* parent, vfs_node_t* child)
+{
+    vfs_children_t* children = parent->children;
+    vfs_child_table_t* table = children->table;
+    for (size_t i = child->name_hash & table->mask; ; i = (i + 1) & table->mask)
+    {
+        vfs_node_t* slot = atomic_load_explicit(&table->slots[i], memory_order_relaxed);
+        if (slot == NULL)
+        {
+            return;
+        }
+        if (slot == child)
+        {
+            // still counted, until the table is next rebuilt
+            atomic_store_explicit(&table->slots[i], VFS_CHILD_REMOVED, memory_order_release);
+            break;
+        }
+    }
+    dcache_invalidate(children, child->name, child->name_length, child->name_hash);
 }
 
 void fs_init()
 {
    vfs_root = vfs_create_node(NULL, NULL, "", false);
 
-   filesystems = malloc(sizeof(filesystem_t*) * KERNEL_FILESYSTEM_COUNT); 
-   filesystems[FS_TMPFS] = tmpfs_create();
+   filesystems = malloc(sizeof(filesystem_table_t) + sizeof(filesystem_t*) * KERNEL_FILESYSTEM_COUNT);
+   filesystems->count = KERNEL_FILESYSTEM_COUNT;
+   filesystems->filesystems[FS_TMPFS] = tmpfs_create();
 
-   filesystems[FS_DEVTMPFS] = devtmpfs_create();
+   filesystems->filesystems[FS_DEVTMPFS] = devtmpfs_create();
 
-   num_filesystems += 2; 
    // todo: finish implementing ext2 support 
-   //filesystems[FS_EXT2] = ext2_init();
+   //filesystems->filesystems[FS_EXT2] = ext2_init();
+}
+
+hpr_fsid_t fs_register(filesystem_t* filesystem)
+{
+    mutex_acquire(&vfs_lock);
+
+    filesystem_table_t* old = filesystems;
+    filesystem_table_t* table = malloc(sizeof(filesystem_table_t) + sizeof(filesystem_t*) * (old->count + 1));
+    memcpy(table->filesystems, old->filesystems, sizeof(filesystem_t*) * old->count);
+    table->filesystems[old->count] = filesystem;
+    table->count = old->count + 1;
+    rcu_assign_pointer(filesystems, table);
+
+    mutex_release(&vfs_lock);
+
+    call_rcu(&old->rcu, filesystem_table_free);
+    return (hpr_fsid_t)(table->count - 1);
+}
+
+filesystem_t* fs_get_filesystem(hpr_fsid_t fs_identifier)
+{
+    filesystem_t* filesystem = NULL;
+
+    rcu_read_lock();
+    filesystem_table_t* table = rcu_dereference(filesystems);
+    if ((size_t)fs_identifier < table->count)
+    {
+        filesystem = table->filesystems[fs_identifier];
+    }
+    rcu_read_unlock();
+
+    // filesystems are never unregistered, so it's still there afterwards
+    return filesystem;
 }
 
 vfs_node_t* reduce_node(vfs_node_t* node, bool follow_symlinks)
@@ -77,10 +223,7 @@ vfs_node_t* reduce_node(vfs_node_t* node, bool follow_symlinks)
     }
     if (follow_symlinks && node->symlink_target != NULL && strlen(node->symlink_target) != 0)
     {
-        path2node_return_t ret = path2node(node->parent, node->symlink_target);
-        vfs_node_t* next_node = ret.current;
-        // we don't use the basename
-        free(ret.basename);
+        vfs_node_t* next_node = path_walk(node->parent, node->symlink_target, false).current;
         if (next_node == NULL)
         {
             return NULL;
@@ -94,111 +237,117 @@ vfs_node_t* reduce_node(vfs_node_t* node, bool follow_symlinks)
 // expects child_name to be zero-terminated string containing only the 
 // specific child we are looking for.  Do not pass in a subpath, as we will
 // not split it! (this behaviour may change in future versions)
+//
+// must be called inside an RCU reader section, or with vfs_lock held
 vfs_node_t* node_get_child(vfs_node_t* node, const char* child_name)
 {
-    klog("fs", "node_get_child node=%x child_name=%s children=%d",
-        node,
-        child_name,
-        node->children_count
-    );
-    // very simple implementation so we just do a linear search,
-    // in future versions we may implement some kind of hash table for node
-    // children, to speed things up when we're looking through large directories
-    for(int i = 0; i < node->children_count; i++)
+    size_t length = strlen(child_name);
+    return node_get_child_hashed(node, child_name, length, vfs_name_hash(child_name, length));
+}
+
+vfs_node_t* node_get_child_hashed(vfs_node_t* node, const char* child_name, size_t length, uint64_t hash)
+{
+    if (node->children == NULL)
+    {
+        // not a directory
+        return NULL;
+    }
+    vfs_child_table_t* table = rcu_dereference(node->children->table);
+
+    // there's always a free slot to stop at
+    for (size_t i = hash & table->mask; ; i = (i + 1) & table->mask)
     {
-        // skip entries where the names are different lengths (stops us matching prefixes by accident)
-        if(strlen(node->children[i].name) != strlen(child_name)) continue;
-        if(strncmp(node->children[i].name, child_name, strlen(child_name)) == 0)
+        vfs_node_t* child = atomic_load_explicit(&table->slots[i], memory_order_acquire);
+        if (child == NULL)
+        {
+            return NULL;
+        }
+        if (child != VFS_CHILD_REMOVED && child->name_hash == hash && child->name_length == length
+            && memcmp(child->name, child_name, length) == 0)
         {
-            return &node->children[i];
+            return child;
         }
     }
-    return NULL;
 }
 
-path2node_return_t path2node(vfs_node_t* parent, const char* path)
+// walk the path one component at a time, going through the dentry cache.
+// Nothing is allocated unless the caller wants the last component's name,
+// which is then theirs to free.
+static path2node_return_t path_walk(vfs_node_t* parent, const char* path, bool want_basename)
 {
-    if(strlen(path) == 0)
+    size_t length = strlen(path);
+    if(length == 0)
     {
         // todo: set errno(ENOENT)
-        return (path2node_return_t){
-            NULL,
-            NULL,
-            NULL 
-        };
+        return (path2node_return_t){NULL, NULL, NULL};
     }
 
-    uint64_t index = 0;
+    size_t index = 0;
     vfs_node_t* current_node = reduce_node(parent, false);
 
     if (path[index] == '/')
     {
         // it's an absolute path, so start from vfs_root instead
         current_node = reduce_node(vfs_root, false);
-        while(path[index] == '/') // eat up all extraneous leading `/` characters
+        // eat up all extraneous leading `/` characters
+        while(index < length && path[index] == '/')
         {
-            if(index == strlen(path) - 1)
-            {
-                // if we only have `/` characters, we're essentially at the root
-                return (path2node_return_t){current_node, current_node, NULL};
-            }
             index++;
         }
+        if(index == length)
+        {
+            // if we only have `/` characters, we're essentially at the root
+            return (path2node_return_t){current_node, current_node, NULL};
+        }
     }
 
     while(1)
     {
-        // warning! this pointer sometimes gets returned, do not free() in those cases
-        // - we expect the pointer to be free'd when it is copied into a structure
-        char* path_elem = malloc(strlen(path));
-        size_t i = 0;
-        // get the next component from the path string
-        while(index < strlen(path) && path[index] != '/')
+        // the next component, left where it is in the path
+        const char* name = &path[index];
+        while(index < length && path[index] != '/')
         {
-            path_elem[i++] = path[index++];
+            index++;
         }
+        size_t name_length = &path[index] - name;
 
         // eat up all the extraneous `/` separators
-        while(index < strlen(path) && path[index] == '/') 
+        while(index < length && path[index] == '/')
         {
             index++;
         }
 
-        bool last = index == strlen(path);
-
-        current_node = reduce_node(current_node, false);
-
+        bool last = index == length;
 
-        vfs_node_t* new_node = node_get_child(current_node, path_elem);
-        if(new_node == NULL)
+        // already reduced
+        vfs_node_t* new_node = dcache_lookup(current_node, name, name_length, vfs_name_hash(name, name_length));
+        if(new_node == NULL && !last)
         {
             // todo: set errno ENOENT
-            if(last)
-            {
-                return (path2node_return_t){current_node, NULL, path_elem};
-            }
             return (path2node_return_t){NULL, NULL, NULL};
         }
 
-        new_node = reduce_node(new_node, false);
-
         if(last)
         {
-            return (path2node_return_t){current_node, new_node, path_elem};
+            char* basename = NULL;
+            if(want_basename)
+            {
+                // malloc zeroes it, so it's terminated
+                basename = malloc(name_length + 1);
+                memcpy(basename, name, name_length);
+            }
+            return (path2node_return_t){current_node, new_node, basename};
         }
 
         current_node = new_node;
 
         if(stat_is_lnk(current_node->resource->stat.mode))
         {
-            path2node_return_t node = path2node(current_node->parent, current_node->symlink_target);
-            if(node.current == NULL)
+            current_node = path_walk(current_node->parent, current_node->symlink_target, false).current;
+            if(current_node == NULL)
             {
-                free(path_elem);
                 return (path2node_return_t){NULL, NULL, NULL};
             }
-            free(path_elem);
-            continue;
         }
 
         if(!stat_is_dir(current_node->resource->stat.mode))
@@ -206,15 +355,15 @@ path2node_return_t path2node(vfs_node_t* parent, const char* path)
             // todo: set errno ENOTDIR
             return (path2node_return_t){NULL, NULL, NULL};
         }
-
-        free(path_elem);
     }
+}
 
-    // todo: set errno ENOENT
-    return (path2node_return_t){NULL, NULL, NULL};
+path2node_return_t path2node(vfs_node_t* parent, const char* path)
+{
+    return path_walk(parent, path, true);
 }
 
-vfs_node_t* fs_symlink(vfs_node_t* parent, const char* dest, const char* target)
+static vfs_node_t* internal_symlink(vfs_node_t* parent, const char* dest, const char* target)
 {
     path2node_return_t ret = path2node(parent, target);
     vfs_node_t* parent_of_tgt = ret.parent;
@@ -237,9 +386,10 @@ vfs_node_t* fs_symlink(vfs_node_t* parent, const char* dest, const char* target)
     return target_node;
 }
 
-bool fs_mount(vfs_node_t* parent, const char* source, const char* target, hpr_fsid_t fs_identifier)
+static bool internal_mount(vfs_node_t* parent, const char* source, const char* target, hpr_fsid_t fs_identifier)
 {
-    if(fs_identifier > num_filesystems-1) 
+    filesystem_t* filesystem = fs_get_filesystem(fs_identifier);
+    if(filesystem == NULL)
     {
         klog("fs", "Mount failed: invalid filesystem identifier %d", fs_identifier);
         return false;
@@ -272,12 +422,14 @@ bool fs_mount(vfs_node_t* parent, const char* source, const char* target, hpr_fs
     }
 
 
-    filesystem_t* f_sys = filesystems[fs_identifier]->instantiate(filesystems[fs_identifier]);
+    filesystem_t* f_sys = filesystem->instantiate(filesystem);
 
     vfs_node_t* mount_node = f_sys->mount(f_sys, parent_of_tgt_node, basename, source_node);
     free(basename);
 
     target_node->mountpoint = mount_node;
+    // anything which led to the target now leads to the mount instead
+    dcache_flush();
 
     dir_create_dotentries(mount_node, parent_of_tgt_node);
 
@@ -292,6 +444,22 @@ bool fs_mount(vfs_node_t* parent, const char* source, const char* target, hpr_fs
     return true;
 }
 
+vfs_node_t* fs_symlink(vfs_node_t* parent, const char* dest, const char* target)
+{
+    mutex_acquire(&vfs_lock);
+    vfs_node_t* ret = internal_symlink(parent, dest, target);
+    mutex_release(&vfs_lock);
+    return ret;
+}
+
+bool fs_mount(vfs_node_t* parent, const char* source, const char* target, hpr_fsid_t fs_identifier)
+{
+    mutex_acquire(&vfs_lock);
+    bool ret = internal_mount(parent, source, target, fs_identifier);
+    mutex_release(&vfs_lock);
+    return ret;
+}
+
 vfs_node_t* internal_create(vfs_node_t* parent, const char* name, int mode)
 {
     path2node_return_t ret = path2node(parent, name);
@@ -326,9 +494,46 @@ vfs_node_t* internal_create(vfs_node_t* parent, const char* name, int mode)
 
 vfs_node_t* fs_create(vfs_node_t* parent, const char* name, int mode)
 {
-    lock_acquire(&vfs_lock);
+    mutex_acquire(&vfs_lock);
     vfs_node_t* ret = internal_create(parent, name, mode);
-    lock_release(&vfs_lock);
+    mutex_release(&vfs_lock);
+    return ret;
+}
+
+static bool internal_unlink(vfs_node_t* parent, const char* path)
+{
+    path2node_return_t ret = path2node(parent, path);
+    if(ret.current == NULL || ret.basename == NULL)
+    {
+        // todo: set errno ENOENT
+        free(ret.basename);
+        return false;
+    }
+
+    // the entry itself, rather than wherever it leads
+    vfs_node_t* node = node_get_child(ret.parent, ret.basename);
+    free(ret.basename);
+    if(node == NULL || node->children != NULL || node->redir != NULL || node->mountpoint != NULL)
+    {
+        // todo: set errno EISDIR/EBUSY, and support rmdir
+        return false;
+    }
+
+    if(node->resource->unlink != NULL && !node->resource->unlink(node->resource, NULL))
+    {
+        return false;
+    }
+    vfs_remove_child(ret.parent, node);
+    // todo: the node is leaked, since there's no telling who's still
+    // looking at it
+    return true;
+}
+
+bool fs_unlink(vfs_node_t* parent, const char* path)
+{
+    mutex_acquire(&vfs_lock);
+    bool ret = internal_unlink(parent, path);
+    mutex_release(&vfs_lock);
     return ret;
 }
 
@@ -345,13 +550,12 @@ void dir_create_dotentries(vfs_node_t* node, vfs_node_t* parent)
 
 vfs_node_t* fs_get_node(vfs_node_t* parent, const char* path, bool follow_symlinks)
 {
-    path2node_return_t ret = path2node(parent, path);
-    klog("fs", "path2node ret.current=%x ret.parent=%x ret.basename=%s", ret.current, ret.parent, ret.basename);
-    free(ret.basename); // not used
-    if(ret.current == NULL) return NULL;
-    if (follow_symlinks)
+    rcu_read_lock();
+    vfs_node_t* node = path_walk(parent, path, false).current;
+    if (node != NULL && follow_symlinks)
     {
-        return reduce_node(ret.current, true);
+        node = reduce_node(node, true);
     }
-    return ret.current;
+    rcu_read_unlock();
+    return node;
 }
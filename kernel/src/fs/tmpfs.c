@@ -75,9 +75,9 @@ vfs_node_t* tmpfs_create_node(filesystem_t* _self, vfs_node_t* parent, const cha
     new_resource->resource.stat.mode = mode;
     new_resource->resource.stat.nlink = 1;
 
-    new_resource->resource.stat.accessed_time = realtime_clock;
-    new_resource->resource.stat.created_time = realtime_clock;
-    new_resource->resource.stat.modified_time = realtime_clock;
+    new_resource->resource.stat.accessed_time = timer_get_realtime();
+    new_resource->resource.stat.created_time = timer_get_realtime();
+    new_resource->resource.stat.modified_time = timer_get_realtime();
     
     new_node->resource = (resource_t*)new_resource;
 
@@ -101,9 +101,9 @@ vfs_node_t* tmpfs_symlink(filesystem_t* _self, vfs_node_t* parent, const char* d
     new_resource->resource.stat.mode = STAT_IFLNK | 0777;
     new_resource->resource.stat.nlink = 1;
 
-    new_resource->resource.stat.accessed_time = realtime_clock;
-    new_resource->resource.stat.created_time = realtime_clock;
-    new_resource->resource.stat.modified_time = realtime_clock;
+    new_resource->resource.stat.accessed_time = timer_get_realtime();
+    new_resource->resource.stat.created_time = timer_get_realtime();
+    new_resource->resource.stat.modified_time = timer_get_realtime();
 
     new_resource->resource.grow  = tmpfs_resource_grow;
     new_resource->resource.read  = tmpfs_resource_read;
@@ -136,7 +136,7 @@ vfs_node_t*tmpfs_link(filesystem_t* self, vfs_node_t* parent, const char* dest,
 bool tmpfs_resource_grow(resource_t* _self, __attribute__((unused)) void* handle, uint64_t size)
 {
     bool rv = true;
-    lock_acquire(&_self->lock);
+    mutex_acquire(&_self->lock);
 
     tmpfs_resource_t* self = (tmpfs_resource_t*)_self;
     size_t new_capacity = self->capacity;
@@ -161,13 +161,13 @@ bool tmpfs_resource_grow(resource_t* _self, __attribute__((unused)) void* handle
     }
 
     
-    lock_release(&_self->lock);
+    mutex_release(&_self->lock);
     return rv;
 }
 
 int64_t tmpfs_resource_read(resource_t* _self, __attribute__((unused)) void* handle, void* buf, uint64_t loc, uint64_t count)
 {
-    lock_acquire(&_self->lock);
+    mutex_acquire(&_self->lock);
     tmpfs_resource_t* self = (tmpfs_resource_t*)_self;
 
     int64_t actual_count = count;
@@ -178,14 +178,14 @@ int64_t tmpfs_resource_read(resource_t* _self, __attribute__((unused)) void* han
 
     memcpy(buf, &self->storage[loc], actual_count);
 
-    lock_release(&_self->lock);
+    mutex_release(&_self->lock);
 
     return actual_count;
 }
 
 int64_t tmpfs_resource_write(resource_t* _self, __attribute__((unused)) void* handle, void* buf, uint64_t loc, uint64_t count)
 {
-    lock_acquire(&_self->lock);
+    mutex_acquire(&_self->lock);
     tmpfs_resource_t* self = (tmpfs_resource_t*)_self;
 
     if ( loc + count > self->capacity)
@@ -218,7 +218,7 @@ int64_t tmpfs_resource_write(resource_t* _self, __attribute__((unused)) void* ha
     }
 
 defer:
-    lock_release(&_self->lock);
+    mutex_release(&_self->lock);
 
     return count;
 }
@@ -255,7 +255,7 @@ bool tmpfs_resource_unlink(resource_t* _self,  __attribute__((unused)) void* han
 void* tmpfs_resource_mmap(resource_t* _self, uint64_t page, int flags)
 {
     void* rv = NULL;
-    lock_acquire(&_self->lock);
+    mutex_acquire(&_self->lock);
     tmpfs_resource_t* self = (tmpfs_resource_t*)_self;
 
     if((flags & MMAP_MAP_SHARED) != 0)
@@ -269,7 +269,7 @@ void* tmpfs_resource_mmap(resource_t* _self, uint64_t page, int flags)
         rv = copy_page;
     }
 
-    lock_release(&_self->lock);
+    mutex_release(&_self->lock);
     return rv;
 }
 
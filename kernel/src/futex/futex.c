@@ -1,10 +1,337 @@
 #include <lock/lock.h>
 #include <futex/futex.h>
 #include <klog/klog.h>
+#include <proc/proc.h>
+#include <mem/pagemap.h>
+#include <mem/pmm.h>
+#include <time/clocksource.h>
+#include <sys/errno.h>
 
-lock_t futex_lock;
+#include <stddef.h>
+
+static futex_bucket_t futex_buckets[FUTEX_HASH_SIZE];
+
+// find the physical address of a futex word in the current process, which is
+// the same whichever process is asking
+static bool futex_key(uint32_t* uaddr, uint64_t* key)
+{
+    uint64_t addr = (uint64_t)uaddr;
+    if ((addr & 3) != 0)
+    {
+        return false;
+    }
+
+    pagemap_t* pagemap = get_current_thread()->process->pagemap;
+    uint64_t page = 0;
+    if (!virt2phys(pagemap, addr, &page))
+    {
+        return false;
+    }
+    *key = page + (addr & (PAGE_SIZE - 1));
+    return true;
+}
+
+static futex_bucket_t* futex_hash(uint64_t key)
+{
+    // the low bits of the key are always zero, and pages are often allocated
+    // next to each other, so mix it up before taking the top bits
+    return &futex_buckets[((key >> 2) * 0x9e3779b97f4a7c15ull) >> (64 - FUTEX_HASH_BITS)];
+}
+
+// read the futex word through the kernel's mapping of its page, so it can't
+// fault even if userland unmaps it in the meantime
+static uint32_t futex_read(uint64_t key)
+{
+    return atomic_load((_Atomic uint32_t*)(key + HIGHER_HALF));
+}
+
+// all of these expect the bucket to be locked
+static void futex_enqueue(futex_bucket_t* bucket, futex_waiter_t* waiter)
+{
+    waiter->next = NULL;
+    waiter->prev = bucket->tail;
+    if (bucket->tail != NULL)
+        bucket->tail->next = waiter;
+    else
+        bucket->head = waiter;
+    bucket->tail = waiter;
+    atomic_store(&waiter->bucket, bucket);
+    waiter->queued = true;
+}
+
+static void futex_dequeue(futex_bucket_t* bucket, futex_waiter_t* waiter)
+{
+    if (waiter->prev != NULL)
+        waiter->prev->next = waiter->next;
+    else
+        bucket->head = waiter->next;
+    if (waiter->next != NULL)
+        waiter->next->prev = waiter->prev;
+    else
+        bucket->tail = waiter->prev;
+
+    waiter->next = NULL;
+    waiter->prev = NULL;
+    waiter->queued = false;
+}
+
+static void futex_wake_waiter(futex_bucket_t* bucket, futex_waiter_t* waiter)
+{
+    futex_dequeue(bucket, waiter);
+    // the waiter can't return until it's seen the bucket unlocked, so its
+    // event is still there for as long as this takes
+    event_trigger(&waiter->woken, false);
+}
+
+// lock the bucket the waiter is on, which may change under us if it's
+// requeued while we're getting the lock
+static futex_bucket_t* futex_lock_waiter(futex_waiter_t* waiter)
+{
+    for (;;)
+    {
+        futex_bucket_t* bucket = atomic_load(&waiter->bucket);
+        lock_acquire(&bucket->lock);
+        if (atomic_load(&waiter->bucket) == bucket)
+        {
+            return bucket;
+        }
+        lock_release(&bucket->lock);
+    }
+}
+
+// take two buckets' locks, always in the same order so that two requeues
+// going opposite ways can't deadlock
+static void futex_lock_pair(futex_bucket_t* a, futex_bucket_t* b)
+{
+    if (a == b)
+    {
+        lock_acquire(&a->lock);
+        return;
+    }
+    if (a > b)
+    {
+        futex_bucket_t* tmp = a;
+        a = b;
+        b = tmp;
+    }
+    lock_acquire(&a->lock);
+    lock_acquire(&b->lock);
+}
+
+static void futex_unlock_pair(futex_bucket_t* a, futex_bucket_t* b)
+{
+    if (a != b)
+    {
+        lock_release(&b->lock);
+    }
+    lock_release(&a->lock);
+}
+
+int64_t futex_wait(uint32_t* uaddr, uint32_t val, uint64_t deadline, uint32_t bitset)
+{
+    if (bitset == 0)
+    {
+        return -EINVAL;
+    }
+
+    futex_waiter_t waiter = {0};
+    if (!futex_key(uaddr, &waiter.key))
+    {
+        return -EFAULT;
+    }
+    waiter.bitset = bitset;
+
+    futex_bucket_t* bucket = futex_hash(waiter.key);
+    lock_acquire(&bucket->lock);
+    // a waker has to take the bucket lock to find us, so if the word has
+    // already changed, we'd have missed the wakeup
+    if (futex_read(waiter.key) != val)
+    {
+        lock_release(&bucket->lock);
+        return -EAGAIN;
+    }
+    futex_enqueue(bucket, &waiter);
+    lock_release(&bucket->lock);
+
+    event_t* events[] = { &waiter.woken, &waiter.timeout.event };
+    uint64_t count = 1;
+    if (deadline != 0)
+    {
+        timer_arm(&waiter.timeout, deadline);
+        count = 2;
+    }
+
+    // a wakeup between unlocking and getting here is left pending on the
+    // event, so it's not lost
+    int64_t which = event_await(events, count, true);
+
+    if (deadline != 0)
+    {
+        timer_disarm(&waiter.timeout);
+    }
+
+    bucket = futex_lock_waiter(&waiter);
+    bool woken = !waiter.queued;
+    if (!woken)
+    {
+        futex_dequeue(bucket, &waiter);
+    }
+    lock_release(&bucket->lock);
+
+    // we may have timed out (or been signalled) and been woken at the same
+    // time, in which case the wakeup wins, since the waker counted us
+    if (woken)
+    {
+        return 0;
+    }
+    return which == 1 ? -ETIMEDOUT : -EINTR;
+}
+
+int64_t futex_wake(uint32_t* uaddr, uint32_t count, uint32_t bitset)
+{
+    if (bitset == 0)
+    {
+        return -EINVAL;
+    }
+
+    uint64_t key = 0;
+    if (!futex_key(uaddr, &key))
+    {
+        return -EFAULT;
+    }
+
+    futex_bucket_t* bucket = futex_hash(key);
+    int64_t woken = 0;
+
+    lock_acquire(&bucket->lock);
+    futex_waiter_t* waiter = bucket->head;
+    while (waiter != NULL && (uint64_t)woken < count)
+    {
+        futex_waiter_t* next = waiter->next;
+        if (waiter->key == key && (waiter->bitset & bitset) != 0)
+        {
+            futex_wake_waiter(bucket, waiter);
+            woken++;
+        }
+        waiter = next;
+    }
+    lock_release(&bucket->lock);
+
+    return woken;
+}
+
+int64_t futex_requeue(uint32_t* uaddr, uint32_t* uaddr2, uint32_t wake, uint32_t requeue, bool check, uint32_t val)
+{
+    uint64_t key = 0;
+    uint64_t key2 = 0;
+    if (!futex_key(uaddr, &key) || !futex_key(uaddr2, &key2))
+    {
+        return -EFAULT;
+    }
+
+    futex_bucket_t* bucket = futex_hash(key);
+    futex_bucket_t* bucket2 = futex_hash(key2);
+    int64_t moved = 0;
+
+    futex_lock_pair(bucket, bucket2);
+
+    if (check && futex_read(key) != val)
+    {
+        futex_unlock_pair(bucket, bucket2);
+        return -EAGAIN;
+    }
+
+    futex_waiter_t* waiter = bucket->head;
+    while (waiter != NULL && (uint64_t)moved < (uint64_t)wake + requeue)
+    {
+        futex_waiter_t* next = waiter->next;
+        if (waiter->key == key)
+        {
+            if ((uint64_t)moved < wake)
+            {
+                futex_wake_waiter(bucket, waiter);
+            }
+            else
+            {
+                // the rest carry on sleeping, but now whoever wakes uaddr2
+                // wakes them
+                futex_dequeue(bucket, waiter);
+                waiter->key = key2;
+                futex_enqueue(bucket2, waiter);
+            }
+            moved++;
+        }
+        waiter = next;
+    }
+
+    futex_unlock_pair(bucket, bucket2);
+    return moved;
+}
+
+// turn a timeout from userland into a deadline on the monotonic clock.
+// FUTEX_WAIT's is relative, the bitset wait's is absolute, on whichever clock
+// was asked for.
+static uint64_t futex_deadline(int cmd, int op, const timespec_t* timeout)
+{
+    int64_t nanos = timeout->tv_sec * 1000000000 + timeout->tv_nsec;
+    uint64_t now = timer_get_nanos();
+
+    if (cmd == FUTEX_WAIT)
+    {
+        return now + (uint64_t)nanos;
+    }
+    if ((op & FUTEX_CLOCK_REALTIME) != 0)
+    {
+        nanos -= clocksource_read_realtime() - (int64_t)now;
+    }
+    // already passed, but a deadline of 0 would mean no timeout at all
+    return nanos > 0 ? (uint64_t)nanos : 1;
+}
+
+int64_t syscall_futex(uint32_t* uaddr, int op, uint32_t val, const timespec_t* timeout, uint32_t* uaddr2, uint32_t val3)
+{
+    int cmd = op & FUTEX_CMD_MASK;
+    uint64_t deadline = 0;
+    int64_t ret = 0;
+
+    switch (cmd)
+    {
+        case FUTEX_WAIT:
+        case FUTEX_WAIT_BITSET:
+            if (timeout != NULL)
+            {
+                if (timeout->tv_nsec < 0 || timeout->tv_nsec >= 1000000000 || timeout->tv_sec < 0)
+                {
+                    ret = -EINVAL;
+                    break;
+                }
+                deadline = futex_deadline(cmd, op, timeout);
+            }
+            ret = futex_wait(uaddr, val, deadline, cmd == FUTEX_WAIT ? FUTEX_BITSET_MATCH_ANY : val3);
+            break;
+        case FUTEX_WAKE:
+        case FUTEX_WAKE_BITSET:
+            ret = futex_wake(uaddr, val, cmd == FUTEX_WAKE ? FUTEX_BITSET_MATCH_ANY : val3);
+            break;
+        case FUTEX_REQUEUE:
+        case FUTEX_CMP_REQUEUE:
+            // how many to requeue is passed where the timeout would be
+            ret = futex_requeue(uaddr, uaddr2, val, (uint32_t)(uint64_t)timeout, cmd == FUTEX_CMP_REQUEUE, val3);
+            break;
+        default:
+            ret = -ENOSYS;
+            break;
+    }
+
+    if (ret < 0)
+    {
+        get_current_thread()->errno = -ret;
+        return -1;
+    }
+    return ret;
+}
 
 void futex_init()
 {
-    klog("futex", "Futexes are not yet properly implemented");
+    klog("futex", "%d futex hash buckets", FUTEX_HASH_SIZE);
 }
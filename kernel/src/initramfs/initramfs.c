@@ -5,6 +5,7 @@
 #include <mem/pmm.h>
 #include <mem/align.h>
 #include <fs/fs.h>
+#include <scheduler/preempt.h>
 
 // third-party headers
 #include <limine.h>
@@ -144,6 +145,7 @@ next:
         // increment header by 1 page (header takes up 1 page) plus however many
         // pages this file took up
         current_header += (512 + align_up(size, 512));
+        cond_resched();
     }
     klog("init", "Initramfs loaded"); 
 }
@@ -8,8 +8,11 @@
 #include <cpu/cpu.h>
 #include <time/pit.h>
 #include <time/timer.h>
+#include <time/clocksource.h>
 #include <cpu/smp.h>
 #include <acpi/madt.h>
+#include <cpu/isolation.h>
+#include <lock/lock.h>
 
 #define LAPIC_REG_ICR0 0x300
 #define LAPIC_REG_ICR1 0x310
@@ -20,7 +23,31 @@
 #define LAPIC_REG_TIMER_CURCNT 0x390
 #define LAPIC_REG_TIMER_DIV 0x3e0
 
+#define LAPIC_TIMER_MASKED (1 << 16)
+// fire when the TSC reaches the value in IA32_TSC_DEADLINE, instead of
+// counting down
+#define LAPIC_TIMER_TSC_DEADLINE (2 << 17)
+#define MSR_TSC_DEADLINE 0x6e0
+
+// GSIs beyond this are never remembered, so won't be steered away from
+// isolated CPUs
+#define IO_APIC_MAX_ROUTES 256
+
+// every redirection we've programmed, so that it can be moved if the CPU it
+// targets gets isolated (or moved back if it stops being isolated)
+typedef struct {
+    bool used;
+    // who the interrupt was asked to go to, which may not be where it's
+    // actually going
+    uint32_t lapic_id;
+    uint8_t vector;
+    uint16_t flags;
+    bool status;
+} io_apic_route_t;
+
 static uint64_t lapic_base = 0;
+static io_apic_route_t io_apic_routes[IO_APIC_MAX_ROUTES];
+static lock_t io_apic_routes_lock;
 
 uint32_t lapic_read(uint32_t reg)
 {
@@ -52,8 +79,12 @@ void lapic_enable(uint16_t spurious_vector)
 
 void lapic_timer_stop()
 {
+    if (clocksource_have_tsc_deadline())
+    {
+        wrmsr(MSR_TSC_DEADLINE, 0);
+    }
     lapic_write(LAPIC_REG_TIMER_INITCNT, 0);
-    lapic_write(LAPIC_REG_TIMER, (1 << 16));
+    lapic_write(LAPIC_REG_TIMER, LAPIC_TIMER_MASKED);
 }
 
 void lapic_send_ipi(uint8_t lapic_id, uint8_t vector)
@@ -77,11 +108,10 @@ void lapic_timer_calibrate(local_cpu_t* local_cpu)
     klog("lapic", "Waiting for %u timer ticks", samples);
 
     lapic_write(LAPIC_REG_TIMER_INITCNT, (uint32_t)samples);
-    uint64_t curcnt = 0;
 
-    while((curcnt = lapic_read(LAPIC_REG_TIMER_CURCNT)) != 0)
+    while (lapic_read(LAPIC_REG_TIMER_CURCNT) != 0)
     {
-        klog("lapic", "Count: %d", curcnt);
+        asm volatile ("pause" ::: "memory");
     }
 
     uint64_t final_pit_tick = (uint64_t) pit_get_current_count();
@@ -95,10 +125,29 @@ void lapic_timer_calibrate(local_cpu_t* local_cpu)
 
 void lapic_timer_oneshot(local_cpu_t* local_cpu, uint8_t vector, uint64_t micros)
 {
+    // no count to run out of range, and no rounding to the bus clock
+    if (clocksource_have_tsc_deadline())
+    {
+        lapic_write(LAPIC_REG_TIMER, LAPIC_TIMER_TSC_DEADLINE | vector);
+        // the LVT write has to land before the deadline is armed
+        asm volatile ("mfence" ::: "memory");
+        if (micros > UINT64_MAX / 1000)
+            micros = UINT64_MAX / 1000;
+        wrmsr(MSR_TSC_DEADLINE, cpu_rdtsc() + clocksource_nanos_to_tsc(micros * 1000));
+        return;
+    }
+
     lapic_timer_stop();
 
     uint64_t ticks = micros * (local_cpu->lapic_timer_freq / 1000000);
-    
+    // the count register is only 32 bits wide, so anything further out just
+    // fires early and gets re-armed by whoever is waiting for it
+    if (ticks > UINT32_MAX)
+        ticks = UINT32_MAX;
+    // a count of 0 would stop the timer rather than fire it straight away
+    if (ticks == 0)
+        ticks = 1;
+
     lapic_write(LAPIC_REG_TIMER, vector);
     lapic_write(LAPIC_REG_TIMER_DIV, 0);
     lapic_write(LAPIC_REG_TIMER_INITCNT, (uint32_t)ticks);
@@ -148,7 +197,7 @@ uint64_t io_apic_from_gsi(uint32_t gsi)
     panic("Cannot determine IO APIC from GSI (missing IO APIC?)");
 }
 
-void io_apic_set_gsi_redirect(uint32_t lapic_id, uint8_t vector, uint32_t gsi, uint16_t flags, bool status)
+static void io_apic_program_gsi(uint32_t lapic_id, uint8_t vector, uint32_t gsi, uint16_t flags, bool status)
 {
     uint64_t io_apic = io_apic_from_gsi(gsi);
     uint64_t redirect = (uint64_t) vector;
@@ -176,6 +225,45 @@ void io_apic_set_gsi_redirect(uint32_t lapic_id, uint8_t vector, uint32_t gsi, u
     io_apic_write(io_apic, ioredtbl + 1, (uint32_t) (redirect >> 32));
 }
 
+void io_apic_set_gsi_redirect(uint32_t lapic_id, uint8_t vector, uint32_t gsi, uint16_t flags, bool status)
+{
+    bool ints = cpu_interrupts_disable();
+    lock_acquire(&io_apic_routes_lock);
+
+    if (gsi < IO_APIC_MAX_ROUTES)
+    {
+        io_apic_routes[gsi] = (io_apic_route_t){
+            .used = true,
+            .lapic_id = lapic_id,
+            .vector = vector,
+            .flags = flags,
+            .status = status,
+        };
+    }
+    io_apic_program_gsi(isolation_irq_target(lapic_id), vector, gsi, flags, status);
+
+    lock_release(&io_apic_routes_lock);
+    cpu_interrupts_restore(ints);
+}
+
+void io_apic_reroute()
+{
+    bool ints = cpu_interrupts_disable();
+    lock_acquire(&io_apic_routes_lock);
+
+    for (uint32_t gsi = 0; gsi < IO_APIC_MAX_ROUTES; gsi++)
+    {
+        io_apic_route_t* route = &io_apic_routes[gsi];
+        if (route->used)
+        {
+            io_apic_program_gsi(isolation_irq_target(route->lapic_id), route->vector, gsi, route->flags, route->status);
+        }
+    }
+
+    lock_release(&io_apic_routes_lock);
+    cpu_interrupts_restore(ints);
+}
+
 void io_apic_set_irq_redirect(uint32_t lapic_id, uint8_t vector, uint8_t irq, bool status)
 {
     for(size_t i = 0; i < madt_iso_count; i++)
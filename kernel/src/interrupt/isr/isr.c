@@ -5,6 +5,7 @@
 #include <gdt/gdt.h>
 #include <klog/klog.h>
 #include <panic.h>
+#include <cpu/fpu.h>
 
 // names of each type of exception the CPU can produce
 static const char *exception_names[] = {
@@ -91,6 +92,12 @@ void isr_init() {
     {
         switch (i)
         {
+            case 7:
+            {
+                set_idt_entry(i, 0x8e, KERNEL_CODE_SEGMENT, 0, (void (*)())isrs[i]);
+                interrupt_table[i] = (void*)fpu_handle_unavailable;
+                break;
+            }
             case 14:
             {
                 // todo: change IST to 3 when TSS is working correctly
@@ -0,0 +1,160 @@
+#include <interrupt/softirq.h>
+#include <cpu/smp.h>
+#include <cpu/percpu.h>
+#include <cpu/cpu.h>
+#include <cpu/cpumask.h>
+#include <scheduler/scheduler.h>
+#include <scheduler/preempt.h>
+#include <scheduler/event.h>
+#include <interrupt/apic.h>
+#include <klog/klog.h>
+#include <panic.h>
+
+static softirq_handler_t softirq_handlers[SOFTIRQ_COUNT];
+
+void softirq_register(softirq_t softirq, softirq_handler_t handler)
+{
+    softirq_handlers[softirq] = handler;
+}
+
+// returns whether there's still work left over
+static bool softirq_run_handlers(local_cpu_t* cpu)
+{
+    for (uint64_t restart = 0; restart < SOFTIRQ_MAX_RESTART; restart++)
+    {
+        uint32_t pending = atomic_exchange(&cpu->softirq_pending, 0);
+        if (pending == 0)
+        {
+            return false;
+        }
+
+        for (uint32_t i = 0; i < SOFTIRQ_COUNT; i++)
+        {
+            if ((pending & (1u << i)) != 0 && softirq_handlers[i] != NULL)
+            {
+                softirq_handlers[i]();
+            }
+        }
+    }
+
+    return atomic_load(&cpu->softirq_pending) != 0;
+}
+
+// called with interrupts disabled, which are turned back on while the
+// handlers run.  Returns whether there's still work left over.
+static bool softirq_run(local_cpu_t* cpu)
+{
+    // interrupts which come in from here on leave their bottom halves to us,
+    // and the scheduler leaves this CPU alone, since we have to finish on it
+    cpu->in_softirq = true;
+    preempt_disable();
+    asm volatile ("sti" ::: "memory");
+
+    bool more = softirq_run_handlers(cpu);
+
+    asm volatile ("cli" ::: "memory");
+    preempt_enable_no_resched();
+    cpu->in_softirq = false;
+
+    if (cpu->softirq_resched)
+    {
+        // we held off the scheduler, so have it come back now.  It's
+        // delivered as soon as interrupts are enabled again.
+        cpu->softirq_resched = false;
+        lapic_send_ipi((uint8_t)cpu->lapic_id, scheduler_vector);
+    }
+    return more;
+}
+
+void softirq_run_pending()
+{
+    // before this, GS isn't necessarily pointing at anything, and nothing
+    // can have raised a bottom half anyway
+    if (!atomic_load(&scheduler_ready))
+    {
+        return;
+    }
+
+    // this is on the way out of every interrupt, and there's usually nothing
+    // to do
+    if (this_cpu_read(softirq_pending) == 0)
+    {
+        return;
+    }
+
+    local_cpu_t* cpu = this_cpu_read(self);
+    // we interrupted the bottom halves, which pick up whatever we raised
+    if (cpu->in_softirq)
+    {
+        return;
+    }
+    if (softirq_run(cpu) && cpu->softirq_thread != NULL)
+    {
+        event_trigger(&cpu->softirq_event, false);
+    }
+}
+
+void softirq_raise_irqoff(softirq_t softirq)
+{
+    local_cpu_t* cpu = cpu_get_current();
+    atomic_fetch_or(&cpu->softirq_pending, 1u << softirq);
+}
+
+void softirq_raise(softirq_t softirq)
+{
+    bool ints = cpu_interrupts_disable();
+    local_cpu_t* cpu = cpu_get_current();
+    atomic_fetch_or(&cpu->softirq_pending, 1u << softirq);
+    if (cpu->softirq_thread != NULL)
+    {
+        event_trigger(&cpu->softirq_event, false);
+    }
+    cpu_interrupts_restore(ints);
+}
+
+static void softirq_thread(void* arg)
+{
+    local_cpu_t* cpu = arg;
+    event_t* events[] = { &cpu->softirq_event };
+
+    for (;;)
+    {
+        event_await(events, 1, true);
+
+        bool ints = cpu_interrupts_disable();
+        // we're pinned, but make sure
+        if (cpu_get_current() != cpu)
+        {
+            panic("softirq thread for CPU %d is running on the wrong CPU", cpu->cpu_number);
+        }
+        if (softirq_run(cpu))
+        {
+            // go round again, but let everyone else have a turn first
+            event_trigger(&cpu->softirq_event, false);
+        }
+        cpu_interrupts_restore(ints);
+    }
+}
+
+void softirq_init()
+{
+    for (uint64_t i = 0; i < cpu_count; i++)
+    {
+        cpumask_t affinity;
+        cpumask_clear_all(&affinity);
+        cpumask_set(&affinity, i);
+        sched_attr_t attr = {
+            .policy = SCHED_POLICY_NORMAL,
+            .nice = 0,
+            .affinity = &affinity,
+        };
+
+        thread_t* thread = new_kernel_thread(softirq_thread, local_cpus[i], true, &attr);
+        if (thread == NULL)
+        {
+            panic("Couldn't start softirq thread for CPU %d", i);
+        }
+        local_cpus[i]->softirq_thread = thread;
+    }
+    klog("softirq", "Started %d softirq threads", cpu_count);
+}
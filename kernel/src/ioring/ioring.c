@@ -0,0 +1,551 @@
+#include <ioring/ioring.h>
+#include <proc/proc.h>
+#include <file/file.h>
+#include <scheduler/scheduler.h>
+#include <scheduler/preempt.h>
+#include <time/timer.h>
+#include <mem/pmm.h>
+#include <mem/mmap.h>
+#include <mem/align.h>
+#include <sys/syscall.h>
+#include <sys/errno.h>
+#include <klog/klog.h>
+
+#include <stdlib.h>
+#include <stddef.h>
+
+// holds a slot while the ring going into it is still being set up
+#define IORING_SLOT_RESERVED ((ioring_t*)1)
+
+static ioring_t* ioring_get(process_t* process, uint64_t id)
+{
+    if (id >= PROC_MAX_IORINGS)
+    {
+        return NULL;
+    }
+    ioring_t* ring = atomic_load(&process->iorings[id]);
+    return ring == IORING_SLOT_RESERVED ? NULL : ring;
+}
+
+// how many completions are waiting for the process to reap them
+static uint32_t ioring_cq_ready(ioring_t* ring)
+{
+    return atomic_load_explicit(&ring->shared->cq_tail, memory_order_relaxed)
+        - atomic_load_explicit(&ring->shared->cq_head, memory_order_acquire);
+}
+
+// set aside a CQ entry for something we're about to take off the SQ, so
+// that it has somewhere to complete to.  Fails if the CQ is full.
+static bool ioring_reserve(ioring_t* ring)
+{
+    lock_acquire(&ring->cq_lock);
+    uint32_t used = ioring_cq_ready(ring);
+    // the process can write anything it likes to cq_head, so don't trust it
+    // to be sensible
+    bool ok = used <= ring->shared->cq_entries
+        && ring->shared->cq_entries - used > ring->inflight;
+    if (ok)
+    {
+        ring->inflight++;
+    }
+    lock_release(&ring->cq_lock);
+    return ok;
+}
+
+static void ioring_complete(ioring_t* ring, uint64_t user_data, int64_t result)
+{
+    lock_acquire(&ring->cq_lock);
+    ring->inflight--;
+    uint32_t tail = atomic_load_explicit(&ring->shared->cq_tail, memory_order_relaxed);
+    if (ioring_cq_ready(ring) >= ring->shared->cq_entries)
+    {
+        atomic_fetch_add(&ring->shared->cq_overflow, 1);
+        lock_release(&ring->cq_lock);
+        return;
+    }
+    ring->cqes[tail & ring->shared->cq_mask] = (ioring_cqe_t) {
+        .user_data = user_data,
+        .result = result,
+    };
+    atomic_store_explicit(&ring->shared->cq_tail, tail + 1, memory_order_release);
+    lock_release(&ring->cq_lock);
+
+    // not dropped, so a waiter which is about to sleep still sees it
+    event_trigger(&ring->cq_event, false);
+}
+
+static file_handle_t* ioring_get_handle(process_t* process, int32_t fd)
+{
+    if (fd < 0 || fd >= PROC_MAX_FDS)
+    {
+        return NULL;
+    }
+    lock_acquire(&process->fds_lock);
+    file_descriptor_t* desc = process->fds[fd];
+    file_handle_t* handle = desc != NULL ? desc->handle : NULL;
+    lock_release(&process->fds_lock);
+    return handle;
+}
+
+static int64_t ioring_rw(ioring_t* ring, ioring_sqe_t* sqe, bool write)
+{
+    // the buffer is the process's word for where it is, so make sure it's
+    // not pointing us at the kernel
+    if (sqe->addr >= SYSCALL_USER_ADDRESS_LIMIT
+        || sqe->len > SYSCALL_USER_ADDRESS_LIMIT - sqe->addr)
+    {
+        return -EFAULT;
+    }
+
+    file_handle_t* handle = ioring_get_handle(ring->process, sqe->fd);
+    if (handle == NULL)
+    {
+        return -EBADF;
+    }
+    resource_t* res = handle->resource;
+
+    uint64_t loc = sqe->offset;
+    bool advance = loc == IORING_OFFSET_CURRENT;
+    if (advance)
+    {
+        lock_acquire(&handle->lock);
+        loc = handle->location;
+        lock_release(&handle->lock);
+    }
+
+    int64_t ret = write
+        ? res->write(res, handle, (void*)sqe->addr, loc, sqe->len)
+        : res->read(res, handle, (void*)sqe->addr, loc, sqe->len);
+    if (ret < 0)
+    {
+        return -EIO;
+    }
+
+    if (advance)
+    {
+        lock_acquire(&handle->lock);
+        handle->location += ret;
+        lock_release(&handle->lock);
+    }
+    return ret;
+}
+
+// which of the bits being polled for are set, if any.  Regular files and
+// directories never block, and don't keep a status, so they're always
+// ready.
+static uint16_t ioring_poll_check(resource_t* res, uint16_t events)
+{
+    int status = stat_is_reg(res->stat.mode) || stat_is_dir(res->stat.mode)
+        ? POLLIN | POLLOUT
+        : atomic_load(&res->status);
+    return status & (events | POLLERR | POLLHUP);
+}
+
+static void ioring_poll(ioring_t* ring, ioring_sqe_t* sqe)
+{
+    file_handle_t* handle = ioring_get_handle(ring->process, sqe->fd);
+    if (handle == NULL)
+    {
+        ioring_complete(ring, sqe->user_data, -EBADF);
+        return;
+    }
+
+    uint16_t revents = ioring_poll_check(handle->resource, sqe->poll_events);
+    if (revents != 0)
+    {
+        ioring_complete(ring, sqe->user_data, revents);
+        return;
+    }
+
+    ioring_poll_t* poll = malloc(sizeof(ioring_poll_t));
+    if (poll == NULL)
+    {
+        ioring_complete(ring, sqe->user_data, -ENOMEM);
+        return;
+    }
+    // the fd may be closed while we wait, so hold on to the resource until
+    // the poll completes
+    atomic_fetch_add(&handle->resource->refcount, 1);
+    poll->resource = handle->resource;
+    poll->events = sqe->poll_events;
+    poll->user_data = sqe->user_data;
+
+    lock_acquire(&ring->polls_lock);
+    poll->next = ring->polls;
+    ring->polls = poll;
+    lock_release(&ring->polls_lock);
+}
+
+// complete any polls which have become ready
+static void ioring_reap_polls(ioring_t* ring)
+{
+    ioring_poll_t* ready = NULL;
+
+    lock_acquire(&ring->polls_lock);
+    ioring_poll_t** link = &ring->polls;
+    while (*link != NULL)
+    {
+        ioring_poll_t* poll = *link;
+        if (ioring_poll_check(poll->resource, poll->events) == 0)
+        {
+            link = &poll->next;
+            continue;
+        }
+        *link = poll->next;
+        poll->next = ready;
+        ready = poll;
+    }
+    lock_release(&ring->polls_lock);
+
+    // checked again, since the bits may have changed since
+    while (ready != NULL)
+    {
+        ioring_poll_t* poll = ready;
+        ready = poll->next;
+        ioring_complete(ring, poll->user_data, ioring_poll_check(poll->resource, poll->events));
+        poll->resource->unref(poll->resource, NULL);
+        free(poll);
+    }
+}
+
+static void ioring_issue(ioring_t* ring, ioring_sqe_t* sqe)
+{
+    switch (sqe->opcode)
+    {
+        case IORING_OP_NOP:
+            ioring_complete(ring, sqe->user_data, 0);
+            break;
+        case IORING_OP_READ:
+            ioring_complete(ring, sqe->user_data, ioring_rw(ring, sqe, false));
+            break;
+        case IORING_OP_WRITE:
+            ioring_complete(ring, sqe->user_data, ioring_rw(ring, sqe, true));
+            break;
+        case IORING_OP_POLL:
+            ioring_poll(ring, sqe);
+            break;
+        default:
+            ioring_complete(ring, sqe->user_data, -EINVAL);
+            break;
+    }
+}
+
+// take up to `max` entries off the SQ and carry them out, returning how many
+// there were
+static uint32_t ioring_submit(ioring_t* ring, uint32_t max)
+{
+    ioring_shared_t* shared = ring->shared;
+    uint32_t submitted = 0;
+
+    while (submitted < max)
+    {
+        lock_acquire(&ring->sq_lock);
+        uint32_t head = atomic_load_explicit(&shared->sq_head, memory_order_relaxed);
+        uint32_t tail = atomic_load_explicit(&shared->sq_tail, memory_order_acquire);
+        if (head == tail || !ioring_reserve(ring))
+        {
+            lock_release(&ring->sq_lock);
+            break;
+        }
+        // copied out, so the process can't change it while we're using it
+        ioring_sqe_t sqe = ring->sqes[head & shared->sq_mask];
+        atomic_store_explicit(&shared->sq_head, head + 1, memory_order_release);
+        lock_release(&ring->sq_lock);
+
+        // outside the lock, since reads and writes can sleep
+        ioring_issue(ring, &sqe);
+        submitted++;
+    }
+
+    return submitted;
+}
+
+// wait until there are at least `min_complete` entries on the CQ
+static int64_t ioring_wait(ioring_t* ring, uint32_t min_complete)
+{
+    hpr_timer_t recheck = {0};
+
+    for (;;)
+    {
+        ioring_reap_polls(ring);
+        if (ioring_cq_ready(ring) >= min_complete)
+        {
+            return 0;
+        }
+
+        // wake up for a completion, or for a change in any of the resources
+        // being polled, as far as there's room for them
+        event_t* events[EVENT_MAX_AWAIT];
+        uint64_t count = 0;
+        events[count++] = &ring->cq_event;
+        events[count++] = &recheck.event;
+
+        lock_acquire(&ring->polls_lock);
+        bool polling = ring->polls != NULL;
+        for (ioring_poll_t* poll = ring->polls; poll != NULL && count < EVENT_MAX_AWAIT; poll = poll->next)
+        {
+            event_t* event = &poll->resource->event;
+            bool seen = false;
+            for (uint64_t i = 2; i < count && !seen; i++)
+            {
+                seen = events[i] == event;
+            }
+            if (!seen)
+            {
+                events[count++] = event;
+            }
+        }
+        lock_release(&ring->polls_lock);
+
+        // the resources don't know about us, so there's nothing to keep a
+        // trigger pending between checking them and waiting.  Look again
+        // now and then rather than risk sleeping through it.
+        if (polling)
+        {
+            timer_arm(&recheck, timer_get_nanos() + IORING_POLL_RECHECK_NANOS);
+        }
+
+        int64_t which = event_await(events, count, true);
+
+        if (polling)
+        {
+            timer_disarm(&recheck);
+        }
+        if (which < 0)
+        {
+            return -EINTR;
+        }
+    }
+}
+
+static void ioring_sq_thread(ioring_t* ring)
+{
+    ioring_shared_t* shared = ring->shared;
+    uint64_t idle_since = timer_get_nanos();
+
+    for (;;)
+    {
+        uint32_t submitted = ioring_submit(ring, UINT32_MAX);
+        ioring_reap_polls(ring);
+
+        uint64_t now = timer_get_nanos();
+        if (submitted != 0)
+        {
+            idle_since = now;
+        }
+        if (now - idle_since < ring->sq_idle_nanos)
+        {
+            cond_resched();
+            continue;
+        }
+
+        // tell the process it has to wake us, then look once more, in case
+        // it queued something before it could see the flag
+        atomic_fetch_or(&shared->sq_flags, IORING_SQ_NEED_WAKEUP);
+        if (atomic_load(&shared->sq_tail) == atomic_load(&shared->sq_head))
+        {
+            event_t* events[] = { &ring->sq_event };
+            event_await(events, 1, true);
+        }
+        atomic_fetch_and(&shared->sq_flags, ~IORING_SQ_NEED_WAKEUP);
+        idle_since = timer_get_nanos();
+    }
+}
+
+// put the ring somewhere in the process, out of the way of its other
+// anonymous mappings
+static bool ioring_map(ioring_t* ring, uint64_t* address)
+{
+    process_t* process = ring->process;
+    uint64_t virt = atomic_fetch_add(
+        (_Atomic uint64_t*)&process->mmap_anon_non_fixed_base, ring->size);
+    if (!mmap_map_range(process->pagemap, virt, ring->phys, ring->size,
+        MMAP_PROT_READ | MMAP_PROT_WRITE, MMAP_MAP_SHARED))
+    {
+        return false;
+    }
+    *address = virt;
+    return true;
+}
+
+// undo a setup which failed after the ring's slot was reserved, taking it
+// back out of the process if it was mapped (`address` isn't 0)
+static void ioring_abandon(ioring_t* ring, int64_t id, uint64_t address)
+{
+    process_t* process = ring->process;
+    if (address != 0)
+    {
+        rwsem_acquire_write(&process->pagemap->lock);
+        munmap(process->pagemap, address, ring->size);
+        rwsem_release_write(&process->pagemap->lock);
+    }
+    atomic_store(&process->iorings[id], NULL);
+    pmm_free((void*)ring->phys, ring->size / PAGE_SIZE);
+    free(ring);
+}
+
+static int64_t ioring_setup(ioring_params_t* params)
+{
+    if ((uint64_t)params >= SYSCALL_USER_ADDRESS_LIMIT)
+    {
+        return -EFAULT;
+    }
+    if (params->sq_entries == 0 || params->sq_entries > IORING_MAX_ENTRIES
+        || (params->flags & ~IORING_SETUP_SQPOLL) != 0)
+    {
+        return -EINVAL;
+    }
+
+    uint32_t sq_entries = 1;
+    while (sq_entries < params->sq_entries)
+    {
+        sq_entries <<= 1;
+    }
+    uint32_t cq_entries = sq_entries * 2;
+
+    process_t* process = get_current_thread()->process;
+    ioring_t* ring = malloc(sizeof(ioring_t));
+    if (ring == NULL)
+    {
+        return -ENOMEM;
+    }
+    ring->process = process;
+    ring->flags = params->flags;
+    ring->sq_idle_nanos = (uint64_t)params->sq_idle_millis * 1000000;
+
+    uint64_t sq_offset = align_up(sizeof(ioring_shared_t), CACHE_LINE_SIZE);
+    uint64_t cq_offset = sq_offset + sq_entries * sizeof(ioring_sqe_t);
+    ring->size = align_up(cq_offset + cq_entries * sizeof(ioring_cqe_t), PAGE_SIZE);
+    ring->phys = (uint64_t)pmm_alloc(ring->size / PAGE_SIZE);
+    if (ring->phys == 0)
+    {
+        free(ring);
+        return -ENOMEM;
+    }
+
+    // pmm_alloc has zeroed the heads and tails
+    uint8_t* base = (uint8_t*)(ring->phys + HIGHER_HALF);
+    ring->shared = (ioring_shared_t*)base;
+    ring->sqes = (ioring_sqe_t*)(base + sq_offset);
+    ring->cqes = (ioring_cqe_t*)(base + cq_offset);
+    ring->shared->sq_entries = sq_entries;
+    ring->shared->sq_mask = sq_entries - 1;
+    ring->shared->cq_entries = cq_entries;
+    ring->shared->cq_mask = cq_entries - 1;
+    ring->shared->sq_offset = sq_offset;
+    ring->shared->cq_offset = cq_offset;
+
+    // the ring only goes into its slot once it's ready to use, so that
+    // nobody can get hold of it before then, or of one that failed
+    int64_t id = -1;
+    for (uint64_t i = 0; i < PROC_MAX_IORINGS && id < 0; i++)
+    {
+        ioring_t* expected = NULL;
+        if (atomic_compare_exchange_strong(&process->iorings[i], &expected, IORING_SLOT_RESERVED))
+        {
+            id = i;
+        }
+    }
+    if (id < 0)
+    {
+        pmm_free((void*)ring->phys, ring->size / PAGE_SIZE);
+        free(ring);
+        return -EBUSY;
+    }
+
+    uint64_t address = 0;
+    if (!ioring_map(ring, &address))
+    {
+        klog("ioring", "Failed to map ring %d into process %d", id, process->pid);
+        ioring_abandon(ring, id, 0);
+        return -ENOMEM;
+    }
+
+    thread_t* thread = NULL;
+    if ((ring->flags & IORING_SETUP_SQPOLL) != 0)
+    {
+        thread = new_kernel_thread(ioring_sq_thread, ring, false, NULL);
+        if (thread == NULL)
+        {
+            ioring_abandon(ring, id, address);
+            return -ENOMEM;
+        }
+        // the entries are reached through the kernel's mapping, but the
+        // buffers are the process's
+        thread->cr3 = (uint64_t)process->pagemap->top_level;
+        ring->sq_thread = thread;
+    }
+
+    atomic_store(&process->iorings[id], ring);
+    if (thread != NULL)
+    {
+        enqueue_thread(thread, false);
+    }
+
+    params->sq_entries = sq_entries;
+    params->cq_entries = cq_entries;
+    params->address = address;
+    params->size = ring->size;
+    return id;
+}
+
+int64_t syscall_ioring_setup(ioring_params_t* params)
+{
+    int64_t ret = ioring_setup(params);
+    if (ret < 0)
+    {
+        get_current_thread()->errno = -ret;
+        return -1;
+    }
+    return ret;
+}
+
+int64_t syscall_ioring_enter(uint64_t id, uint32_t to_submit, uint32_t min_complete, uint32_t flags)
+{
+    ioring_t* ring = ioring_get(get_current_thread()->process, id);
+    if (ring == NULL)
+    {
+        get_current_thread()->errno = EBADF;
+        return -1;
+    }
+
+    int64_t submitted = 0;
+    if (ring->sq_thread != NULL)
+    {
+        // the thread takes care of the SQ, all we can do is wake it
+        if ((flags & IORING_ENTER_SQ_WAKEUP) != 0)
+        {
+            event_trigger(&ring->sq_event, false);
+        }
+        submitted = to_submit;
+    }
+    else
+    {
+        submitted = ioring_submit(ring, to_submit);
+        if (submitted == 0 && to_submit != 0
+            && atomic_load(&ring->shared->sq_tail) != atomic_load(&ring->shared->sq_head))
+        {
+            // there's something to submit, but nowhere for it to complete
+            get_current_thread()->errno = EBUSY;
+            return -1;
+        }
+    }
+
+    if ((flags & IORING_ENTER_GETEVENTS) != 0)
+    {
+        int64_t ret = ioring_wait(ring, min_complete);
+        // what was submitted has been, so that's more important to report
+        // than being interrupted
+        if (ret < 0 && submitted == 0)
+        {
+            get_current_thread()->errno = -ret;
+            return -1;
+        }
+    }
+    else
+    {
+        ioring_reap_polls(ring);
+    }
+
+    return submitted;
+}
@@ -25,20 +25,21 @@ static size_t log_end = 0;
 extern bool have_term;
 extern bool have_malloc;
 
-lock_t klog_lock = {
-    .is_locked = false
-};
+// klog is called from interrupt handlers too, so this is always taken with
+// interrupts disabled
+mcs_lock_t klog_lock;
 
 void klog_putc(char c);
 
 void syscall_klog(const char* fmt, ...)
 {
-    lock_acquire(&klog_lock);
+    mcs_node_t node;
+    bool ints = mcs_lock_acquire_irqsave(&klog_lock, &node);
     va_list args;
     va_start(args, fmt);
     vklog("user", fmt, args);
     va_end(args);
-    lock_release(&klog_lock);
+    mcs_lock_release_irqrestore(&klog_lock, &node, ints);
 }
 
 void vklog(const char* module, const char* fmt, va_list args)
@@ -110,23 +111,25 @@ void vklog(const char* module, const char* fmt, va_list args)
 
 void klog(const char *module, const char *fmt, ...)
 {
-    lock_acquire(&klog_lock);
+    mcs_node_t node;
+    bool ints = mcs_lock_acquire_irqsave(&klog_lock, &node);
     va_list args;
     va_start(args, fmt);
     vklog(module, fmt, args);
     va_end(args);
-    lock_release(&klog_lock);
+    mcs_lock_release_irqrestore(&klog_lock, &node, ints);
 }
 
 #ifdef COTTAGE_DEBUG
 void klog_debug(const char* module, const char* fmt, ...)
 {
-    lock_acquire(&klog_lock);
+    mcs_node_t node;
+    bool ints = mcs_lock_acquire_irqsave(&klog_lock, &node);
     va_list args;
     va_start(args, fmt);
     vklog(module, fmt, args);
     va_end(args);
-    lock_release(&klog_lock);
+    mcs_lock_release_irqrestore(&klog_lock, &node, ints);
 }
 #endif
 
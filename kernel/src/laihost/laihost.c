@@ -213,9 +213,6 @@ void laihost_sleep(uint64_t ms)
 
 uint64_t laihost_timer()
 {
-    uint64_t tps = get_ticks_per_second();
-    uint64_t ticks = get_ticks();
-
     // reduce resolution of the timer down to 100ns as this is what LAI expects
-    return ticks / (tps * 10000); 
+    return timer_get_nanos() / 100;
 }
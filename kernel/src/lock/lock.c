@@ -1,51 +1,224 @@
 #include <lock/lock.h>
+#include <lock/lockstat.h>
 #include <stdatomic.h>
 #include <klog/klog.h>
 #include <panic.h>
+#include <time/timer.h>
+#include <cpu/cpu.h>
+#include <scheduler/preempt.h>
+#include <debug/ksym.h>
 
-void lock_acquire(lock_t* lock)
+// how long to spin before deciding the lock is never going to be released
+#define LOCK_DEADLOCK_NANOS 5000000000ull
+#define LOCK_CLOCK_CHECK_MASK 0xffff
+
+// spinlocks are only for short critical sections -- anything that might have
+// to wait a while should sleep on a wait queue instead.  So if we've been
+// spinning for seconds, something has gone badly wrong.  The clock is only
+// checked every so often, reading it isn't free.
+typedef struct {
+    uint64_t spins;
+    uint64_t deadline;
+} lock_watchdog_t;
+
+static void lock_log_caller(const char* what, uint64_t caller)
 {
-    uint64_t caller = (uint64_t) __builtin_return_address(0);
+    uint64_t offset = 0;
+    const char* name = ksym_lookup(caller, &offset);
+    if (name != NULL)
+        klog("lock", "%s: %llx (%s+%llx)", what, caller, name, offset);
+    else
+        klog("lock", "%s: %llx", what, caller);
+}
 
-    // I believe this magic number is just "a big number",
-    // that gives us as much chance as possible at getting the lock in time
-    // it should probably be abstracted out into some kind of compile time const,
-    // or configuration variable, but I can't be bothered right now.
-    for (uint64_t i = 0; i < 50000000; i++)
+static void lock_watchdog_check(lock_watchdog_t* watchdog, void* lock, uint64_t caller, uint64_t last_caller)
+{
+    if ((++watchdog->spins & LOCK_CLOCK_CHECK_MASK) != 0)
     {
-        if (lock_test_and_acquire(lock))
-        {
-            lock->caller = caller;
-            return;
-        }
-        asm volatile ( "pause" ::: "memory" );
+        return;
     }
 
-    // todo: implement tracing to get some symbolic names going and easier 
-    // debugging of deadlock conditions
-    klog("lock", "Lock address: %llx", (void*)lock);
-    klog("lock", "Current caller: %llx", caller);
-    klog("lock", "Last caller: %llx", lock->caller);
+    uint64_t now = timer_get_nanos();
+    if (watchdog->deadline == 0)
+    {
+        watchdog->deadline = now + LOCK_DEADLOCK_NANOS;
+        return;
+    }
+    if (now < watchdog->deadline)
+    {
+        return;
+    }
+
+    klog("lock", "Lock address: %llx", lock);
+    lock_log_caller("Current caller", caller);
+    lock_log_caller("Last caller", last_caller);
 
     panic("Deadlock detected");
 }
 
+static void lock_spin(lock_t* lock, uint64_t caller)
+{
+    uint32_t ticket = atomic_fetch_add_explicit(&lock->next, 1, memory_order_relaxed);
+    lock_watchdog_t watchdog = {0};
+    uint64_t start = LOCKSTAT_NOW();
+    bool contended = false;
+
+    while (atomic_load_explicit(&lock->owner, memory_order_acquire) != ticket)
+    {
+        contended = true;
+        asm volatile ( "pause" ::: "memory" );
+        lock_watchdog_check(&watchdog, lock, caller, lock->caller);
+    }
+    lock->caller = caller;
+    LOCKSTAT_ACQUIRED(lock, caller, start, contended);
+}
+
+void lock_acquire(lock_t* lock)
+{
+    // we mustn't be switched away from while other CPUs may be spinning on
+    // us, so this comes before taking the lock
+    preempt_disable();
+    lock_spin(lock, (uint64_t) __builtin_return_address(0));
+}
+
 void lock_release(lock_t* lock)
 {
-    atomic_store(&lock->is_locked, false);
+    lock_release_raw(lock);
+    // if the scheduler wanted the CPU while we held the lock, this is where
+    // it gets it
+    preempt_enable();
+}
+
+void lock_acquire_raw(lock_t* lock)
+{
+    lock_spin(lock, (uint64_t) __builtin_return_address(0));
+}
+
+void lock_release_raw(lock_t* lock)
+{
+    LOCKSTAT_RELEASED(lock);
+    // only the holder ever writes `owner`, so this needn't be atomic
+    uint32_t owner = atomic_load_explicit(&lock->owner, memory_order_relaxed);
+    atomic_store_explicit(&lock->owner, owner + 1, memory_order_release);
 }
 
 bool lock_test_and_acquire(lock_t* lock)
 {
-    uint64_t caller = (uint64_t) __builtin_return_address(0);
-    
-    bool expected = false;
-    bool new_value = true;
-    
-    if(atomic_compare_exchange_strong(&lock->is_locked, &expected, new_value))
+    preempt_disable();
+
+    // the lock is free if nobody has taken a ticket past the current owner's
+    uint32_t owner = atomic_load_explicit(&lock->owner, memory_order_relaxed);
+    uint32_t expected = owner;
+    if (atomic_compare_exchange_strong_explicit(&lock->next, &expected, owner + 1,
+        memory_order_acquire, memory_order_relaxed))
     {
-        lock->caller = caller;
+        lock->caller = (uint64_t) __builtin_return_address(0);
+        LOCKSTAT_ACQUIRED(lock, lock->caller, LOCKSTAT_NOW(), false);
+        return true;
     }
 
-    return lock->is_locked;
+    preempt_enable();
+    return false;
+}
+
+bool lock_acquire_irqsave(lock_t* lock)
+{
+    bool ints = cpu_interrupts_disable();
+    preempt_disable();
+    lock_spin(lock, (uint64_t) __builtin_return_address(0));
+    return ints;
+}
+
+void lock_release_irqrestore(lock_t* lock, bool ints)
+{
+    lock_release(lock);
+    cpu_interrupts_restore(ints);
+}
+
+static void mcs_lock_spin(mcs_lock_t* lock, mcs_node_t* node, uint64_t caller)
+{
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    atomic_store_explicit(&node->waiting, true, memory_order_relaxed);
+
+    // join the back of the queue
+    uint64_t start = LOCKSTAT_NOW();
+    mcs_node_t* prev = atomic_exchange_explicit(&lock->tail, node, memory_order_acq_rel);
+    if (prev != NULL)
+    {
+        atomic_store_explicit(&prev->next, node, memory_order_release);
+
+        lock_watchdog_t watchdog = {0};
+        while (atomic_load_explicit(&node->waiting, memory_order_acquire))
+        {
+            asm volatile ( "pause" ::: "memory" );
+            lock_watchdog_check(&watchdog, lock, caller, lock->caller);
+        }
+    }
+    lock->caller = caller;
+    LOCKSTAT_ACQUIRED(lock, caller, start, prev != NULL);
+}
+
+void mcs_lock_acquire(mcs_lock_t* lock, mcs_node_t* node)
+{
+    preempt_disable();
+    mcs_lock_spin(lock, node, (uint64_t) __builtin_return_address(0));
+}
+
+void mcs_lock_release(mcs_lock_t* lock, mcs_node_t* node)
+{
+    LOCKSTAT_RELEASED(lock);
+    mcs_node_t* next = atomic_load_explicit(&node->next, memory_order_acquire);
+    if (next == NULL)
+    {
+        // nobody's queued behind us, unless they're in the middle of it
+        mcs_node_t* expected = node;
+        if (atomic_compare_exchange_strong_explicit(&lock->tail, &expected, NULL,
+            memory_order_release, memory_order_relaxed))
+        {
+            preempt_enable();
+            return;
+        }
+
+        // someone has swapped themselves in as the tail, but hasn't linked
+        // themselves to us yet
+        while ((next = atomic_load_explicit(&node->next, memory_order_acquire)) == NULL)
+        {
+            asm volatile ( "pause" ::: "memory" );
+        }
+    }
+
+    atomic_store_explicit(&next->waiting, false, memory_order_release);
+    preempt_enable();
+}
+
+bool mcs_lock_test_and_acquire(mcs_lock_t* lock, mcs_node_t* node)
+{
+    preempt_disable();
+
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    mcs_node_t* expected = NULL;
+    if (atomic_compare_exchange_strong_explicit(&lock->tail, &expected, node,
+        memory_order_acquire, memory_order_relaxed))
+    {
+        lock->caller = (uint64_t) __builtin_return_address(0);
+        LOCKSTAT_ACQUIRED(lock, lock->caller, LOCKSTAT_NOW(), false);
+        return true;
+    }
+
+    preempt_enable();
+    return false;
+}
+
+bool mcs_lock_acquire_irqsave(mcs_lock_t* lock, mcs_node_t* node)
+{
+    bool ints = cpu_interrupts_disable();
+    preempt_disable();
+    mcs_lock_spin(lock, node, (uint64_t) __builtin_return_address(0));
+    return ints;
+}
+
+void mcs_lock_release_irqrestore(mcs_lock_t* lock, mcs_node_t* node, bool ints)
+{
+    mcs_lock_release(lock, node);
+    cpu_interrupts_restore(ints);
 }
@@ -0,0 +1,248 @@
+#include <lock/lockstat.h>
+
+#ifdef COTTAGE_LOCKSTAT
+
+#include <resource/resource.h>
+#include <fs/devtmpfs.h>
+#include <debug/ksym.h>
+#include <klog/klog.h>
+#include <mem/malloc.h>
+#include <stat/stat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Sites are found by hashing the caller's address into an open-addressed
+// table, and claimed with a compare-and-swap, so counting never takes a lock
+// of its own.  Each site has a line to itself, so that two hot locks don't
+// slow each other down through their statistics.
+static lockstat_site_t lockstat_sites[LOCKSTAT_SITES];
+static _Atomic uint64_t lockstat_dropped = 0;
+
+static resource_t lockstat_device;
+
+static lockstat_site_t* lockstat_find_site(uint64_t caller)
+{
+    uint64_t i = (caller * 0x9e3779b97f4a7c15ull) >> (64 - LOCKSTAT_SITE_BITS);
+    for (uint64_t probes = 0; probes < LOCKSTAT_SITES; probes++, i = (i + 1) % LOCKSTAT_SITES)
+    {
+        lockstat_site_t* site = &lockstat_sites[i];
+        uint64_t current = atomic_load_explicit(&site->caller, memory_order_acquire);
+        if (current == caller)
+        {
+            return site;
+        }
+        if (current == 0)
+        {
+            uint64_t expected = 0;
+            if (atomic_compare_exchange_strong(&site->caller, &expected, caller) || expected == caller)
+            {
+                return site;
+            }
+        }
+    }
+
+    atomic_fetch_add_explicit(&lockstat_dropped, 1, memory_order_relaxed);
+    return NULL;
+}
+
+static void lockstat_update_max(_Atomic uint64_t* max, uint64_t value)
+{
+    uint64_t current = atomic_load_explicit(max, memory_order_relaxed);
+    while (value > current && !atomic_compare_exchange_weak_explicit(max, &current, value,
+        memory_order_relaxed, memory_order_relaxed))
+    {
+        // someone else raised it in the meantime, try again
+    }
+}
+
+void lockstat_acquired(lockstat_hold_t* hold, void* lock, uint64_t caller, uint64_t start, bool contended)
+{
+    uint64_t now = cpu_rdtsc();
+    lockstat_site_t* site = lockstat_find_site(caller);
+
+    hold->site = site;
+    hold->acquired_at = now;
+    if (site == NULL)
+    {
+        return;
+    }
+
+    atomic_store_explicit(&site->lock, (uint64_t)lock, memory_order_relaxed);
+    atomic_fetch_add_explicit(&site->acquisitions, 1, memory_order_relaxed);
+    if (contended)
+    {
+        uint64_t waited = now - start;
+        atomic_fetch_add_explicit(&site->contended, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&site->wait_cycles, waited, memory_order_relaxed);
+        lockstat_update_max(&site->wait_max, waited);
+    }
+}
+
+void lockstat_released(lockstat_hold_t* hold)
+{
+    lockstat_site_t* site = hold->site;
+    if (site == NULL)
+    {
+        return;
+    }
+
+    uint64_t held = cpu_rdtsc() - hold->acquired_at;
+    atomic_fetch_add_explicit(&site->hold_cycles, held, memory_order_relaxed);
+    lockstat_update_max(&site->hold_max, held);
+}
+
+typedef struct {
+    uint64_t caller;
+    uint64_t lock;
+    uint64_t acquisitions;
+    uint64_t contended;
+    uint64_t wait_cycles;
+    uint64_t wait_max;
+    uint64_t hold_cycles;
+    uint64_t hold_max;
+} lockstat_snapshot_t;
+
+// most time spent waiting first
+static int lockstat_compare(const void* a, const void* b)
+{
+    uint64_t wait_a = ((const lockstat_snapshot_t*)a)->wait_cycles;
+    uint64_t wait_b = ((const lockstat_snapshot_t*)b)->wait_cycles;
+    return wait_a > wait_b ? -1 : wait_a < wait_b;
+}
+
+#define LOCKSTAT_HEADER "wait-total wait-max contended acquired hold-total hold-max lock site\n"
+// everything on a line but the symbol name
+#define LOCKSTAT_LINE_MAX 192
+
+// render the whole table as text, returning its length
+static uint64_t lockstat_render(char** out)
+{
+    lockstat_snapshot_t* snapshot = malloc(sizeof(lockstat_snapshot_t) * LOCKSTAT_SITES);
+    uint64_t count = 0;
+    for (uint64_t i = 0; i < LOCKSTAT_SITES; i++)
+    {
+        lockstat_site_t* site = &lockstat_sites[i];
+        if (atomic_load(&site->caller) == 0)
+            continue;
+
+        snapshot[count++] = (lockstat_snapshot_t){
+            .caller = atomic_load(&site->caller),
+            .lock = atomic_load(&site->lock),
+            .acquisitions = atomic_load(&site->acquisitions),
+            .contended = atomic_load(&site->contended),
+            .wait_cycles = atomic_load(&site->wait_cycles),
+            .wait_max = atomic_load(&site->wait_max),
+            .hold_cycles = atomic_load(&site->hold_cycles),
+            .hold_max = atomic_load(&site->hold_max),
+        };
+    }
+    qsort(snapshot, count, sizeof(lockstat_snapshot_t), lockstat_compare);
+
+    uint64_t capacity = sizeof(LOCKSTAT_HEADER) + LOCKSTAT_LINE_MAX;
+    for (uint64_t i = 0; i < count; i++)
+    {
+        uint64_t offset = 0;
+        const char* name = ksym_lookup(snapshot[i].caller, &offset);
+        capacity += LOCKSTAT_LINE_MAX + (name != NULL ? strlen(name) : 0);
+    }
+
+    char* text = malloc(capacity);
+    uint64_t length = snprintf(text, capacity, LOCKSTAT_HEADER);
+    for (uint64_t i = 0; i < count; i++)
+    {
+        lockstat_snapshot_t* s = &snapshot[i];
+        length += snprintf(text + length, capacity - length, "%lu %lu %lu %lu %lu %lu %lx ",
+            s->wait_cycles, s->wait_max, s->contended, s->acquisitions,
+            s->hold_cycles, s->hold_max, s->lock);
+
+        uint64_t offset = 0;
+        const char* name = ksym_lookup(s->caller, &offset);
+        if (name != NULL)
+            length += snprintf(text + length, capacity - length, "%s+%lx\n", name, offset);
+        else
+            length += snprintf(text + length, capacity - length, "%lx\n", s->caller);
+    }
+
+    uint64_t dropped = atomic_load(&lockstat_dropped);
+    if (dropped != 0)
+    {
+        length += snprintf(text + length, capacity - length, "# %lu acquisitions from untracked sites\n", dropped);
+    }
+
+    free(snapshot);
+    *out = text;
+    return length;
+}
+
+static int64_t lockstat_read(__attribute__((unused)) resource_t* self, __attribute__((unused)) void* handle,
+    void* buf, uint64_t loc, uint64_t count)
+{
+    char* text = NULL;
+    uint64_t length = lockstat_render(&text);
+    if (loc >= length)
+    {
+        free(text);
+        return 0;
+    }
+    if (count > length - loc)
+    {
+        count = length - loc;
+    }
+    memcpy(buf, text + loc, count);
+    free(text);
+    return count;
+}
+
+// writing anything clears the counts, but keeps the sites we know about
+static int64_t lockstat_write(__attribute__((unused)) resource_t* self, __attribute__((unused)) void* handle,
+    __attribute__((unused)) void* buf, __attribute__((unused)) uint64_t loc, uint64_t count)
+{
+    for (uint64_t i = 0; i < LOCKSTAT_SITES; i++)
+    {
+        lockstat_site_t* site = &lockstat_sites[i];
+        atomic_store(&site->acquisitions, 0);
+        atomic_store(&site->contended, 0);
+        atomic_store(&site->wait_cycles, 0);
+        atomic_store(&site->wait_max, 0);
+        atomic_store(&site->hold_cycles, 0);
+        atomic_store(&site->hold_max, 0);
+    }
+    atomic_store(&lockstat_dropped, 0);
+    return count;
+}
+
+static int lockstat_ioctl(__attribute__((unused)) resource_t* self, void* handle, uint64_t request, void* argp)
+{
+    return resource_default_ioctl(handle, request, argp);
+}
+
+static bool lockstat_unref(__attribute__((unused)) resource_t* self, __attribute__((unused)) void* handle)
+{
+    return true;
+}
+
+void lockstat_init()
+{
+    lockstat_device.read = lockstat_read;
+    lockstat_device.write = lockstat_write;
+    lockstat_device.ioctl = lockstat_ioctl;
+    lockstat_device.unref = lockstat_unref;
+    lockstat_device.stat.size = 0;
+    lockstat_device.stat.blocks = 0;
+    lockstat_device.stat.block_size = 4096;
+    lockstat_device.stat.rdev = resource_create_dev_id();
+    lockstat_device.stat.mode = 0644 | STAT_IFCHR;
+
+    devtmpfs_add_device(&lockstat_device, "lockstat");
+    klog("lockstat", "Lock statistics available from /dev/lockstat");
+}
+
+#else
+
+void lockstat_init()
+{
+}
+
+#endif
@@ -0,0 +1,117 @@
+#include <lock/mutex.h>
+#include <scheduler/preempt.h>
+#include <lock/rcu.h>
+#include <proc/proc.h>
+#include <klog/klog.h>
+#include <panic.h>
+
+#include <stddef.h>
+
+static bool mutex_try(mutex_t* mutex, thread_t* thread)
+{
+    thread_t* expected = NULL;
+    return atomic_compare_exchange_strong(&mutex->owner, &expected, thread);
+}
+
+// spin for as long as whoever holds the mutex is running, since it should
+// let go soon, but not for longer than MUTEX_SPIN_MAX goes or once someone
+// else should have our CPU.  Returns whether we got the mutex.
+static bool mutex_spin(mutex_t* mutex, thread_t* thread)
+{
+    for (uint64_t spins = 0; spins < MUTEX_SPIN_MAX; spins++)
+    {
+        if (atomic_load(&thread->need_resched))
+        {
+            return false;
+        }
+
+        // the owner may exit as soon as it lets go, but exited threads are
+        // freed through RCU, so it's still there to be looked at until we
+        // leave the reader section
+        rcu_read_lock();
+        thread_t* owner = atomic_load(&mutex->owner);
+        if (owner == NULL)
+        {
+            rcu_read_unlock();
+            if (mutex_try(mutex, thread))
+            {
+                return true;
+            }
+            continue;
+        }
+        bool running = atomic_load(&owner->cpuid) != (uint64_t)-1;
+        rcu_read_unlock();
+
+        // it's asleep, or waiting for a CPU, so it could be a while
+        if (!running)
+        {
+            return false;
+        }
+
+        asm volatile ( "pause" ::: "memory" );
+    }
+    return false;
+}
+
+void mutex_acquire(mutex_t* mutex)
+{
+    thread_t* thread = get_current_thread();
+
+    if (mutex_try(mutex, thread))
+    {
+        return;
+    }
+    if (atomic_load(&mutex->owner) == thread)
+    {
+        panic("Thread %d took a mutex it already holds", thread->tid);
+    }
+    if (preempt_count() != 0)
+    {
+        panic("Sleeping on a mutex with preemption disabled");
+    }
+    if (mutex_spin(mutex, thread))
+    {
+        return;
+    }
+
+    lock_acquire(&mutex->waiters.lock);
+    // mutex_release drops the owner before looking at sleepers, and we bump
+    // sleepers before trying again, so either we see the mutex free or the
+    // releaser sees us and wakes us up
+    atomic_fetch_add(&mutex->sleepers, 1);
+    while (!mutex_try(mutex, thread))
+    {
+        wait_queue_wait(&mutex->waiters);
+    }
+    atomic_fetch_sub(&mutex->sleepers, 1);
+    lock_release(&mutex->waiters.lock);
+}
+
+void mutex_release(mutex_t* mutex)
+{
+    if (atomic_load(&mutex->owner) != get_current_thread())
+    {
+        panic("Released a mutex held by someone else");
+    }
+
+    atomic_store(&mutex->owner, NULL);
+
+    if (atomic_load(&mutex->sleepers) != 0)
+    {
+        // the mutex isn't handed over, whoever we wake has to race for it
+        // like everyone else, which keeps the mutex busy in the meantime
+        lock_acquire(&mutex->waiters.lock);
+        wait_queue_wake(&mutex->waiters, 1);
+        lock_release(&mutex->waiters.lock);
+    }
+}
+
+bool mutex_test_and_acquire(mutex_t* mutex)
+{
+    return mutex_try(mutex, get_current_thread());
+}
+
+bool mutex_is_held(mutex_t* mutex)
+{
+    return atomic_load(&mutex->owner) != NULL;
+}
@@ -0,0 +1,213 @@
+#include <lock/rcu.h>
+#include <cpu/smp.h>
+#include <cpu/percpu.h>
+#include <cpu/cpu.h>
+#include <scheduler/scheduler.h>
+#include <scheduler/event.h>
+#include <time/timer.h>
+#include <klog/klog.h>
+#include <macro.h>
+#include <panic.h>
+
+#include <stddef.h>
+
+// Grace periods are numbered.  When one starts, the grace period thread bumps
+// rcu_gp_seq, and each CPU copies the new number into its rcu_qs_seq the
+// next time it's somewhere no reader can be.  Once every CPU has caught up
+// (or is idle), everything queued before the bump can be called.
+
+static _Atomic uint64_t rcu_gp_seq = 0;
+// triggered when a CPU's callback list stops being empty
+static event_t rcu_gp_event;
+
+typedef struct {
+    rcu_head_t head;
+    event_t done;
+} rcu_waiter_t;
+
+void rcu_note_qs(local_cpu_t* cpu)
+{
+    uint64_t gp = atomic_load(&rcu_gp_seq);
+    // a busy CPU comes through here every tick, so only write when there's
+    // something new to say
+    if (atomic_load_explicit(&cpu->rcu_qs_seq, memory_order_relaxed) != gp)
+    {
+        atomic_store(&cpu->rcu_qs_seq, gp);
+    }
+}
+
+void rcu_idle_enter(local_cpu_t* cpu)
+{
+    rcu_note_qs(cpu);
+    atomic_store(&cpu->rcu_idle, true);
+}
+
+void rcu_irq_enter()
+{
+    // before this, GS isn't necessarily pointing at anything
+    if (!atomic_load(&scheduler_ready))
+    {
+        return;
+    }
+
+    // the handler may read things, so an idle CPU stops counting as
+    // quiescent until it's done
+    local_cpu_t* cpu = this_cpu_read(self);
+    // taken while running bottom halves, inside an interrupt which has
+    // already done this
+    if (cpu->in_softirq)
+    {
+        return;
+    }
+    cpu->rcu_irq_from_idle = atomic_exchange(&cpu->rcu_idle, false);
+}
+
+void rcu_irq_exit()
+{
+    if (!atomic_load(&scheduler_ready))
+    {
+        return;
+    }
+
+    if (this_cpu_read(in_softirq))
+    {
+        return;
+    }
+    // if the scheduler switched to a thread, we never get here, and the
+    // stale flag is overwritten by the next rcu_irq_enter
+    if (this_cpu_read(rcu_irq_from_idle))
+    {
+        local_cpu_t* cpu = this_cpu_read(self);
+        cpu->rcu_irq_from_idle = false;
+        atomic_store(&cpu->rcu_idle, true);
+    }
+}
+
+static bool rcu_cpu_quiescent(local_cpu_t* cpu, uint64_t gp)
+{
+    return atomic_load(&cpu->rcu_idle) || atomic_load(&cpu->rcu_qs_seq) >= gp;
+}
+
+static bool rcu_gp_done(uint64_t gp)
+{
+    for (uint64_t i = 0; i < cpu_count; i++)
+    {
+        if (!rcu_cpu_quiescent(local_cpus[i], gp))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// a CPU with its tick stopped may not pass through the scheduler for a long
+// time, so give it a reason to
+static void rcu_kick_stragglers(uint64_t gp)
+{
+    for (uint64_t i = 0; i < cpu_count; i++)
+    {
+        if (!rcu_cpu_quiescent(local_cpus[i], gp))
+        {
+            scheduler_kick_timer(local_cpus[i]);
+        }
+    }
+}
+
+// take every CPU's queued callbacks, oldest first
+static rcu_head_t* rcu_collect()
+{
+    rcu_head_t* batch = NULL;
+    for (uint64_t i = 0; i < cpu_count; i++)
+    {
+        // each list is newest first, so this puts it back in order
+        rcu_head_t* head = atomic_exchange(&local_cpus[i]->rcu_callbacks, NULL);
+        while (head != NULL)
+        {
+            rcu_head_t* next = head->next;
+            head->next = batch;
+            batch = head;
+            head = next;
+        }
+    }
+    return batch;
+}
+
+static void rcu_gp_thread(__attribute__((unused)) void* arg)
+{
+    event_t* events[] = { &rcu_gp_event };
+
+    for (;;)
+    {
+        rcu_head_t* batch = rcu_collect();
+        if (batch == NULL)
+        {
+            event_await(events, 1, true);
+            continue;
+        }
+
+        uint64_t gp = atomic_fetch_add(&rcu_gp_seq, 1) + 1;
+        for (uint64_t polls = 1; !rcu_gp_done(gp); polls++)
+        {
+            if (polls % RCU_GP_KICK_POLLS == 0)
+            {
+                rcu_kick_stragglers(gp);
+            }
+            sleep(RCU_GP_POLL_MILLIS);
+        }
+
+        while (batch != NULL)
+        {
+            // the callback probably frees the head
+            rcu_head_t* next = batch->next;
+            batch->func(batch);
+            batch = next;
+        }
+    }
+}
+
+void call_rcu(rcu_head_t* head, rcu_callback_t func)
+{
+    head->func = func;
+
+    bool ints = cpu_interrupts_disable();
+    local_cpu_t* cpu = cpu_get_current();
+    // the grace period thread may be taking the list at the same time
+    rcu_head_t* old = atomic_load(&cpu->rcu_callbacks);
+    do
+    {
+        head->next = old;
+    } while (!atomic_compare_exchange_weak(&cpu->rcu_callbacks, &old, head));
+    cpu_interrupts_restore(ints);
+
+    if (old == NULL)
+    {
+        event_trigger(&rcu_gp_event, false);
+    }
+}
+
+static void rcu_wake_waiter(rcu_head_t* head)
+{
+    rcu_waiter_t* waiter = CONTAINER_OF(head, rcu_waiter_t, head);
+    event_trigger(&waiter->done, false);
+}
+
+void synchronize_rcu()
+{
+    rcu_waiter_t waiter = {0};
+    event_t* events[] = { &waiter.done };
+
+    call_rcu(&waiter.head, rcu_wake_waiter);
+    while (event_await(events, 1, true) < 0)
+    {
+        // woken up by something else, go back to sleep
+    }
+}
+
+void rcu_init()
+{
+    if (new_kernel_thread(rcu_gp_thread, NULL, true, NULL) == NULL)
+    {
+        panic("Couldn't start the RCU grace period thread");
+    }
+    klog("rcu", "Started the grace period thread");
+}
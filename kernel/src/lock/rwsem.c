@@ -0,0 +1,161 @@
+#include <lock/rwsem.h>
+#include <lock/mutex.h>
+#include <lock/rcu.h>
+#include <scheduler/preempt.h>
+#include <proc/proc.h>
+#include <panic.h>
+
+#include <stddef.h>
+
+bool rwsem_test_and_acquire_read(rwsem_t* sem)
+{
+    uint64_t count = atomic_load(&sem->count);
+    while ((count & RWSEM_WRITER) == 0 && atomic_load(&sem->writers_waiting) == 0)
+    {
+        if (atomic_compare_exchange_weak(&sem->count, &count, count + RWSEM_READER))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool rwsem_test_and_acquire_write(rwsem_t* sem)
+{
+    uint64_t expected = 0;
+    if (!atomic_compare_exchange_strong(&sem->count, &expected, RWSEM_WRITER))
+    {
+        return false;
+    }
+    atomic_store(&sem->owner, get_current_thread());
+    return true;
+}
+
+static void rwsem_might_sleep()
+{
+    if (preempt_count() != 0)
+    {
+        panic("Sleeping on a semaphore with preemption disabled");
+    }
+}
+
+// wake everyone up and let them sort out between themselves who gets it.
+// Whoever can't have it yet goes straight back to sleep.
+static void rwsem_wake(rwsem_t* sem)
+{
+    // the release before this and the sleepers count on the way into
+    // the wait queue order against each other the same way as for mutexes,
+    // see mutex_acquire
+    if (atomic_load(&sem->sleepers) == 0)
+    {
+        return;
+    }
+
+    lock_acquire(&sem->waiters.lock);
+    wait_queue_wake(&sem->waiters, UINT64_MAX);
+    lock_release(&sem->waiters.lock);
+}
+
+void rwsem_acquire_read(rwsem_t* sem)
+{
+    if (rwsem_test_and_acquire_read(sem))
+    {
+        return;
+    }
+    rwsem_might_sleep();
+
+    lock_acquire(&sem->waiters.lock);
+    atomic_fetch_add(&sem->sleepers, 1);
+    while (!rwsem_test_and_acquire_read(sem))
+    {
+        wait_queue_wait(&sem->waiters);
+    }
+    atomic_fetch_sub(&sem->sleepers, 1);
+    lock_release(&sem->waiters.lock);
+}
+
+void rwsem_release_read(rwsem_t* sem)
+{
+    uint64_t count = atomic_fetch_sub(&sem->count, RWSEM_READER);
+    if (count == RWSEM_READER)
+    {
+        // that was the last reader, a writer may be waiting
+        rwsem_wake(sem);
+    }
+}
+
+// spin while another writer has it and is running, like mutexes do, and
+// for no longer than they do.  Readers can't be spun on, we don't know which
+// threads they are.
+static bool rwsem_spin_write(rwsem_t* sem, thread_t* thread)
+{
+    for (uint64_t spins = 0; spins < MUTEX_SPIN_MAX; spins++)
+    {
+        if (rwsem_test_and_acquire_write(sem))
+        {
+            return true;
+        }
+        if (atomic_load(&thread->need_resched))
+        {
+            return false;
+        }
+
+        // exited threads are freed through RCU, see mutex_spin
+        rcu_read_lock();
+        thread_t* owner = atomic_load(&sem->owner);
+        bool running = owner != NULL && atomic_load(&owner->cpuid) != (uint64_t)-1;
+        rcu_read_unlock();
+
+        if (!running)
+        {
+            return false;
+        }
+
+        asm volatile ( "pause" ::: "memory" );
+    }
+    return false;
+}
+
+void rwsem_acquire_write(rwsem_t* sem)
+{
+    if (rwsem_test_and_acquire_write(sem))
+    {
+        return;
+    }
+    thread_t* thread = get_current_thread();
+    if (atomic_load(&sem->owner) == thread)
+    {
+        panic("Thread took a semaphore for writing while already writing");
+    }
+    rwsem_might_sleep();
+    if (rwsem_spin_write(sem, thread))
+    {
+        return;
+    }
+
+    lock_acquire(&sem->waiters.lock);
+    atomic_fetch_add(&sem->sleepers, 1);
+    // keeps new readers out until we've had our turn
+    atomic_fetch_add(&sem->writers_waiting, 1);
+    while (!rwsem_test_and_acquire_write(sem))
+    {
+        wait_queue_wait(&sem->waiters);
+    }
+    atomic_fetch_sub(&sem->writers_waiting, 1);
+    atomic_fetch_sub(&sem->sleepers, 1);
+    lock_release(&sem->waiters.lock);
+}
+
+void rwsem_release_write(rwsem_t* sem)
+{
+    atomic_store(&sem->owner, NULL);
+    atomic_fetch_sub(&sem->count, RWSEM_WRITER);
+    rwsem_wake(sem);
+}
+
+void rwsem_downgrade(rwsem_t* sem)
+{
+    atomic_store(&sem->owner, NULL);
+    atomic_fetch_add(&sem->count, RWSEM_READER - RWSEM_WRITER);
+    rwsem_wake(sem);
+}
@@ -0,0 +1,26 @@
+#include <lock/seqlock.h>
+
+void seqlock_write_lock(seqlock_t* sl)
+{
+    lock_acquire(&sl->lock);
+    seqcount_write_begin(&sl->seq);
+}
+
+void seqlock_write_unlock(seqlock_t* sl)
+{
+    seqcount_write_end(&sl->seq);
+    lock_release(&sl->lock);
+}
+
+bool seqlock_write_lock_irqsave(seqlock_t* sl)
+{
+    bool ints = lock_acquire_irqsave(&sl->lock);
+    seqcount_write_begin(&sl->seq);
+    return ints;
+}
+
+void seqlock_write_unlock_irqrestore(seqlock_t* sl, bool ints)
+{
+    seqcount_write_end(&sl->seq);
+    lock_release_irqrestore(&sl->lock, ints);
+}
@@ -1,9 +1,14 @@
 #include <acpi/acpi.h>
 #include <scheduler/scheduler.h>
+#include <scheduler/workqueue.h>
+#include <lock/rcu.h>
+#include <lock/lockstat.h>
 #include <devicetree/dtb.h>
 #include <interrupt/idt.h>
 #include <interrupt/isr.h>
+#include <interrupt/softirq.h>
 #include <klog/klog.h>
+#include <debug/ksym.h>
 #include <limine.h>
 #include <mem/vmm.h>
 #include <mem/pmm.h>
@@ -15,13 +20,16 @@
 #include <term/term.h>
 #include <pci/pci.h>
 #include <cpu/smp.h>
+#include <cpu/isolation.h>
 #include <gdt/gdt.h>
 #include <time/pit.h>
 #include <time/timer.h>
+#include <time/clocksource.h>
 #include <sys/syscall.h>
 #include <socket/socket.h>
 #include <pipe/pipe.h>
 #include <futex/futex.h>
+#include <sys/systrace.h>
 #include <fs/fs.h>
 #include <initramfs/initramfs.h>
 #include <streams/streams.h>
@@ -91,6 +99,11 @@ static volatile struct limine_module_request module_request = {
     .revision = 0,
 };
 
+static volatile struct limine_kernel_file_request kernel_file_request = {
+    .id = LIMINE_KERNEL_FILE_REQUEST,
+    .revision = 0,
+};
+
 void* g_framebuffer;
 
 void kmain_thread(void* arg);
@@ -209,9 +222,20 @@ void _start(void)
     // pci_init();
     // klog("main", "PCI devices enumerated");
 
+    if (kernel_file_request.response != NULL)
+    {
+        klog("main", "Kernel command line: %s", kernel_file_request.response->kernel_file->cmdline);
+        isolation_parse_cmdline(kernel_file_request.response->kernel_file->cmdline);
+        ksym_init(kernel_file_request.response->kernel_file, kernel_address_request.response->virtual_base);
+    }
+
+    // before the other CPUs come up, so they can use the TSC deadline timer
+    clocksource_init();
+
     klog("main", "Initializing SMP");
     klog("main", "SMP response was: %x", smp_request.response);
     smp_init(smp_request.response);
+    isolation_init();
     klog("main", "SMP initialized");
 
     klog("main", "Initializing high resolution timer");
@@ -228,10 +252,13 @@ void _start(void)
 
     klog("main", "Initializing scheduler");
     scheduler_init();
+    softirq_init();
+    workqueue_init();
+    rcu_init();
     klog("main", "Scheduler initialized");
 
     klog("main", "Kernel main thread starts at %x", kmain_thread);
-    new_kernel_thread(kmain_thread, NULL, true);
+    new_kernel_thread(kmain_thread, NULL, true, NULL);
 
     klog("main", "Pre-startup complete");
     scheduler_await();
@@ -296,6 +323,9 @@ void kmain_thread(void* arg)
     random_init();
     klog("main", "/dev/random initialized");
 
+    lockstat_init();
+    systrace_init();
+
     klog("main", "Initializing console");
     // todo: write console_init
     //console_init();
@@ -2,7 +2,8 @@
 #include <mem/vmm.h>
 #include <mem/mmap.h>
 #include <mem/align.h>
-#include <lock/lock.h>
+#include <lock/rwsem.h>
+#include <scheduler/preempt.h>
 #include <panic.h>
 
 #include <stdlib.h>
@@ -67,15 +68,16 @@ bool mmap_map_range(pagemap_t* pagemap, uint64_t virt, uint64_t phys, uint64_t s
 
     range_global->shadow_pagemap.top_level = pmm_alloc(1);
 
-    lock_acquire(&pagemap->lock);
+    rwsem_acquire_write(&pagemap->lock);
     pagemap->mmap_ranges = realloc(pagemap->mmap_ranges, sizeof(void*) * pagemap->mmap_range_count+1);
     pagemap->mmap_ranges[pagemap->mmap_range_count] = range_local;
     pagemap->mmap_range_count++;
-    lock_release(&pagemap->lock);
+    rwsem_release_write(&pagemap->lock);
 
     for(uint64_t i = 0; i < length; i+= PAGE_SIZE)
     {
         mmap_map_page_in_range(range_global, virt_addr + i, phys + i, prot);
+        cond_resched();
     }
     return true;
 }
@@ -189,7 +191,7 @@ pagemap_t* mmap_fork_pagemap(pagemap_t* old_pagemap)
     pagemap_t* pagemap = malloc(sizeof(pagemap_t));
     *pagemap = new_pagemap();
 
-    lock_acquire(&old_pagemap->lock);
+    rwsem_acquire_read(&old_pagemap->lock);
 
     for(size_t i = 0; i < old_pagemap->mmap_range_count; i++)
     {
@@ -220,7 +222,7 @@ pagemap_t* mmap_fork_pagemap(pagemap_t* old_pagemap)
                 if(old_pte == NULL) continue;
                 uint64_t* new_pte = virt2pte(pagemap, i, true);
                 if(new_pte == NULL) {
-                    lock_release(&old_pagemap->lock);
+                    rwsem_release_read(&old_pagemap->lock);
                     return NULL;
                 }
                 new_pte[0] = old_pte[0];
@@ -247,19 +249,21 @@ pagemap_t* mmap_fork_pagemap(pagemap_t* old_pagemap)
                     uint64_t* new_pte = virt2pte(pagemap, i, true);
                     if(new_pte == NULL) 
                     {
-                        lock_release(&old_pagemap->lock);
+                        rwsem_release_read(&old_pagemap->lock);
                         return NULL;
                     }
                     uint64_t* new_spte = virt2pte(&new_global_range->shadow_pagemap, i, true);
                     if(new_spte == NULL) 
                     {
-                        lock_release(&old_pagemap->lock);
+                        rwsem_release_read(&old_pagemap->lock);
                         return NULL;
                     }
                     void* page = pmm_alloc(1);
                     memcpy(page + HIGHER_HALF, (void*) (old_pte[0] & (~(uint64_t)0xfff)) + HIGHER_HALF, PAGE_SIZE);
                     new_pte[0] = (old_pte[0] & (uint64_t)0xfff) | (uint64_t)page;
                     new_spte[0] = new_pte[0];
+                    // the pagemap lock sleeps, so holding it here is fine
+                    cond_resched();
                 }
             }
             else
@@ -273,6 +277,6 @@ pagemap_t* mmap_fork_pagemap(pagemap_t* old_pagemap)
         pagemap->mmap_range_count++;
     }
 
-    lock_release(&old_pagemap->lock);
+    rwsem_release_read(&old_pagemap->lock);
     return pagemap;
 }
@@ -97,7 +97,7 @@ void switch_pagemap(pagemap_t* pagemap)
 bool virt2phys(pagemap_t* pagemap, uint64_t virt_addr, uint64_t* phys)
 {
     uint64_t* pte_p = virt2pte(pagemap, virt_addr, false);
-    if((pte_p[0] & 1) == 0)
+    if(pte_p == NULL || (pte_p[0] & 1) == 0)
         return false;
     *phys = pte_p[0] & ~(uint64_t)0xfff;
     return true;
@@ -185,7 +185,7 @@ pagemap_t new_pagemap()
 bool delete_pagemap(pagemap_t* pagemap)
 {
     bool rv = true;
-    lock_acquire(&pagemap->lock);
+    rwsem_acquire_write(&pagemap->lock);
 
     for(size_t i = 0; i < pagemap->mmap_range_count; i++)
     {
@@ -199,8 +199,8 @@ bool delete_pagemap(pagemap_t* pagemap)
 
     }
 
+    rwsem_release_write(&pagemap->lock);
     free(pagemap);
-	
-    lock_release(&pagemap->lock);
+
     return rv;
 }
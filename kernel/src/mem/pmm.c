@@ -8,6 +8,7 @@
 #include <string.h>
 #include <mem/slaballoc.h>
 #include <lock/lock.h>
+#include <scheduler/preempt.h>
 
 void bitmap_setbit(size_t index);
 void bitmap_resetbit(size_t index);
@@ -20,7 +21,9 @@ static void* pmm_bitmap;
 static size_t free_pages;
 
 // mutex for syncing alloc/free calls
-static lock_t pmm_lock;
+// every allocation and free goes through this, so it's queued to keep it
+// fair and cheap to hand over when lots of CPUs want it
+static mcs_lock_t pmm_lock;
 
 void pmm_init(struct limine_memmap_response* memmap)
 {
@@ -121,7 +124,8 @@ void* inner_alloc(size_t count, size_t limit)
 
 void* pmm_alloc(size_t count)
 {
-    lock_acquire(&pmm_lock);
+    mcs_node_t node;
+    mcs_lock_acquire(&pmm_lock, &node);
     size_t last = last_used_index;
 
     void* ret = inner_alloc(count, pmm_page_count);
@@ -138,25 +142,32 @@ void* pmm_alloc(size_t count)
 
     free_pages -= count;
 
-    // zero out the freshly allocated memory before passing it back to the caller
-    void* ptr = ret + HIGHER_HALF;
-    memset(ptr, 0, count * PAGE_SIZE);
+    mcs_lock_release(&pmm_lock, &node);
 
-    lock_release(&pmm_lock);
+    // zero out the freshly allocated memory before passing it back to the
+    // caller.  It's ours now, so there's no need to hold the lock for this,
+    // and allocations can be big enough that we shouldn't hog the CPU either
+    uint8_t* ptr = ret + HIGHER_HALF;
+    for (size_t i = 0; i < count; i++)
+    {
+        memset(ptr + i * PAGE_SIZE, 0, PAGE_SIZE);
+        cond_resched();
+    }
 
     return ret;
 }
 
 void pmm_free(void* ptr, size_t count)
 {
-    lock_acquire(&pmm_lock);
+    mcs_node_t node;
+    mcs_lock_acquire(&pmm_lock, &node);
     size_t page = (uint64_t)ptr / PAGE_SIZE;
     for(size_t i = page; i < page + count; i++)
     {
         bitmap_resetbit(i);
     }
     free_pages += count;
-    lock_release(&pmm_lock);
+    mcs_lock_release(&pmm_lock, &node);
 }
 
 // this is a little bit magic, ported from VINIX, and tests a single bit
@@ -6,7 +6,8 @@
 #include <string.h>
 
 slab_t slabs[SLAB_COUNT];
-static lock_t slab_lock;
+// taken for every malloc and free that fits in a slab, see lock/lock.h
+static mcs_lock_t slab_lock;
 
 void slaballoc_init()
 {
@@ -60,7 +61,8 @@ slab_t* find_slab(uint64_t size)
 
 void* slab_alloc(slab_t* slab)
 {
-    lock_acquire(&slab_lock);
+    mcs_node_t node;
+    mcs_lock_acquire(&slab_lock, &node);
     if(slab->first_free == 0)
     {
         init_slab(slab, slab->ent_size);
@@ -69,15 +71,16 @@ void* slab_alloc(slab_t* slab)
     uint64_t* old_free = (uint64_t*) slab->first_free;
     slab->first_free = *old_free;
     memset((void*)old_free, 0, slab->ent_size);
-    lock_release(&slab_lock); 
+    mcs_lock_release(&slab_lock, &node);
     return old_free;
 }
 
 void slab_free(slab_t* slab, void* ptr)
 {
-    lock_acquire(&slab_lock);
+    mcs_node_t node;
+    mcs_lock_acquire(&slab_lock, &node);
     if(ptr == NULL) {
-        lock_release(&slab_lock);
+        mcs_lock_release(&slab_lock, &node);
         return;
     }
 
@@ -85,5 +88,5 @@ void slab_free(slab_t* slab, void* ptr)
     new_head[0] = slab->first_free;
 
     slab->first_free = (uint64_t) new_head;
-    lock_release(&slab_lock);
+    mcs_lock_release(&slab_lock, &node);
 }
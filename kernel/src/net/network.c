@@ -1,25 +1,74 @@
 #include <net/network.h>
 #include <klog/klog.h>
+#include <lock/lock.h>
+#include <lock/rcu.h>
+#include <macro.h>
 #include <stdbool.h>
 #include <malloc.h>
 #include <string.h>
 
-static network_device_descriptor_t* devices = NULL;
-static size_t device_count;
+// looked up on every read and write, but only changed when a device turns
+// up, so readers go through RCU and registering swaps in a new copy
+static network_device_table_t* devices = NULL;
+// serialises registrations
+static lock_t devices_lock;
+
+static void net_device_table_free(rcu_head_t* head)
+{
+    free(CONTAINER_OF(head, network_device_table_t, rcu));
+}
 
 void net_register_device(const char *identifier, network_device_t* device)
 {
     klog("net", "Registering networking device %s", identifier);
-    
-    // step 1: grow the device array
-    device_count++;
-    devices = realloc(devices, device_count * sizeof(network_device_descriptor_t));
+
+    lock_acquire(&devices_lock);
+
+    // step 1: copy the device array, with room for one more
+    network_device_table_t* old = devices;
+    size_t count = old == NULL ? 0 : old->count;
+    network_device_table_t* table = malloc(sizeof(network_device_table_t) + (count + 1) * sizeof(network_device_descriptor_t));
+    if (old != NULL)
+    {
+        memcpy(table->devices, old->devices, count * sizeof(network_device_descriptor_t));
+    }
 
     // step 2: insert the device into the end of the array
-    devices[device_count - 1] = (network_device_descriptor_t) {
+    table->devices[count] = (network_device_descriptor_t) {
         .device = device,
         .identifier = identifier
     };
+    table->count = count + 1;
+
+    // step 3: publish it, and free the old one once nobody can be using it
+    rcu_assign_pointer(devices, table);
+    lock_release(&devices_lock);
+
+    if (old != NULL)
+    {
+        call_rcu(&old->rcu, net_device_table_free);
+    }
+}
+
+// devices are never unregistered, so what this returns stays valid after
+// the reader section
+static network_device_t* net_find_device(const char* devid)
+{
+    network_device_t* device = NULL;
+
+    rcu_read_lock();
+    network_device_table_t* table = rcu_dereference(devices);
+    for(size_t i = 0; table != NULL && i < table->count; i++)
+    {
+        if(strcmp(table->devices[i].identifier, devid) == 0)
+        {
+            device = table->devices[i].device;
+            break;
+        }
+    }
+    rcu_read_unlock();
+
+    return device;
 }
 
 // very low-level call, simply writes <len> bytes to the network device's
@@ -29,19 +78,16 @@ void net_register_device(const char *identifier, network_device_t* device)
 // truncated, possibly due to lack of buffer space)
 size_t net_write(const char* devid, uint8_t* ptr, size_t len)
 {
-    for(size_t i = 0; i < device_count; i++)
+    network_device_t* dev = net_find_device(devid);
+    if(dev != NULL)
     {
-        if(strcmp(devices[i].identifier, devid) == 0)
+        if(dev->send_buf_len + len > dev->send_buf_max)
         {
-            if(devices[i].device->send_buf_len + len > devices[i].device->send_buf_max)
-            {
-                // only send as many bytes as we actually can
-                len = (devices[i].device->send_buf_max - devices[i].device->send_buf_len);
-            }
-            memcpy(devices[i].device->send_buf, ptr, len);
-            devices[i].device->send_buf_len += len;
-            break;
+            // only send as many bytes as we actually can
+            len = (dev->send_buf_max - dev->send_buf_len);
         }
+        memcpy(dev->send_buf, ptr, len);
+        dev->send_buf_len += len;
     }
     return len;
 }
@@ -51,23 +97,20 @@ size_t net_write(const char* devid, uint8_t* ptr, size_t len)
 size_t net_read(const char* devid, uint8_t* buf, size_t len)
 {
     size_t bytes_read = 0;
-    for(size_t i = 0; i < device_count; i++)
+    network_device_t* dev = net_find_device(devid);
+    if(dev != NULL)
     {
-        if(strcmp(devices[i].identifier, devid) == 0)
+        for (size_t i = 0; dev->recv_buf_len > 0 && i < len; i++)
         {
-            network_device_t* dev = devices[i].device;
-            for (size_t i = 0; dev->recv_buf_len > 0 && i < len; i++)
+            memcpy(buf, *dev->recv_buf_read_ptr, 1);
+            (*dev->recv_buf_read_ptr)++;
+            // if we hit the end, wrap the pointer back around
+            if(*dev->recv_buf_read_ptr - dev->recv_buf == dev->recv_buf_len)
             {
-                memcpy(buf, *dev->recv_buf_read_ptr, 1);
-                (*dev->recv_buf_read_ptr)++;
-                // if we hit the end, wrap the pointer back around
-                if(*dev->recv_buf_read_ptr - dev->recv_buf == dev->recv_buf_len)
-                {
-                    *dev->recv_buf_read_ptr = dev->recv_buf;
-                }
-                dev->recv_buf_len--;
-                bytes_read++;
+                *dev->recv_buf_read_ptr = dev->recv_buf;
             }
+            dev->recv_buf_len--;
+            bytes_read++;
         }
     }
     return bytes_read;
@@ -77,7 +120,10 @@ size_t net_read(const char* devid, uint8_t* buf, size_t len)
 // and is intended to be run as a task in the OS scheduler.
 bool net_init()
 {
-    if(device_count == 0) return false;
+    rcu_read_lock();
+    bool have_devices = rcu_dereference(devices) != NULL;
+    rcu_read_unlock();
+    if(!have_devices) return false;
 
     return true;
 }
@@ -36,11 +36,11 @@ void dump_task_state_segment(const task_state_segment_t *tss) {
 
 void dump_local_cpu(const local_cpu_t *cpu) {
     term_printf("Local CPU Dump:\n");
-    term_printf("  CPU Number: %x Zero: %x\n", cpu->cpu_number, cpu->zero);
+    term_printf("  CPU Number: %x Current Thread: %x\n", cpu->cpu_number, cpu->current_thread);
     dump_task_state_segment(&(cpu->tss));
     term_printf("  LAPIC ID: %x LAPIC Timer Freq: %x\n", cpu->lapic_id, cpu->lapic_timer_freq);
     term_printf("  Online: %x Is Idle: %d\n", cpu->online, cpu->is_idle);
-    term_printf("  Last Run Queue Index: %ld\n", cpu->last_run_queue_index);
+    term_printf("  Runnable Threads: %d\n", cpu->run_queue.nr_running);
     term_printf("  Abort Stack:\n");
     for (int i = 0; i < ABORT_STACK_SIZE; ++i) {
         term_printf("    %x\n", cpu->abort_stack[i]);
@@ -1,18 +1,16 @@
 #include <proc/proc.h>
 #include <panic.h>
+#include <macro.h>
+#include <lock/rcu.h>
+#include <cpu/percpu.h>
+
+#include <stdlib.h>
 
 _Atomic(process_t*) processes[PROC_MAX_PROCESSES];
 
 thread_t* get_current_thread()
 {
-    thread_t* ret = NULL;
-
-    asm volatile (
-        "movq %%gs:[8], %0"
-        : "=r" (ret)
-    );
-
-    return ret;
+    return this_cpu_read(current_thread);
 }
 
 uint64_t proc_allocate_pid(process_t* process)
@@ -28,3 +26,29 @@ uint64_t proc_allocate_pid(process_t* process)
     panic("PID exhaustion!");
 }
 
+static void proc_free(rcu_head_t* head)
+{
+    process_t* process = CONTAINER_OF(head, process_t, rcu);
+    free(process->name);
+    free(process);
+}
+
+void proc_release_pid(process_t* process)
+{
+    process_t* expected = process;
+    if (!atomic_compare_exchange_strong(&processes[process->pid], &expected, NULL))
+    {
+        panic("Releasing pid %d, which doesn't belong to this process", process->pid);
+    }
+    call_rcu(&process->rcu, proc_free);
+}
+
+process_t* proc_find(uint64_t pid)
+{
+    if (pid >= PROC_MAX_PROCESSES)
+    {
+        return NULL;
+    }
+    return atomic_load_explicit(&processes[pid], memory_order_consume);
+}
+
@@ -0,0 +1,334 @@
+// reference: Introduction to Algorithms (CLRS), chapter 13.
+// the main difference from the book is that we use NULL for the leaves
+// instead of a sentinel node, so the delete fixup has to track the parent
+// of `x` separately (x itself may be NULL).
+
+#include <rbtree/rbtree.h>
+
+static void rb_rotate_left(rb_tree_t* tree, rb_node_t* x)
+{
+    rb_node_t* y = x->right;
+
+    x->right = y->left;
+    if (y->left != NULL)
+        y->left->parent = x;
+
+    y->parent = x->parent;
+    if (x->parent == NULL)
+        tree->root = y;
+    else if (x == x->parent->left)
+        x->parent->left = y;
+    else
+        x->parent->right = y;
+
+    y->left = x;
+    x->parent = y;
+}
+
+static void rb_rotate_right(rb_tree_t* tree, rb_node_t* x)
+{
+    rb_node_t* y = x->left;
+
+    x->left = y->right;
+    if (y->right != NULL)
+        y->right->parent = x;
+
+    y->parent = x->parent;
+    if (x->parent == NULL)
+        tree->root = y;
+    else if (x == x->parent->right)
+        x->parent->right = y;
+    else
+        x->parent->left = y;
+
+    y->right = x;
+    x->parent = y;
+}
+
+static inline bool rb_is_red(const rb_node_t* node)
+{
+    return node != NULL && node->red;
+}
+
+static void rb_insert_fixup(rb_tree_t* tree, rb_node_t* z)
+{
+    while (rb_is_red(z->parent))
+    {
+        // the parent is red, so it can't be the root, so there's a grandparent
+        rb_node_t* grandparent = z->parent->parent;
+
+        if (z->parent == grandparent->left)
+        {
+            rb_node_t* uncle = grandparent->right;
+            if (rb_is_red(uncle))
+            {
+                z->parent->red = false;
+                uncle->red = false;
+                grandparent->red = true;
+                z = grandparent;
+            }
+            else
+            {
+                if (z == z->parent->right)
+                {
+                    z = z->parent;
+                    rb_rotate_left(tree, z);
+                }
+                z->parent->red = false;
+                grandparent->red = true;
+                rb_rotate_right(tree, grandparent);
+            }
+        }
+        else
+        {
+            rb_node_t* uncle = grandparent->left;
+            if (rb_is_red(uncle))
+            {
+                z->parent->red = false;
+                uncle->red = false;
+                grandparent->red = true;
+                z = grandparent;
+            }
+            else
+            {
+                if (z == z->parent->left)
+                {
+                    z = z->parent;
+                    rb_rotate_right(tree, z);
+                }
+                z->parent->red = false;
+                grandparent->red = true;
+                rb_rotate_left(tree, grandparent);
+            }
+        }
+    }
+
+    tree->root->red = false;
+}
+
+void rb_insert(rb_tree_t* tree, rb_node_t* node, rb_less_fn less)
+{
+    rb_node_t* parent = NULL;
+    rb_node_t** link = &tree->root;
+    bool leftmost = true;
+
+    while (*link != NULL)
+    {
+        parent = *link;
+        if (less(node, parent))
+        {
+            link = &parent->left;
+        }
+        else
+        {
+            link = &parent->right;
+            leftmost = false;
+        }
+    }
+
+    node->parent = parent;
+    node->left = NULL;
+    node->right = NULL;
+    node->red = true;
+    *link = node;
+
+    if (leftmost)
+        tree->leftmost = node;
+
+    rb_insert_fixup(tree, node);
+}
+
+static void rb_transplant(rb_tree_t* tree, rb_node_t* u, rb_node_t* v)
+{
+    if (u->parent == NULL)
+        tree->root = v;
+    else if (u == u->parent->left)
+        u->parent->left = v;
+    else
+        u->parent->right = v;
+
+    if (v != NULL)
+        v->parent = u->parent;
+}
+
+static void rb_erase_fixup(rb_tree_t* tree, rb_node_t* x, rb_node_t* parent)
+{
+    while (x != tree->root && !rb_is_red(x))
+    {
+        if (x == parent->left)
+        {
+            rb_node_t* sibling = parent->right;
+            if (rb_is_red(sibling))
+            {
+                sibling->red = false;
+                parent->red = true;
+                rb_rotate_left(tree, parent);
+                sibling = parent->right;
+            }
+
+            if (!rb_is_red(sibling->left) && !rb_is_red(sibling->right))
+            {
+                sibling->red = true;
+                x = parent;
+                parent = x->parent;
+            }
+            else
+            {
+                if (!rb_is_red(sibling->right))
+                {
+                    sibling->left->red = false;
+                    sibling->red = true;
+                    rb_rotate_right(tree, sibling);
+                    sibling = parent->right;
+                }
+                sibling->red = parent->red;
+                parent->red = false;
+                if (sibling->right != NULL)
+                    sibling->right->red = false;
+                rb_rotate_left(tree, parent);
+                x = tree->root;
+                parent = NULL;
+            }
+        }
+        else
+        {
+            rb_node_t* sibling = parent->left;
+            if (rb_is_red(sibling))
+            {
+                sibling->red = false;
+                parent->red = true;
+                rb_rotate_right(tree, parent);
+                sibling = parent->left;
+            }
+
+            if (!rb_is_red(sibling->left) && !rb_is_red(sibling->right))
+            {
+                sibling->red = true;
+                x = parent;
+                parent = x->parent;
+            }
+            else
+            {
+                if (!rb_is_red(sibling->left))
+                {
+                    sibling->right->red = false;
+                    sibling->red = true;
+                    rb_rotate_left(tree, sibling);
+                    sibling = parent->left;
+                }
+                sibling->red = parent->red;
+                parent->red = false;
+                if (sibling->left != NULL)
+                    sibling->left->red = false;
+                rb_rotate_right(tree, parent);
+                x = tree->root;
+                parent = NULL;
+            }
+        }
+    }
+
+    if (x != NULL)
+        x->red = false;
+}
+
+void rb_erase(rb_tree_t* tree, rb_node_t* z)
+{
+    if (tree->leftmost == z)
+        tree->leftmost = rb_next(z);
+
+    rb_node_t* y = z;
+    bool y_was_red = y->red;
+    rb_node_t* x = NULL;
+    rb_node_t* x_parent = NULL;
+
+    if (z->left == NULL)
+    {
+        x = z->right;
+        x_parent = z->parent;
+        rb_transplant(tree, z, z->right);
+    }
+    else if (z->right == NULL)
+    {
+        x = z->left;
+        x_parent = z->parent;
+        rb_transplant(tree, z, z->left);
+    }
+    else
+    {
+        // two children: splice out the successor and put it in z's place
+        y = z->right;
+        while (y->left != NULL)
+            y = y->left;
+
+        y_was_red = y->red;
+        x = y->right;
+
+        if (y->parent == z)
+        {
+            x_parent = y;
+        }
+        else
+        {
+            x_parent = y->parent;
+            rb_transplant(tree, y, y->right);
+            y->right = z->right;
+            y->right->parent = y;
+        }
+
+        rb_transplant(tree, z, y);
+        y->left = z->left;
+        y->left->parent = y;
+        y->red = z->red;
+    }
+
+    if (!y_was_red)
+        rb_erase_fixup(tree, x, x_parent);
+
+    z->parent = NULL;
+    z->left = NULL;
+    z->right = NULL;
+}
+
+rb_node_t* rb_next(const rb_node_t* node)
+{
+    if (node->right != NULL)
+    {
+        node = node->right;
+        while (node->left != NULL)
+            node = node->left;
+        return (rb_node_t*)node;
+    }
+
+    while (node->parent != NULL && node == node->parent->right)
+        node = node->parent;
+
+    return node->parent;
+}
+
+rb_node_t* rb_prev(const rb_node_t* node)
+{
+    if (node->left != NULL)
+    {
+        node = node->left;
+        while (node->right != NULL)
+            node = node->right;
+        return (rb_node_t*)node;
+    }
+
+    while (node->parent != NULL && node == node->parent->left)
+        node = node->parent;
+
+    return node->parent;
+}
+
+rb_node_t* rb_last(const rb_tree_t* tree)
+{
+    rb_node_t* node = tree->root;
+    if (node == NULL)
+        return NULL;
+
+    while (node->right != NULL)
+        node = node->right;
+
+    return node;
+}
@@ -0,0 +1,228 @@
+/**
+ * The deadline scheduling class.  Each thread asks for `runtime` nanoseconds
+ * of CPU time within `deadline` of the start of each `period`, and we always
+ * run whichever thread has the earliest absolute deadline (EDF).
+ *
+ * To stop a thread which overruns from eating into everyone else's
+ * guarantees, we use a constant bandwidth server: once a thread has used up
+ * its runtime, its deadline is pushed back by a period and its budget
+ * refilled, so it drops behind threads which are still within budget.
+ *
+ * Admission control makes sure the total bandwidth (runtime / period) of
+ * every deadline thread never exceeds what the CPUs can provide.
+ */
+
+#include <scheduler/deadline.h>
+#include <proc/proc.h>
+#include <time/timer.h>
+#include <cpu/smp.h>
+#include <lock/lock.h>
+#include <macro.h>
+
+#define DL_THREAD(node) CONTAINER_OF(node, thread_t, run_node)
+
+static lock_t dl_bw_lock;
+// the bandwidth reserved by every deadline thread in the system
+static uint64_t dl_total_bw = 0;
+
+static void dl_enqueue(run_queue_t* rq, thread_t* thread, int flags);
+static void dl_dequeue(run_queue_t* rq, thread_t* thread);
+static thread_t* dl_pick_next(run_queue_t* rq);
+static void dl_put_prev(run_queue_t* rq, thread_t* thread);
+static thread_t* dl_steal(run_queue_t* rq, uint64_t cpu);
+static bool dl_check_preempt(run_queue_t* rq, thread_t* thread);
+static uint64_t dl_timeslice(run_queue_t* rq, thread_t* thread);
+
+sched_class_t dl_sched_class = {
+    .name = "deadline",
+    .priority = SCHED_PRIORITY_DEADLINE,
+    .enqueue = dl_enqueue,
+    .dequeue = dl_dequeue,
+    .pick_next = dl_pick_next,
+    .put_prev = dl_put_prev,
+    .steal = dl_steal,
+    .check_preempt = dl_check_preempt,
+    // absolute deadlines mean the same thing on every CPU
+    .migrate = NULL,
+    .timeslice = dl_timeslice,
+};
+
+static inline bool deadline_before(uint64_t a, uint64_t b)
+{
+    return (int64_t)(a - b) < 0;
+}
+
+static bool dl_less(const rb_node_t* a, const rb_node_t* b)
+{
+    return deadline_before(DL_THREAD(a)->dl_abs_deadline, DL_THREAD(b)->dl_abs_deadline);
+}
+
+static uint64_t dl_bandwidth(uint64_t runtime, uint64_t period)
+{
+    return (runtime << DL_BW_SHIFT) / period;
+}
+
+bool dl_admit(const sched_attr_t* attr)
+{
+    if (attr->runtime_ns < DL_MIN_RUNTIME
+        || attr->runtime_ns > attr->deadline_ns
+        || attr->deadline_ns > attr->period_ns)
+    {
+        return false;
+    }
+
+    uint64_t bw = dl_bandwidth(attr->runtime_ns, attr->period_ns);
+
+    lock_acquire(&dl_bw_lock);
+    if (dl_total_bw + bw > DL_BW_LIMIT * cpu_count)
+    {
+        lock_release(&dl_bw_lock);
+        return false;
+    }
+    dl_total_bw += bw;
+    lock_release(&dl_bw_lock);
+
+    return true;
+}
+
+void dl_release(thread_t* thread)
+{
+    if (thread->sched_class != &dl_sched_class)
+    {
+        return;
+    }
+
+    lock_acquire(&dl_bw_lock);
+    dl_total_bw -= dl_bandwidth(thread->dl_runtime, thread->dl_period);
+    lock_release(&dl_bw_lock);
+}
+
+// start a fresh period for the thread, beginning now
+static void dl_replenish(thread_t* thread, uint64_t now)
+{
+    thread->dl_abs_deadline = now + thread->dl_deadline;
+    thread->dl_remaining = thread->dl_runtime;
+}
+
+// charge the running thread for the time it has spent on the CPU since we
+// last looked at it
+static void dl_update_curr(run_queue_t* rq)
+{
+    thread_t* current = rq->current;
+    if (current == NULL || current->sched_class != &dl_sched_class)
+    {
+        return;
+    }
+
+    uint64_t now = timer_get_nanos();
+    if (now > current->exec_start)
+    {
+        uint64_t delta = now - current->exec_start;
+        current->sum_exec_runtime += delta;
+        current->dl_remaining -= delta;
+    }
+    current->exec_start = now;
+
+    // out of budget: postpone the deadline rather than letting the thread
+    // run on at its old priority
+    while (current->dl_remaining <= 0)
+    {
+        current->dl_abs_deadline += current->dl_period;
+        current->dl_remaining += current->dl_runtime;
+    }
+}
+
+static void dl_enqueue(run_queue_t* rq, thread_t* thread, int flags)
+{
+    uint64_t now = timer_get_nanos();
+
+    if ((flags & RQ_ENQUEUE_NEW) != 0)
+    {
+        dl_replenish(thread, now);
+    }
+    else if ((flags & RQ_ENQUEUE_WAKEUP) != 0)
+    {
+        // if the thread's old deadline has passed, or it would need more than
+        // its share of the CPU to use its leftover runtime before the
+        // deadline, it gets a new period.  Otherwise keep going with the old
+        // one, so that sleeping can't be used to gain bandwidth.
+        if (!deadline_before(now, thread->dl_abs_deadline)
+            || (uint64_t)thread->dl_remaining * thread->dl_period
+                > (thread->dl_abs_deadline - now) * thread->dl_runtime)
+        {
+            dl_replenish(thread, now);
+        }
+    }
+
+    rq->dl.nr_running++;
+    rb_insert(&rq->dl.timeline, &thread->run_node, dl_less);
+}
+
+static void dl_dequeue(run_queue_t* rq, thread_t* thread)
+{
+    dl_update_curr(rq);
+
+    // the running thread isn't kept in the tree
+    if (thread != rq->current)
+    {
+        rb_erase(&rq->dl.timeline, &thread->run_node);
+    }
+    rq->dl.nr_running--;
+}
+
+static thread_t* dl_pick_next(run_queue_t* rq)
+{
+    rb_node_t* earliest = rb_first(&rq->dl.timeline);
+    if (earliest == NULL)
+    {
+        return NULL;
+    }
+
+    thread_t* thread = DL_THREAD(earliest);
+    rb_erase(&rq->dl.timeline, earliest);
+    thread->exec_start = timer_get_nanos();
+    return thread;
+}
+
+static void dl_put_prev(run_queue_t* rq, thread_t* thread)
+{
+    dl_update_curr(rq);
+    rb_insert(&rq->dl.timeline, &thread->run_node, dl_less);
+}
+
+static thread_t* dl_steal(run_queue_t* rq, uint64_t cpu)
+{
+    // the most urgent thread that's stuck waiting here, and allowed to go
+    rb_node_t* earliest = rb_first(&rq->dl.timeline);
+    while (earliest != NULL && !cpumask_test(&DL_THREAD(earliest)->affinity, cpu))
+    {
+        earliest = rb_next(earliest);
+    }
+    if (earliest == NULL)
+    {
+        return NULL;
+    }
+
+    thread_t* thread = DL_THREAD(earliest);
+    rb_erase(&rq->dl.timeline, earliest);
+    rq->dl.nr_running--;
+    return thread;
+}
+
+static bool dl_check_preempt(run_queue_t* rq, thread_t* thread)
+{
+    dl_update_curr(rq);
+    return deadline_before(thread->dl_abs_deadline, rq->current->dl_abs_deadline);
+}
+
+static uint64_t dl_timeslice(__attribute__((unused)) run_queue_t* rq, thread_t* thread)
+{
+    // run until the budget is gone, at which point the deadline gets pushed
+    // back and someone else may have a more pressing one
+    uint64_t slice = (uint64_t)thread->dl_remaining / 1000;
+    if (slice < DL_MIN_TIMESLICE)
+    {
+        slice = DL_MIN_TIMESLICE;
+    }
+    return slice;
+}
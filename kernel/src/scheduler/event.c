@@ -1,11 +1,127 @@
 #include <scheduler/event.h>
+#include <scheduler/scheduler.h>
+#include <proc/proc.h>
+#include <cpu/cpu.h>
 #include <klog/klog.h>
-#include <panic.h>
 
+#include <stdatomic.h>
+
+// number of threads blocked on events, so the scheduler can tell the
+// difference between an idle system and one that's deadlocked
 _Atomic uint64_t waiting_event_count = 0;
 
+// consume a pending trigger from one of the events, without blocking.  Must
+// be called with interrupts disabled.
+static int64_t event_check_pending(event_t** events, uint64_t count)
+{
+    for (uint64_t i = 0; i < count; i++)
+    {
+        lock_acquire(&events[i]->waiters.lock);
+        if (events[i]->pending > 0)
+        {
+            events[i]->pending--;
+            lock_release(&events[i]->waiters.lock);
+            return i;
+        }
+        lock_release(&events[i]->waiters.lock);
+    }
+    return -1;
+}
+
+int64_t event_await(event_t** events, uint64_t count, bool block)
+{
+    if (count == 0 || count > EVENT_MAX_AWAIT)
+    {
+        klog("event", "Can't wait on %d events at once", count);
+        return -1;
+    }
+
+    bool ints = cpu_interrupts_disable();
+
+    if (!block)
+    {
+        int64_t which = event_check_pending(events, count);
+        cpu_interrupts_restore(ints);
+        return which;
+    }
+
+    thread_t* thread = get_current_thread();
+    wait_queue_entry_t entries[EVENT_MAX_AWAIT];
+
+    // from here on, any trigger will wake us, so we can't miss one between
+    // checking for pending triggers and going to sleep
+    wait_prepare(thread);
+
+    for (uint64_t i = 0; i < count; i++)
+    {
+        entries[i] = (wait_queue_entry_t) {
+            .thread = thread,
+            .which = i,
+        };
+
+        lock_acquire(&events[i]->waiters.lock);
+        if (events[i]->pending > 0)
+        {
+            uint64_t expected = WAIT_NOT_WOKEN;
+            if (atomic_compare_exchange_strong(&thread->which_event, &expected, i))
+            {
+                events[i]->pending--;
+            }
+            lock_release(&events[i]->waiters.lock);
+            count = i;
+            break;
+        }
+        wait_queue_add(&events[i]->waiters, &entries[i]);
+        lock_release(&events[i]->waiters.lock);
+    }
+
+    if (atomic_load(&thread->which_event) == WAIT_NOT_WOKEN)
+    {
+        atomic_fetch_add(&waiting_event_count, 1);
+        scheduler_yield();
+        atomic_fetch_sub(&waiting_event_count, 1);
+        asm volatile ("cli" ::: "memory");
+    }
+    else
+    {
+        // we found a pending trigger (or were woken while queueing up), so
+        // there's no need to sleep after all
+        enqueue_thread(thread, false);
+    }
+
+    for (uint64_t i = 0; i < count; i++)
+    {
+        lock_acquire(&events[i]->waiters.lock);
+        wait_queue_remove(&events[i]->waiters, &entries[i]);
+        lock_release(&events[i]->waiters.lock);
+    }
+
+    cpu_interrupts_restore(ints);
+    return atomic_load(&thread->which_event);
+}
+
+static uint64_t event_trigger_max(event_t* event, bool drop, uint64_t max)
+{
+    bool ints = cpu_interrupts_disable();
+    lock_acquire(&event->waiters.lock);
+
+    uint64_t woken = wait_queue_wake(&event->waiters, max);
+    if (woken == 0 && !drop)
+    {
+        event->pending++;
+    }
+
+    lock_release(&event->waiters.lock);
+    cpu_interrupts_restore(ints);
+    return woken;
+}
+
 uint64_t event_trigger(event_t* event, bool drop)
 {
-    klog("event", "event triggered address=%x, drop=%d", event, drop);
-    panic("Event triggering is not implemented");
+    return event_trigger_max(event, drop, UINT64_MAX);
+}
+
+uint64_t event_trigger_one(event_t* event, bool drop)
+{
+    return event_trigger_max(event, drop, 1);
 }
@@ -0,0 +1,315 @@
+/**
+ * The fair scheduling class.  Every thread accumulates "virtual runtime" as
+ * it runs, scaled by its weight (derived from its nice value), and we always
+ * run whichever thread has the least of it.  Runnable threads are kept in a
+ * red-black tree ordered by vruntime, so picking the next one is O(1) and
+ * queueing one is O(log n).
+ *
+ * This is the same basic idea as Linux's CFS, minus group scheduling.
+ */
+
+#include <scheduler/fair.h>
+#include <proc/proc.h>
+#include <time/timer.h>
+#include <macro.h>
+
+// weights for each nice level from -20 to 19.  Each step is worth roughly 10%
+// more or less CPU time than its neighbour.  Taken from Linux's
+// sched_prio_to_weight table.
+static const uint64_t fair_weights[FAIR_NICE_MAX - FAIR_NICE_MIN + 1] = {
+    /* -20 */ 88761, 71755, 56483, 46273, 36291,
+    /* -15 */ 29154, 23254, 18705, 14949, 11916,
+    /* -10 */  9548,  7620,  6100,  4904,  3906,
+    /*  -5 */  3121,  2501,  1991,  1586,  1277,
+    /*   0 */  1024,   820,   655,   526,   423,
+    /*   5 */   335,   272,   215,   172,   137,
+    /*  10 */   110,    87,    70,    56,    45,
+    /*  15 */    36,    29,    23,    18,    15,
+};
+
+fair_tunables_t fair_tunables = {
+    .latency_ns = 6000000,
+    .min_granularity_ns = 750000,
+    .wakeup_granularity_ns = 1000000,
+};
+
+#define FAIR_THREAD(node) CONTAINER_OF(node, thread_t, run_node)
+
+static void fair_enqueue(run_queue_t* rq, thread_t* thread, int flags);
+static void fair_dequeue(run_queue_t* rq, thread_t* thread);
+static thread_t* fair_pick_next(run_queue_t* rq);
+static void fair_put_prev(run_queue_t* rq, thread_t* thread);
+static thread_t* fair_steal(run_queue_t* rq, uint64_t cpu);
+static bool fair_check_preempt(run_queue_t* rq, thread_t* thread);
+static void fair_migrate(thread_t* thread, run_queue_t* from, run_queue_t* to);
+static uint64_t fair_timeslice(run_queue_t* rq, thread_t* thread);
+
+sched_class_t fair_sched_class = {
+    .name = "fair",
+    .priority = SCHED_PRIORITY_FAIR,
+    .enqueue = fair_enqueue,
+    .dequeue = fair_dequeue,
+    .pick_next = fair_pick_next,
+    .put_prev = fair_put_prev,
+    .steal = fair_steal,
+    .check_preempt = fair_check_preempt,
+    .migrate = fair_migrate,
+    .timeslice = fair_timeslice,
+};
+
+// vruntimes are free to wrap around, so always compare them by difference
+static inline bool vruntime_before(uint64_t a, uint64_t b)
+{
+    return (int64_t)(a - b) < 0;
+}
+
+static bool fair_less(const rb_node_t* a, const rb_node_t* b)
+{
+    return vruntime_before(FAIR_THREAD(a)->vruntime, FAIR_THREAD(b)->vruntime);
+}
+
+// convert real time into virtual time for a thread of the given weight:
+// heavier threads' clocks tick more slowly, so they get picked more often
+static inline uint64_t fair_scale(uint64_t delta, uint64_t weight)
+{
+    if (weight == FAIR_NICE_0_WEIGHT)
+    {
+        return delta;
+    }
+    return delta * FAIR_NICE_0_WEIGHT / weight;
+}
+
+uint64_t fair_nice_to_weight(int nice)
+{
+    if (nice < FAIR_NICE_MIN)
+        nice = FAIR_NICE_MIN;
+    if (nice > FAIR_NICE_MAX)
+        nice = FAIR_NICE_MAX;
+    return fair_weights[nice - FAIR_NICE_MIN];
+}
+
+bool fair_set_tunables(fair_tunables_t tunables)
+{
+    if (tunables.min_granularity_ns == 0 || tunables.latency_ns < tunables.min_granularity_ns)
+    {
+        return false;
+    }
+
+    fair_tunables = tunables;
+    return true;
+}
+
+static void fair_update_min_vruntime(run_queue_t* rq)
+{
+    fair_run_queue_t* fair = &rq->fair;
+    thread_t* current = rq->current;
+    uint64_t min_vruntime = atomic_load(&fair->min_vruntime);
+    uint64_t vruntime = min_vruntime;
+    bool found = false;
+
+    if (current != NULL && current->sched_class == &fair_sched_class && atomic_load(&current->is_in_queue))
+    {
+        vruntime = current->vruntime;
+        found = true;
+    }
+
+    rb_node_t* leftmost = rb_first(&fair->timeline);
+    if (leftmost != NULL)
+    {
+        uint64_t leftmost_vruntime = FAIR_THREAD(leftmost)->vruntime;
+        if (!found || vruntime_before(leftmost_vruntime, vruntime))
+        {
+            vruntime = leftmost_vruntime;
+        }
+        found = true;
+    }
+
+    // never let it go backwards, or sleepers could game their way to the front
+    if (found && vruntime_before(min_vruntime, vruntime))
+    {
+        atomic_store(&fair->min_vruntime, vruntime);
+    }
+}
+
+// charge the running thread for the time it has spent on the CPU since we
+// last looked at it
+static void fair_update_curr(run_queue_t* rq)
+{
+    thread_t* current = rq->current;
+    if (current == NULL || current->sched_class != &fair_sched_class)
+    {
+        return;
+    }
+
+    uint64_t now = timer_get_nanos();
+    if (now > current->exec_start)
+    {
+        uint64_t delta = now - current->exec_start;
+        current->sum_exec_runtime += delta;
+        current->vruntime += fair_scale(delta, current->weight);
+    }
+    current->exec_start = now;
+
+    fair_update_min_vruntime(rq);
+}
+
+// every runnable thread gets a share of the period proportional to its weight
+static uint64_t fair_slice(fair_run_queue_t* fair, thread_t* thread)
+{
+    uint64_t period = fair_tunables.latency_ns;
+    if (fair->nr_running > fair_tunables.latency_ns / fair_tunables.min_granularity_ns)
+    {
+        period = fair->nr_running * fair_tunables.min_granularity_ns;
+    }
+
+    uint64_t total_weight = fair->total_weight != 0 ? fair->total_weight : thread->weight;
+    uint64_t slice = period * thread->weight / total_weight;
+
+    if (slice < fair_tunables.min_granularity_ns)
+    {
+        slice = fair_tunables.min_granularity_ns;
+    }
+    return slice;
+}
+
+static void fair_enqueue(run_queue_t* rq, thread_t* thread, int flags)
+{
+    fair_run_queue_t* fair = &rq->fair;
+    fair_update_curr(rq);
+
+    uint64_t min_vruntime = atomic_load(&fair->min_vruntime);
+    if ((flags & RQ_ENQUEUE_NEW) != 0)
+    {
+        // new threads start a slice behind everyone else, so that spawning
+        // lots of threads can't be used to hog the CPU
+        thread->vruntime = min_vruntime + fair_scale(fair_slice(fair, thread), thread->weight);
+    }
+    else if ((flags & RQ_ENQUEUE_WAKEUP) != 0)
+    {
+        // give sleepers some credit for the time they spent not running, so
+        // they get to respond quickly, but not so much that they can then
+        // monopolise the CPU
+        uint64_t floor = min_vruntime - fair_tunables.latency_ns / 2;
+        if (vruntime_before(thread->vruntime, floor))
+        {
+            thread->vruntime = floor;
+        }
+    }
+
+    fair->nr_running++;
+    fair->total_weight += thread->weight;
+    rb_insert(&fair->timeline, &thread->run_node, fair_less);
+}
+
+static void fair_dequeue(run_queue_t* rq, thread_t* thread)
+{
+    fair_run_queue_t* fair = &rq->fair;
+    fair_update_curr(rq);
+
+    // the running thread isn't kept in the tree
+    if (thread != rq->current)
+    {
+        rb_erase(&fair->timeline, &thread->run_node);
+    }
+
+    fair->nr_running--;
+    fair->total_weight -= thread->weight;
+    fair_update_min_vruntime(rq);
+}
+
+static thread_t* fair_pick_next(run_queue_t* rq)
+{
+    rb_node_t* leftmost = rb_first(&rq->fair.timeline);
+    if (leftmost == NULL)
+    {
+        return NULL;
+    }
+
+    thread_t* thread = FAIR_THREAD(leftmost);
+    rb_erase(&rq->fair.timeline, leftmost);
+    thread->exec_start = timer_get_nanos();
+    return thread;
+}
+
+static void fair_put_prev(run_queue_t* rq, thread_t* thread)
+{
+    fair_update_curr(rq);
+    rb_insert(&rq->fair.timeline, &thread->run_node, fair_less);
+}
+
+static thread_t* fair_steal(run_queue_t* rq, uint64_t cpu)
+{
+    // the rightmost thread has the longest wait ahead of it on this CPU,
+    // skipping over any which are pinned elsewhere
+    rb_node_t* rightmost = rb_last(&rq->fair.timeline);
+    while (rightmost != NULL && !cpumask_test(&FAIR_THREAD(rightmost)->affinity, cpu))
+    {
+        rightmost = rb_prev(rightmost);
+    }
+    if (rightmost == NULL)
+    {
+        return NULL;
+    }
+
+    thread_t* thread = FAIR_THREAD(rightmost);
+    rb_erase(&rq->fair.timeline, rightmost);
+    rq->fair.nr_running--;
+    rq->fair.total_weight -= thread->weight;
+    return thread;
+}
+
+static bool fair_check_preempt(run_queue_t* rq, thread_t* thread)
+{
+    fair_update_curr(rq);
+
+    // only preempt if the waking thread is a decent way behind the running
+    // one, otherwise we'd just bounce between them
+    int64_t lag = (int64_t)(rq->current->vruntime - thread->vruntime);
+    return lag > (int64_t)fair_scale(fair_tunables.wakeup_granularity_ns, thread->weight);
+}
+
+static void fair_migrate(thread_t* thread, run_queue_t* from, run_queue_t* to)
+{
+    // vruntime only means anything relative to the other threads on the same
+    // queue, so carry over how far ahead of (or behind) the pack we were
+    thread->vruntime = thread->vruntime - atomic_load(&from->fair.min_vruntime)
+        + atomic_load(&to->fair.min_vruntime);
+}
+
+static uint64_t fair_timeslice(run_queue_t* rq, thread_t* thread)
+{
+    return fair_slice(&rq->fair, thread) / 1000;
+}
+
+void fair_reweight(run_queue_t* rq, thread_t* thread, int nice)
+{
+    if (nice < FAIR_NICE_MIN)
+        nice = FAIR_NICE_MIN;
+    if (nice > FAIR_NICE_MAX)
+        nice = FAIR_NICE_MAX;
+    uint64_t weight = fair_nice_to_weight(nice);
+
+    if (rq == NULL || thread->sched_class != &fair_sched_class)
+    {
+        thread->nice = nice;
+        thread->weight = weight;
+        return;
+    }
+
+    fair_update_curr(rq);
+
+    bool queued = thread != rq->current;
+    if (queued)
+    {
+        rb_erase(&rq->fair.timeline, &thread->run_node);
+    }
+
+    rq->fair.total_weight = rq->fair.total_weight - thread->weight + weight;
+    thread->nice = nice;
+    thread->weight = weight;
+
+    if (queued)
+    {
+        rb_insert(&rq->fair.timeline, &thread->run_node, fair_less);
+    }
+}
@@ -0,0 +1,98 @@
+#include <scheduler/preempt.h>
+#include <scheduler/scheduler.h>
+#include <proc/proc.h>
+#include <cpu/cpu.h>
+#include <panic.h>
+
+// the thread whose count we should be using, or NULL if there isn't one
+static thread_t* preempt_current()
+{
+    // GS doesn't point at anything useful until the scheduler's ready
+    if (!atomic_load(&scheduler_ready))
+    {
+        return NULL;
+    }
+    return get_current_thread();
+}
+
+static bool preempt_should_resched(thread_t* thread)
+{
+    // with interrupts disabled, we're either in an interrupt handler or
+    // still inside someone's critical section
+    return thread->preempt_count == 0
+        && atomic_load(&thread->need_resched)
+        && cpu_interrupt_state();
+}
+
+void preempt_disable()
+{
+    thread_t* thread = preempt_current();
+    if (thread == NULL)
+    {
+        return;
+    }
+    thread->preempt_count++;
+    asm volatile ("" ::: "memory");
+}
+
+void preempt_enable_no_resched()
+{
+    thread_t* thread = preempt_current();
+    if (thread == NULL)
+    {
+        return;
+    }
+    asm volatile ("" ::: "memory");
+    if (thread->preempt_count == 0)
+    {
+        panic("Preemption enabled more times than it was disabled");
+    }
+    thread->preempt_count--;
+}
+
+void preempt_enable()
+{
+    preempt_enable_no_resched();
+
+    thread_t* thread = preempt_current();
+    if (thread != NULL && preempt_should_resched(thread))
+    {
+        // we stay runnable, so this just lets whoever the scheduler wanted
+        // to run go first
+        scheduler_yield();
+    }
+}
+
+uint64_t preempt_count()
+{
+    thread_t* thread = preempt_current();
+    if (thread == NULL)
+    {
+        return 0;
+    }
+    return thread->preempt_count;
+}
+
+void cond_resched()
+{
+    thread_t* thread = preempt_current();
+    if (thread != NULL && preempt_should_resched(thread))
+    {
+        scheduler_yield();
+    }
+}
+
+bool cond_resched_lock(lock_t* lock)
+{
+    thread_t* thread = preempt_current();
+    // the lock we're holding is the only thing stopping us
+    if (thread == NULL || thread->preempt_count != 1 || !atomic_load(&thread->need_resched))
+    {
+        return false;
+    }
+
+    // releasing the lock reschedules for us
+    lock_release(lock);
+    lock_acquire(lock);
+    return true;
+}
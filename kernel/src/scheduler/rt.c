@@ -0,0 +1,180 @@
+/**
+ * The real-time scheduling class.  Threads have a static priority from 1 to
+ * 99, and the highest priority runnable thread always runs.  Threads of the
+ * same priority either run to completion in the order they were queued
+ * (SCHED_POLICY_FIFO), or take turns (SCHED_POLICY_RR).
+ *
+ * Everything here is O(1): there's a list per priority level and a bitmap
+ * of which lists are non-empty.  The exception is stealing, which has to
+ * step over threads that aren't allowed on the CPU doing the stealing.
+ */
+
+#include <scheduler/rt.h>
+#include <proc/proc.h>
+#include <time/timer.h>
+
+static void rt_enqueue(run_queue_t* rq, thread_t* thread, int flags);
+static void rt_dequeue(run_queue_t* rq, thread_t* thread);
+static thread_t* rt_pick_next(run_queue_t* rq);
+static void rt_put_prev(run_queue_t* rq, thread_t* thread);
+static thread_t* rt_steal(run_queue_t* rq, uint64_t cpu);
+static bool rt_check_preempt(run_queue_t* rq, thread_t* thread);
+static uint64_t rt_timeslice(run_queue_t* rq, thread_t* thread);
+
+sched_class_t rt_sched_class = {
+    .name = "rt",
+    .priority = SCHED_PRIORITY_RT,
+    .enqueue = rt_enqueue,
+    .dequeue = rt_dequeue,
+    .pick_next = rt_pick_next,
+    .put_prev = rt_put_prev,
+    .steal = rt_steal,
+    .check_preempt = rt_check_preempt,
+    // priorities mean the same thing on every CPU
+    .migrate = NULL,
+    .timeslice = rt_timeslice,
+};
+
+static void rt_push_back(rt_run_queue_t* rt, thread_t* thread)
+{
+    int prio = thread->rt_priority;
+    thread->rt_next = NULL;
+    thread->rt_prev = rt->queues[prio].tail;
+    if (rt->queues[prio].tail != NULL)
+        rt->queues[prio].tail->rt_next = thread;
+    else
+        rt->queues[prio].head = thread;
+    rt->queues[prio].tail = thread;
+    rt->bitmap[prio / 64] |= 1ull << (prio % 64);
+}
+
+static void rt_push_front(rt_run_queue_t* rt, thread_t* thread)
+{
+    int prio = thread->rt_priority;
+    thread->rt_prev = NULL;
+    thread->rt_next = rt->queues[prio].head;
+    if (rt->queues[prio].head != NULL)
+        rt->queues[prio].head->rt_prev = thread;
+    else
+        rt->queues[prio].tail = thread;
+    rt->queues[prio].head = thread;
+    rt->bitmap[prio / 64] |= 1ull << (prio % 64);
+}
+
+static void rt_remove(rt_run_queue_t* rt, thread_t* thread)
+{
+    int prio = thread->rt_priority;
+    if (thread->rt_prev != NULL)
+        thread->rt_prev->rt_next = thread->rt_next;
+    else
+        rt->queues[prio].head = thread->rt_next;
+    if (thread->rt_next != NULL)
+        thread->rt_next->rt_prev = thread->rt_prev;
+    else
+        rt->queues[prio].tail = thread->rt_prev;
+    thread->rt_next = NULL;
+    thread->rt_prev = NULL;
+
+    if (rt->queues[prio].head == NULL)
+        rt->bitmap[prio / 64] &= ~(1ull << (prio % 64));
+}
+
+// the highest priority level with anything queued, or -1
+static int rt_highest_priority(rt_run_queue_t* rt)
+{
+    for (int i = 1; i >= 0; i--)
+    {
+        if (rt->bitmap[i] != 0)
+        {
+            return i * 64 + 63 - __builtin_clzll(rt->bitmap[i]);
+        }
+    }
+    return -1;
+}
+
+static void rt_enqueue(run_queue_t* rq, thread_t* thread, __attribute__((unused)) int flags)
+{
+    rt_push_back(&rq->rt, thread);
+    rq->rt.nr_running++;
+}
+
+static void rt_dequeue(run_queue_t* rq, thread_t* thread)
+{
+    // the running thread isn't kept in a list
+    if (thread != rq->current)
+    {
+        rt_remove(&rq->rt, thread);
+    }
+    rq->rt.nr_running--;
+}
+
+static thread_t* rt_pick_next(run_queue_t* rq)
+{
+    int prio = rt_highest_priority(&rq->rt);
+    if (prio < 0)
+    {
+        return NULL;
+    }
+
+    thread_t* thread = rq->rt.queues[prio].head;
+    rt_remove(&rq->rt, thread);
+    thread->exec_start = timer_get_nanos();
+    return thread;
+}
+
+static void rt_put_prev(run_queue_t* rq, thread_t* thread)
+{
+    uint64_t now = timer_get_nanos();
+    if (now > thread->exec_start)
+    {
+        thread->sum_exec_runtime += now - thread->exec_start;
+    }
+
+    // a FIFO thread keeps its place at the front of the line until it blocks,
+    // a round-robin thread goes to the back and lets its peers have a turn
+    if (thread->policy == SCHED_POLICY_FIFO)
+    {
+        rt_push_front(&rq->rt, thread);
+    }
+    else
+    {
+        rt_push_back(&rq->rt, thread);
+    }
+}
+
+static thread_t* rt_steal(run_queue_t* rq, uint64_t cpu)
+{
+    // a queued real-time thread is one that's being held up by something of
+    // at least its own priority, so give the most important one a CPU --
+    // as long as it's allowed to run there
+    for (int prio = rt_highest_priority(&rq->rt); prio >= SCHED_RT_PRIORITY_MIN; prio--)
+    {
+        if ((rq->rt.bitmap[prio / 64] & (1ull << (prio % 64))) == 0)
+            continue;
+
+        for (thread_t* thread = rq->rt.queues[prio].head; thread != NULL; thread = thread->rt_next)
+        {
+            if (cpumask_test(&thread->affinity, cpu))
+            {
+                rt_remove(&rq->rt, thread);
+                rq->rt.nr_running--;
+                return thread;
+            }
+        }
+    }
+    return NULL;
+}
+
+static bool rt_check_preempt(run_queue_t* rq, thread_t* thread)
+{
+    return thread->rt_priority > rq->current->rt_priority;
+}
+
+static uint64_t rt_timeslice(__attribute__((unused)) run_queue_t* rq, thread_t* thread)
+{
+    if (thread->policy == SCHED_POLICY_FIFO)
+    {
+        return RT_FIFO_TIMESLICE;
+    }
+    return RT_RR_TIMESLICE;
+}
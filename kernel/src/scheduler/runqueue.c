@@ -0,0 +1,85 @@
+#include <scheduler/runqueue.h>
+#include <scheduler/deadline.h>
+#include <scheduler/rt.h>
+#include <scheduler/fair.h>
+#include <proc/proc.h>
+
+#include <stddef.h>
+
+// every scheduling class, in the order they get to pick a thread
+static sched_class_t* sched_classes[] = {
+    &dl_sched_class,
+    &rt_sched_class,
+    &fair_sched_class,
+};
+
+#define SCHED_CLASS_COUNT (sizeof(sched_classes) / sizeof(sched_classes[0]))
+
+void run_queue_enqueue(run_queue_t* rq, thread_t* thread, int flags)
+{
+    thread->sched_class->enqueue(rq, thread, flags);
+    atomic_store(&thread->run_queue, rq);
+    atomic_fetch_add(&rq->nr_running, 1);
+}
+
+void run_queue_dequeue(run_queue_t* rq, thread_t* thread)
+{
+    thread->sched_class->dequeue(rq, thread);
+    atomic_store(&thread->run_queue, NULL);
+    atomic_fetch_sub(&rq->nr_running, 1);
+}
+
+void run_queue_put_prev(run_queue_t* rq, thread_t* thread)
+{
+    thread->sched_class->put_prev(rq, thread);
+}
+
+// the returned thread is still counted in nr_running, it's just not queued
+// any more -- the caller is expected to make it rq->current
+thread_t* run_queue_pick_next(run_queue_t* rq)
+{
+    for (size_t i = 0; i < SCHED_CLASS_COUNT; i++)
+    {
+        thread_t* thread = sched_classes[i]->pick_next(rq);
+        if (thread != NULL)
+        {
+            thread->timeslice = thread->sched_class->timeslice(rq, thread);
+            atomic_store(&rq->current_priority, thread->sched_class->priority);
+            return thread;
+        }
+    }
+    atomic_store(&rq->current_priority, SCHED_PRIORITY_IDLE);
+    return NULL;
+}
+
+// the returned thread has been fully removed from this run queue
+thread_t* run_queue_steal(run_queue_t* rq, uint64_t cpu)
+{
+    for (size_t i = 0; i < SCHED_CLASS_COUNT; i++)
+    {
+        thread_t* thread = sched_classes[i]->steal(rq, cpu);
+        if (thread != NULL)
+        {
+            atomic_store(&thread->run_queue, NULL);
+            atomic_fetch_sub(&rq->nr_running, 1);
+            return thread;
+        }
+    }
+    return NULL;
+}
+
+bool run_queue_check_preempt(run_queue_t* rq, thread_t* thread)
+{
+    thread_t* current = rq->current;
+    if (current == NULL || current == thread)
+    {
+        return false;
+    }
+
+    if (thread->sched_class != current->sched_class)
+    {
+        return thread->sched_class->priority < current->sched_class->priority;
+    }
+
+    return thread->sched_class->check_preempt(rq, thread);
+}
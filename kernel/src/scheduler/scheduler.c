@@ -9,56 +9,395 @@
 #include <mem/mmap.h>
 #include <cpu/smp.h>
 #include <cpu/cpu.h>
+#include <cpu/fpu.h>
 #include <mem/align.h>
 #include <gdt/gdt.h>
 #include <interrupt/apic.h>
 #include <string.h>
 #include <debug/debug.h>
 #include <fs/fs.h>
+#include <time/timer.h>
+#include <interrupt/softirq.h>
+#include <lock/rcu.h>
+#include <macro.h>
+#include <scheduler/fair.h>
+#include <scheduler/rt.h>
+#include <scheduler/deadline.h>
+#include <scheduler/switch.h>
 
 // use 2MB stack, similar to Linux
 #define STACK_SIZE (uint64_t)(0x200000)
-#define MAX_THREADS 512
+// the most threads a CPU moves elsewhere (because they're no longer allowed
+// to run on it) each time it switches threads
+#define SCHED_EVICT_BATCH 8
 
 // variables
 _Atomic bool scheduler_ready = false;
 _Atomic uint8_t scheduler_vector;
 process_t *kernel_process;
-_Atomic(thread_t *) scheduler_running_queue[MAX_THREADS];
 _Atomic uint64_t working_cpus = 0;
 
 // functions
-int64_t get_next_thread(int64_t orig_i);
+uint64_t cpu_load(local_cpu_t *cpu);
+local_cpu_t *scheduler_select_cpu(thread_t *thread);
+thread_t *scheduler_steal_thread(local_cpu_t *cpu);
+run_queue_t *scheduler_lock_run_queue(thread_t *thread);
+local_cpu_t *scheduler_select_cpu_rt(thread_t *thread, uint64_t last_cpu);
+bool scheduler_cpu_allowed(thread_t *thread, local_cpu_t *cpu);
+bool scheduler_cpus_share_llc(local_cpu_t *a, local_cpu_t *b);
+local_cpu_t *scheduler_select_idlest(thread_t *thread, local_cpu_t *near);
+local_cpu_t *scheduler_select_idle_sibling(thread_t *thread, local_cpu_t *cpu);
+thread_t *scheduler_steal_from(local_cpu_t *cpu, bool same_llc);
+bool scheduler_apply_attr(thread_t *thread, const sched_attr_t *attr);
+bool scheduler_affinity_usable(const cpumask_t *mask);
+uint64_t scheduler_micros_to_timer();
+void scheduler_arm_timer(local_cpu_t *cpu);
+void scheduler_arm_tick(local_cpu_t *cpu, thread_t *thread);
+void scheduler_kick_idle_cpu(local_cpu_t *busy_cpu);
+thread_t *scheduler_pick_next(local_cpu_t *cpu, thread_t *current);
+void scheduler_switch_out(thread_t *thread);
+void scheduler_switch_in(local_cpu_t *cpu, thread_t *thread);
+uint64_t scheduler_thread_context(thread_t *thread);
+uint64_t scheduler_idle_context(local_cpu_t *cpu);
+__attribute__((noreturn)) void scheduler_idle_entry();
 void scheduler_isr(uint32_t num, cpu_status_t *status);
 
-int64_t get_next_thread(int64_t orig_i)
+// a rough measure of how busy a CPU is: everything runnable on it, including
+// whatever it's running right now.  Read without any locks held, so only ever
+// use it as a hint.
+uint64_t cpu_load(local_cpu_t *cpu)
 {
-    uint64_t cpu_number = cpu_get_current()->cpu_number;
-    int64_t index = orig_i + 1;
+    return atomic_load(&cpu->run_queue.nr_running);
+}
+
+// lock the run queue a thread is attached to and return it, or return NULL
+// if the thread isn't attached to one.  Must be called with interrupts
+// disabled.
+run_queue_t *scheduler_lock_run_queue(thread_t *thread)
+{
+    // the run queue a thread belongs to can change under our feet (e.g if it
+    // gets stolen by another CPU), so make sure we lock the right one
+    run_queue_t *rq = NULL;
+    while ((rq = atomic_load(&thread->run_queue)) != NULL)
+    {
+        lock_acquire(&rq->lock);
+        if (atomic_load(&thread->run_queue) == rq)
+        {
+            return rq;
+        }
+        lock_release(&rq->lock);
+    }
+    return NULL;
+}
+
+// is the thread allowed to run on this CPU?
+bool scheduler_cpu_allowed(thread_t *thread, local_cpu_t *cpu)
+{
+    if (atomic_load(&cpu->isolated) && !thread->pinned)
+    {
+        return false;
+    }
+    return cpumask_test(&thread->affinity, cpu->cpu_number);
+}
+
+// do the two CPUs share a last level cache, i.e can a thread move between
+// them without losing everything it had cached?
+bool scheduler_cpus_share_llc(local_cpu_t *a, local_cpu_t *b)
+{
+    return a->topology.llc_id == b->topology.llc_id;
+}
+
+// the least busy CPU the thread is allowed on, preferring CPUs which share a
+// cache with `near` when it's a close call
+local_cpu_t *scheduler_select_idlest(thread_t *thread, local_cpu_t *near)
+{
+    local_cpu_t *idlest = NULL;
+    // twice the load, plus one if it means leaving near's cache behind
+    uint64_t idlest_cost = UINT64_MAX;
+    for (uint64_t i = 0; i < cpu_count; i++)
+    {
+        local_cpu_t *cpu = local_cpus[i];
+        if (!scheduler_cpu_allowed(thread, cpu))
+            continue;
+
+        uint64_t cost = cpu_load(cpu) * 2;
+        if (!scheduler_cpus_share_llc(cpu, near))
+        {
+            cost++;
+        }
+        if (cost < idlest_cost || (cost == idlest_cost && cpu == near))
+        {
+            idlest = cpu;
+            idlest_cost = cost;
+        }
+    }
+
+    // only possible if the affinity mask has nothing but CPUs we don't have,
+    // which scheduler_set_affinity won't allow
+    if (idlest == NULL)
+    {
+        return near;
+    }
+    return idlest;
+}
+
+// an idle CPU sharing a cache with `cpu` which the thread may run on, or
+// NULL if there isn't one
+local_cpu_t *scheduler_select_idle_sibling(thread_t *thread, local_cpu_t *cpu)
+{
+    for (uint64_t i = 0; i < cpu_count; i++)
+    {
+        local_cpu_t *sibling = local_cpus[i];
+        if (sibling != cpu
+            && scheduler_cpus_share_llc(sibling, cpu)
+            && scheduler_cpu_allowed(thread, sibling)
+            && atomic_load(&sibling->is_idle))
+        {
+            return sibling;
+        }
+    }
+    return NULL;
+}
+
+// decide which CPU's run queue a thread should be placed on when it becomes
+// runnable.  Must be called with interrupts disabled.
+local_cpu_t *scheduler_select_cpu(thread_t *thread)
+{
+    local_cpu_t *this_cpu = cpu_get_current();
+    uint64_t last_cpu = atomic_load(&thread->last_cpu);
+
+    if (thread->sched_class != &fair_sched_class)
+    {
+        local_cpu_t *cpu = scheduler_select_cpu_rt(thread, last_cpu);
+        if (cpu != NULL)
+        {
+            return cpu;
+        }
+    }
+
+    // brand new thread: it has no cache footprint anywhere yet, so just give
+    // it to whoever is least busy
+    if (last_cpu >= cpu_count)
+    {
+        return scheduler_select_idlest(thread, this_cpu);
+    }
+
+    local_cpu_t *prev_cpu = local_cpus[last_cpu];
+    bool prev_allowed = scheduler_cpu_allowed(thread, prev_cpu);
+
+    // the CPU we last ran on is the most likely to still have our working set
+    // in cache, so if it's sitting idle that's the obvious choice
+    if (prev_allowed && (prev_cpu == this_cpu || atomic_load(&prev_cpu->is_idle)))
+    {
+        return prev_cpu;
+    }
+
+    // failing that, an idle CPU sharing its cache is nearly as good
+    local_cpu_t *sibling = scheduler_select_idle_sibling(thread, prev_cpu);
+    if (sibling != NULL)
+    {
+        return sibling;
+    }
+
+    // otherwise, wake-affine: the thread doing the waking has probably just
+    // produced whatever the woken thread is about to consume, so pulling it
+    // over here keeps that data hot -- as long as we're not busier
+    if (prev_allowed && scheduler_cpu_allowed(thread, this_cpu)
+        && cpu_load(this_cpu) < cpu_load(prev_cpu))
+    {
+        return this_cpu;
+    }
+
+    if (prev_allowed)
+    {
+        return prev_cpu;
+    }
+
+    // our affinity has changed since we last ran, so start afresh somewhere
+    // as close as possible to where we were
+    return scheduler_select_idlest(thread, prev_cpu);
+}
+
+// real-time and deadline threads care more about getting a CPU straight away
+// than about cache warmth, so look for one that's running something less
+// important than them, preferring the CPU they last ran on.  Returns NULL if
+// every CPU is busy with something at least as important.
+local_cpu_t *scheduler_select_cpu_rt(thread_t *thread, uint64_t last_cpu)
+{
+    int priority = thread->sched_class->priority;
+
+    if (last_cpu < cpu_count
+        && scheduler_cpu_allowed(thread, local_cpus[last_cpu])
+        && atomic_load(&local_cpus[last_cpu]->run_queue.current_priority) > priority)
+    {
+        return local_cpus[last_cpu];
+    }
+
+    local_cpu_t *best = NULL;
+    int best_priority = priority;
+    for (uint64_t i = 0; i < cpu_count; i++)
+    {
+        if (!scheduler_cpu_allowed(thread, local_cpus[i]))
+            continue;
+
+        int current_priority = atomic_load(&local_cpus[i]->run_queue.current_priority);
+        if (current_priority > best_priority)
+        {
+            best = local_cpus[i];
+            best_priority = current_priority;
+        }
+    }
+    return best;
+}
+
+// look for the CPU with the most threads waiting, either among those
+// sharing our last level cache or among those that don't, and take one of
+// them off its hands.  This only looks at each CPU once.
+thread_t *scheduler_steal_from(local_cpu_t *cpu, bool same_llc)
+{
+    local_cpu_t *busiest = NULL;
+    // a CPU with a single runnable thread has nothing waiting to give away
+    uint64_t busiest_load = 1;
 
-    while (1)
+    for (uint64_t i = 0; i < cpu_count; i++)
     {
-        // wrap-around
-        if (index >= MAX_THREADS)
-            index = 0;
+        if (local_cpus[i] == cpu
+            || atomic_load(&local_cpus[i]->isolated)
+            || scheduler_cpus_share_llc(local_cpus[i], cpu) != same_llc)
+            continue;
 
-        thread_t *t = scheduler_running_queue[index];
-        if (t != 0)
+        uint64_t load = cpu_load(local_cpus[i]);
+        if (load > busiest_load)
         {
-            if (atomic_load(&t->cpuid) == cpu_number || lock_test_and_acquire(&t->lock))
-            {
-                return index;
-            }
+            busiest = local_cpus[i];
+            busiest_load = load;
         }
+    }
+
+    if (busiest == NULL)
+        return NULL;
 
-        // only allow looping through the full queue once
-        if (index == orig_i)
-            break;
+    run_queue_t *rq = &busiest->run_queue;
+    lock_acquire(&rq->lock);
+    thread_t *thread = run_queue_steal(rq, cpu->cpu_number);
+    lock_release(&rq->lock);
 
-        index++;
+    if (thread != NULL && thread->sched_class->migrate != NULL)
+    {
+        thread->sched_class->migrate(thread, rq, &cpu->run_queue);
     }
 
-    return -1;
+    return thread;
+}
+
+// called by a CPU which has run out of work of its own.  Moving a thread
+// within a cache domain costs next to nothing, while moving it across one
+// means it has to warm up a whole new cache, so only go further afield if
+// our neighbours have nothing to spare.
+thread_t *scheduler_steal_thread(local_cpu_t *cpu)
+{
+    // isolated CPUs only ever run what's been pinned to them
+    if (atomic_load(&cpu->isolated))
+    {
+        return NULL;
+    }
+
+    thread_t *thread = scheduler_steal_from(cpu, true);
+    if (thread == NULL)
+    {
+        thread = scheduler_steal_from(cpu, false);
+    }
+    return thread;
+}
+
+// how long until the next timer is due, or UINT64_MAX if there aren't any
+uint64_t scheduler_micros_to_timer()
+{
+    uint64_t deadline = timer_next_deadline();
+    if (deadline == TIMER_NO_DEADLINE)
+    {
+        return UINT64_MAX;
+    }
+
+    uint64_t now = timer_get_nanos();
+    if (deadline <= now)
+    {
+        return 1;
+    }
+    return div_roundup(deadline - now, 1000);
+}
+
+// program the LAPIC timer to go off when the next timer is due, or leave it
+// stopped if there aren't any
+void scheduler_arm_timer(local_cpu_t *cpu)
+{
+    uint64_t micros = scheduler_micros_to_timer();
+    if (micros != UINT64_MAX)
+    {
+        lapic_timer_oneshot(cpu, scheduler_vector, micros);
+    }
+}
+
+// program the next scheduler interrupt for a CPU that's about to run `thread`
+void scheduler_arm_tick(local_cpu_t *cpu, thread_t *thread)
+{
+    // an isolated CPU leaves the timers to everyone else while it has
+    // something to run, so that it's only interrupted for its own threads
+    bool isolated = atomic_load(&cpu->isolated);
+
+    // if there's nobody else to share the CPU with, there's no point
+    // interrupting the thread just to pick it again.  Anyone enqueueing onto
+    // this CPU checks tick_stopped after bumping nr_running, so one of us is
+    // guaranteed to notice the other.
+    atomic_store(&cpu->tick_stopped, true);
+    if (atomic_load(&cpu->run_queue.nr_running) > 1)
+    {
+        atomic_store(&cpu->tick_stopped, false);
+        uint64_t micros = isolated ? UINT64_MAX : scheduler_micros_to_timer();
+        if (thread->timeslice < micros)
+        {
+            micros = thread->timeslice;
+        }
+        lapic_timer_oneshot(cpu, scheduler_vector, micros);
+        return;
+    }
+
+    if (!isolated)
+    {
+        scheduler_arm_timer(cpu);
+    }
+}
+
+void scheduler_kick_timer(local_cpu_t *cpu)
+{
+    if (!atomic_load(&scheduler_ready))
+    {
+        return;
+    }
+
+    // an idle CPU, or one whose thread has it to itself, has nothing else
+    // coming to wake it up.  Anyone else will see the new timer when they
+    // next program their tick, at most a timeslice from now.
+    if (atomic_load(&cpu->is_idle) || atomic_load(&cpu->tick_stopped))
+    {
+        lapic_send_ipi(cpu->lapic_id, scheduler_vector);
+    }
+}
+
+// idle CPUs don't poll for work, so when a busy CPU ends up with more
+// runnable threads than it can run, wake one of them up to come and steal
+void scheduler_kick_idle_cpu(local_cpu_t *busy_cpu)
+{
+    for (uint64_t i = 0; i < cpu_count; i++)
+    {
+        if (local_cpus[i] != busy_cpu
+            && !atomic_load(&local_cpus[i]->isolated)
+            && atomic_load(&local_cpus[i]->is_idle))
+        {
+            lapic_send_ipi(local_cpus[i]->lapic_id, scheduler_vector);
+            return;
+        }
+    }
 }
 
 void scheduler_init()
@@ -74,120 +413,279 @@ void scheduler_init()
     atomic_store(&scheduler_ready, true);
 }
 
-void scheduler_isr(__attribute__((unused)) uint32_t num, __attribute__((unused)) cpu_status_t *status)
+// work out what this CPU should run next, after `current` (if there is one).
+// The thread that's returned has been made rq->current.  Must be called with
+// interrupts disabled.
+thread_t *scheduler_pick_next(local_cpu_t *cpu, thread_t *current)
 {
-    lapic_timer_stop();
-    local_cpu_t *cpu = cpu_get_current();
-    atomic_store(&cpu->is_idle, false);
-    thread_t *current_thread = get_current_thread();
-    int64_t new_index = get_next_thread(cpu->last_run_queue_index); 
-
-    klog("sched", "Getting ready to try to run %d on %d", new_index, cpu->cpu_number);
+    run_queue_t *rq = &cpu->run_queue;
+    thread_t *next = NULL;
+    thread_t *evicted[SCHED_EVICT_BATCH];
+    size_t evicted_count = 0;
 
-    klog("sched", "current_thread=%x, new_index=%d, new_thread=%x", current_thread, new_index, scheduler_running_queue[new_index]);
-
-    if (current_thread != 0)
+    lock_acquire(&rq->lock);
+    if (current != NULL)
     {
-        lock_release(&current_thread->yield_await);
+        // we're doing what it asked for
+        atomic_store(&current->need_resched, false);
 
-        // the happy case, we're just running the same thread again
-        if (new_index == cpu->last_run_queue_index)
+        if (!atomic_load(&current->is_in_queue))
         {
-            lapic_eoi();
-            lapic_timer_oneshot(cpu, scheduler_vector, current_thread->timeslice);
-            return;
+            // it has been dequeued while running, so it belongs to no-one now
+            run_queue_dequeue(rq, current);
         }
-        // switch context
-        current_thread->gs_base = get_kernel_gs_base();
-        current_thread->fs_base = get_fs_base();
-        current_thread->cr3 = read_cr3();
-        fpu_save(current_thread->fpu_storage);
-        atomic_store(&current_thread->cpuid, -1);
-        lock_release(&current_thread->lock);
+        else if (!scheduler_cpu_allowed(current, cpu))
+        {
+            // its affinity changed (or the CPU was isolated) while it was
+            // running, so it has to carry on somewhere else
+            run_queue_dequeue(rq, current);
+            atomic_store(&current->is_in_queue, false);
+            evicted[evicted_count++] = current;
+        }
+        else
+        {
+            // still runnable, so it goes back to wait its turn
+            run_queue_put_prev(rq, current);
+        }
+    }
+    next = run_queue_pick_next(rq);
+    rq->current = next;
+    // the same goes for anything that was already queued here.  Anything we
+    // don't get round to now gets moved on the next switch.
+    while (next != NULL && !scheduler_cpu_allowed(next, cpu) && evicted_count < SCHED_EVICT_BATCH)
+    {
+        run_queue_dequeue(rq, next);
+        atomic_store(&next->is_in_queue, false);
+        evicted[evicted_count++] = next;
+        next = run_queue_pick_next(rq);
+        rq->current = next;
+    }
+    lock_release(&rq->lock);
 
-        atomic_fetch_sub(&working_cpus, 1);
+    // nobody can run the current thread until we've finished saving its
+    // context anyway, so it's safe to hand it over already
+    for (size_t i = 0; i < evicted_count; i++)
+    {
+        enqueue_thread(evicted[i], atomic_load(&evicted[i]->enqueued_by_signal));
     }
 
-    if (new_index == -1)
+    if (next == NULL)
     {
-        lapic_eoi();
-        set_gs_base(cpu->cpu_number);
-        set_kernel_gs_base(cpu->cpu_number);
-        cpu->last_run_queue_index = 0;
-        atomic_store(&cpu->is_idle, true);
-        if (atomic_load(&waiting_event_count) == 0 && atomic_load(&working_cpus) == 0)
+        thread_t *stolen = scheduler_steal_thread(cpu);
+        if (stolen != NULL)
         {
-            panic("Event heartbeat has flatlined :(");
+            lock_acquire(&rq->lock);
+            run_queue_enqueue(rq, stolen, 0);
+            next = run_queue_pick_next(rq);
+            rq->current = next;
+            lock_release(&rq->lock);
         }
-        scheduler_await();
     }
 
+    return next;
+}
+
+// save the parts of a thread's state that don't live in its saved context.
+// The thread's lock is still held afterwards: nobody else may resume it
+// until its context has been saved too.
+void scheduler_switch_out(thread_t *thread)
+{
+    thread->gs_base = get_kernel_gs_base();
+    thread->fs_base = get_fs_base();
+    thread->cr3 = read_cr3();
+    fpu_switch_out(thread);
+    atomic_store(&thread->cpuid, -1);
+
+    atomic_fetch_sub(&working_cpus, 1);
+}
+
+// get the CPU ready to resume `thread`, everything except actually loading
+// its saved context
+void scheduler_switch_in(local_cpu_t *cpu, thread_t *thread)
+{
     atomic_fetch_add(&working_cpus, 1);
 
-    current_thread = scheduler_running_queue[new_index];
-    cpu->last_run_queue_index = new_index;
+    // the CPU that ran this thread last may still be busy saving its context.
+    // The lock is held for as long as the thread is running, and released by
+    // whichever CPU switches away from it, so it's not counted against
+    // anyone's preemption count
+    lock_acquire_raw(&thread->lock);
+
+    atomic_store(&thread->last_cpu, cpu->cpu_number);
+    atomic_store(&thread->cpuid, cpu->cpu_number);
+
+    // GS stays pointing at the CPU.  The kernel GS base holds userland's,
+    // to be swapped in on the way back out, whether the thread stopped in
+    // userland or in the kernel (e.g in a syscall).  Kernel threads never
+    // swap it in.
+    cpu->current_thread = thread;
+    set_kernel_gs_base(thread->gs_base);
+    set_fs_base(thread->fs_base);
+
+    cpu->tss.ist3 = thread->pf_stack;
+
+    if (read_cr3() != thread->cr3)
+        write_cr3(thread->cr3);
+
+    fpu_switch_in(thread);
+
+    scheduler_arm_tick(cpu, thread);
 
-    set_gs_base((uint64_t)current_thread);
-    if (current_thread->cpu_state.cs == USER_CODE_SEGMENT)
+    if (thread->context_kind == CONTEXT_FRAME && thread->cpu_state.cs == USER_CODE_SEGMENT)
     {
-        set_kernel_gs_base(current_thread->gs_base);
+        // todo: dispatch a signal
+        klog("sched", "Should dispatch signal but not yet implemented");
     }
-    else
+}
+
+uint64_t scheduler_thread_context(thread_t *thread)
+{
+    if (thread->context_kind == CONTEXT_STACK)
+    {
+        return thread->switch_rsp;
+    }
+    return (uint64_t)&thread->cpu_state;
+}
+
+// lay out a context on this CPU's scheduler stack which starts running
+// scheduler_idle_entry when it's resumed
+uint64_t scheduler_idle_context(local_cpu_t *cpu)
+{
+    // this is the stack the scheduler interrupt runs on, and nothing on it
+    // needs to survive once we've stopped running a thread
+    uint64_t *sp = (uint64_t *)cpu->tss.ist1;
+    // a return address for scheduler_idle_entry, which never returns, so that
+    // the stack is aligned the way the compiler expects on entry
+    *--sp = 0;
+    *--sp = (uint64_t)scheduler_idle_entry;
+    // flags, with interrupts disabled
+    *--sp = 0x2;
+    // rbp, rbx, r12-r15
+    for (int i = 0; i < 6; i++)
+    {
+        *--sp = 0;
+    }
+    return (uint64_t)sp;
+}
+
+static void thread_free_rcu(rcu_head_t* head)
+{
+    free(CONTAINER_OF(head, thread_t, rcu));
+}
+
+// runs on the CPU's own scheduler stack, once it has stopped running any
+// thread
+__attribute__((noreturn))
+void scheduler_idle_entry()
+{
+    local_cpu_t *cpu = cpu_get_current();
+
+    // we couldn't free a dying thread while we were still on its stack
+    thread_t *dying = cpu->dying_thread;
+    if (dying != NULL)
     {
-        set_kernel_gs_base((uint64_t)current_thread);
+        cpu->dying_thread = NULL;
+        for (size_t i = 0; i < PROC_MAX_STACKS_PER_THREAD; i++)
+        {
+            pmm_free(dying->stacks[i], STACK_SIZE / PAGE_SIZE);
+        }
+        // someone spinning on a mutex may still be looking at it
+        call_rcu(&dying->rcu, thread_free_rcu);
+
+        thread_t *next = scheduler_pick_next(cpu, NULL);
+        if (next != NULL)
+        {
+            scheduler_switch_in(cpu, next);
+            context_resume(scheduler_thread_context(next), next->context_kind);
+        }
     }
-    set_fs_base(current_thread->fs_base);
 
-    cpu->tss.ist3 = current_thread->pf_stack;
+    if (atomic_load(&waiting_event_count) == 0 && atomic_load(&working_cpus) == 0)
+    {
+        panic("Event heartbeat has flatlined :(");
+    }
+    scheduler_await();
+    __builtin_unreachable();
+}
 
-    if (read_cr3() != current_thread->cr3)
-        write_cr3(current_thread->cr3);
+void scheduler_isr(__attribute__((unused)) uint32_t num, cpu_status_t *status)
+{
+    lapic_timer_stop();
+    local_cpu_t *cpu = cpu_get_current();
+    atomic_store(&cpu->is_idle, false);
+    atomic_store(&cpu->tick_stopped, false);
 
-    fpu_restore(current_thread->fpu_storage);
+    thread_t *current_thread = get_current_thread();
+    // anything this interrupt handler does to the preemption count is undone
+    // before we get to switch, so look before it starts
+    bool can_preempt = current_thread == NULL || current_thread->preempt_count == 0;
 
-    atomic_store(&current_thread->cpuid, cpu->cpu_number);
+    softirq_raise_irqoff(SOFTIRQ_TIMER);
+    if (cpu->in_softirq)
+    {
+        // we interrupted the bottom halves, which have to finish on this
+        // CPU before it can do anything else.  They pick up the timer
+        // softirq, and send us another interrupt once they're done.
+        cpu->softirq_resched = true;
+        lapic_eoi();
+        return;
+    }
+    // we might not return through the ISR stub if we switch away, so run
+    // the bottom halves here rather than leaving them for IRQ exit.  They
+    // run with interrupts enabled, but this vector can't come in again
+    // until we've sent the EOI.
+    softirq_run_pending();
+
+    if (!can_preempt)
+    {
+        // the thread is in the middle of something that would leave other
+        // CPUs stuck if we switched away now, so it gives the CPU up as soon
+        // as it's finished.  Keep the tick going in case that's a while.
+        atomic_store(&current_thread->need_resched, true);
+        lapic_eoi();
+        scheduler_arm_tick(cpu, current_thread);
+        return;
+    }
+
+    // we caught the thread (if any) outside of any RCU reader section
+    rcu_note_qs(cpu);
+
+    thread_t *next_thread = scheduler_pick_next(cpu, current_thread);
+
+    klog("sched", "current_thread=%x, new_thread=%x on %d", current_thread, next_thread, cpu->cpu_number);
 
     lapic_eoi();
-    lapic_timer_oneshot(cpu, scheduler_vector, current_thread->timeslice);
 
-    cpu_status_t* new_cpu_state = &current_thread->cpu_state;
-    if (new_cpu_state->cs == USER_CODE_SEGMENT)
+    if (current_thread != NULL)
     {
-        // todo: dispatch a signal
-        klog("sched", "Should dispatch signal but not yet implemented");
+        // the happy case, we're just running the same thread again
+        if (next_thread == current_thread)
+        {
+            scheduler_arm_tick(cpu, current_thread);
+            return;
+        }
+        // switch context
+        current_thread->cpu_state = *status;
+        current_thread->context_kind = CONTEXT_FRAME;
+        scheduler_switch_out(current_thread);
+        // from here on, another CPU is free to pick the thread up
+        lock_release_raw(&current_thread->lock);
     }
 
-    asm volatile(
-        "movq %0, %%rsp\n"
-        "popq %%rax\n"
-        "movl %%eax, %%ds\n"
-        "popq %%rax\n"
-        "movl %%eax, %%es\n"
-        "popq %%rax\n"
-        "popq %%rbx\n"
-        "popq %%rcx\n"
-        "popq %%rdx\n"
-        "popq %%rsi\n"
-        "popq %%rdi\n"
-        "popq %%rbp\n"
-        "popq %%r8\n"
-        "popq %%r9\n"
-        "popq %%r10\n"
-        "popq %%r11\n"
-        "popq %%r12\n"
-        "popq %%r13\n"
-        "popq %%r14\n"
-        "popq %%r15\n"
-        "addq $8, %%rsp\n"
-        "swapgs\n"
-        "iretq\n"
-        :
-        : "rm" (new_cpu_state)
-        : "memory"
-        );
-
-
-    while (1);
+    if (next_thread == NULL)
+    {
+        cpu->current_thread = NULL;
+        set_kernel_gs_base((uint64_t)cpu);
+
+        if (atomic_load(&waiting_event_count) == 0 && atomic_load(&working_cpus) == 0)
+        {
+            panic("Event heartbeat has flatlined :(");
+        }
+        scheduler_await();
+    }
+
+    scheduler_switch_in(cpu, next_thread);
+    context_resume(scheduler_thread_context(next_thread), next_thread->context_kind);
 }
 
 void scheduler_await()
@@ -195,130 +693,324 @@ void scheduler_await()
     // disable interrupts - we can't be interrupted while using cpu_get_current
     asm volatile("cli");
     local_cpu_t *local_cpu = cpu_get_current();
-    // wait for 20ms
-    lapic_timer_oneshot(local_cpu, scheduler_vector, 20000);
-    // enable interrupts and run a HLT loop until the interrupt fires
-    asm volatile("sti" ::: "memory");
-    for (;;)
+    atomic_store(&local_cpu->is_idle, true);
+    rcu_idle_enter(local_cpu);
+
+    // anyone enqueueing onto us from here on will see that we're idle and
+    // send us an IPI, but something may have snuck in before that
+    if (atomic_load(&local_cpu->run_queue.nr_running) != 0)
     {
-        asm volatile("hlt" ::: "memory");
+        lapic_send_ipi((uint8_t)local_cpu->lapic_id, scheduler_vector);
     }
+
+    // there's no tick while idle: new work arrives with an IPI, so the only
+    // other reason to wake up is a timer going off
+    scheduler_arm_timer(local_cpu);
+    // we're usually still on the scheduler's IST stack, which the next
+    // scheduler interrupt starts again from the top of.  Nothing on it needs
+    // to survive, but an interrupt taken while idle (which may well run its
+    // bottom halves with interrupts enabled) does, so idle somewhere else.
+    // Then enable interrupts and run a HLT loop until an interrupt fires.
+    asm volatile(
+        "mov %0, %%rsp\n"
+        "sti\n"
+        "1:\n"
+        "hlt\n"
+        "jmp 1b\n"
+        :: "r" (local_cpu->idle_stack) : "memory"
+    );
+    __builtin_unreachable();
 }
 
 bool scheduler_dequeue_thread(thread_t* thread)
 {
-    // shortcut for duplicate calls
-    if(thread->is_in_queue == false)
-    {
-        return true;
-    }
+    bool ints = cpu_interrupts_disable();
+
+    run_queue_t* rq = scheduler_lock_run_queue(thread);
 
-    for(uint64_t i = 0; i < MAX_THREADS; i++)
+    atomic_store(&thread->is_in_queue, false);
+
+    if (rq != NULL)
     {
-        if(atomic_compare_exchange_strong(&scheduler_running_queue[i], &thread, NULL))
+        // if the thread is running, the scheduler will drop it the next time
+        // it switches away from it.  Otherwise, pull it out of the queue now.
+        if (rq->current != thread)
         {
-            thread->is_in_queue = false;
-            return true;
+            run_queue_dequeue(rq, thread);
         }
+        lock_release(&rq->lock);
     }
 
-    // did not find thread, but thread thinks it is running
-    // should this be a panic?! kind of fucked up situation tbh
-    return false;
+    cpu_interrupts_restore(ints);
+    return true;
 }
 
-void scheduler_yield(bool save_context)
+void scheduler_yield()
 {
-    asm volatile ("cli" ::: "memory");
+    bool ints = cpu_interrupts_disable();
     lapic_timer_stop();
-    local_cpu_t* local_cpu = cpu_get_current();
-    thread_t* current_thread = get_current_thread();
+    local_cpu_t *cpu = cpu_get_current();
+    atomic_store(&cpu->tick_stopped, false);
+    // RCU readers can't sleep, so giving up the CPU means we're not in one
+    rcu_note_qs(cpu);
+    thread_t *current_thread = get_current_thread();
+    thread_t *next_thread = scheduler_pick_next(cpu, current_thread);
 
-    if (save_context)
+    if (next_thread == current_thread)
     {
-         // acquire the yield await lock
-         // ready to later on use the lock to wait for
-         // an interrupt
-         lock_acquire(&current_thread->yield_await);
+        scheduler_arm_tick(cpu, current_thread);
+        cpu_interrupts_restore(ints);
+        return;
     }
-    else
-    {
-        set_gs_base((uint64_t)&local_cpu->cpu_number);
-        set_kernel_gs_base((uint64_t)&local_cpu->cpu_number);
-    }
-
-    lapic_send_ipi((uint8_t)local_cpu->lapic_id, scheduler_vector);
 
-    asm volatile("sti" ::: "memory");
+    // unlike the interrupt path, we only need to keep the callee-saved
+    // registers, and can jump straight into the next thread
+    current_thread->context_kind = CONTEXT_STACK;
+    scheduler_switch_out(current_thread);
 
-    if(save_context)
+    uint64_t next_rsp = 0;
+    uint64_t next_kind = CONTEXT_STACK;
+    if (next_thread != NULL)
     {
-        // wait for a scheduler interrupt to fire and save the context
-        lock_acquire(&current_thread->yield_await);
-        lock_release(&current_thread->yield_await);
+        scheduler_switch_in(cpu, next_thread);
+        next_rsp = scheduler_thread_context(next_thread);
+        next_kind = next_thread->context_kind;
     }
     else
     {
-        // hlt loop -- another thread should take over after the next interrupt
-        while(1) asm volatile ("hlt" ::: "memory");
+        cpu->current_thread = NULL;
+        set_kernel_gs_base((uint64_t)cpu);
+        next_rsp = scheduler_idle_context(cpu);
     }
+
+    context_switch(&current_thread->switch_rsp, &current_thread->lock.owner, next_rsp, next_kind);
+
+    // we've been picked to run again, possibly on a different CPU
+    cpu_interrupts_restore(ints);
 }
 
 __attribute__((noreturn)) 
 void scheduler_dequeue_and_die()
 {
     asm volatile ( "cli":::"memory" );
+    local_cpu_t* cpu = cpu_get_current();
     thread_t* t = get_current_thread();
 
-    scheduler_dequeue_thread(t);
-
-    for(size_t i = 0; i < PROC_MAX_STACKS_PER_THREAD; i++)
+    // we're about to free the thread, so it can't be left for the scheduler
+    // to drop when it switches away
+    run_queue_t* rq = scheduler_lock_run_queue(t);
+    atomic_store(&t->is_in_queue, false);
+    if (rq != NULL)
     {
-        pmm_free(t->stacks[i], STACK_SIZE / PAGE_SIZE);
+        run_queue_dequeue(rq, t);
+        rq->current = NULL;
+        lock_release(&rq->lock);
     }
-
-    free(t);
-    scheduler_yield(false);
-    while(1);
+    dl_release(t);
+    fpu_release(t);
+    atomic_fetch_sub(&working_cpus, 1);
+
+    // we're still running on one of the thread's stacks, so the rest of the
+    // cleanup has to happen from the CPU's own stack
+    cpu->current_thread = NULL;
+    set_kernel_gs_base((uint64_t)cpu);
+    cpu->dying_thread = t;
+    context_resume(scheduler_idle_context(cpu), CONTEXT_STACK);
 }
 
 bool enqueue_thread(thread_t *thread, bool by_signal)
 {
+    bool ints = cpu_interrupts_disable();
+
+    // if the thread is still attached to a CPU, that CPU's lock decides
+    // whether it gets put back in the queue or not
+    run_queue_t *rq = scheduler_lock_run_queue(thread);
+    if (rq != NULL)
+    {
+        // it's either already queued up, or running and about to be
+        // requeued by the scheduler on that CPU as soon as it switches away
+        atomic_store(&thread->enqueued_by_signal, by_signal);
+        atomic_store(&thread->is_in_queue, true);
+        lock_release(&rq->lock);
+        cpu_interrupts_restore(ints);
+        return true;
+    }
+
     // shortcut for duplicate calls
-    if (thread->is_in_queue)
+    bool expected = false;
+    if (!atomic_compare_exchange_strong(&thread->is_in_queue, &expected, true))
+    {
+        cpu_interrupts_restore(ints);
         return true;
+    }
 
     klog("sched", "Enqueueing thread %x", thread);
 
     atomic_store(&thread->enqueued_by_signal, by_signal);
 
-    for (uint64_t i = 0; i < MAX_THREADS; i++)
+    local_cpu_t *target = scheduler_select_cpu(thread);
+    rq = &target->run_queue;
+
+    uint64_t last_cpu = atomic_load(&thread->last_cpu);
+    int flags = RQ_ENQUEUE_WAKEUP;
+    if (last_cpu >= cpu_count)
+    {
+        flags = RQ_ENQUEUE_NEW;
+    }
+    else if (local_cpus[last_cpu] != target && thread->sched_class->migrate != NULL)
+    {
+        thread->sched_class->migrate(thread, &local_cpus[last_cpu]->run_queue, rq);
+    }
+
+    lock_acquire(&rq->lock);
+    run_queue_enqueue(rq, thread, flags);
+    bool preempt = run_queue_check_preempt(rq, thread);
+    lock_release(&rq->lock);
+
+    // only poke the CPU we actually queued the thread on, and only if it's
+    // asleep, running something that should make way for the new thread, or
+    // has stopped its tick -- otherwise it will get to it on its next tick
+    if (preempt || atomic_load(&target->is_idle) || atomic_load(&target->tick_stopped))
+    {
+        lapic_send_ipi(target->lapic_id, scheduler_vector);
+    }
+    else if (atomic_load(&rq->nr_running) > 1)
+    {
+        scheduler_kick_idle_cpu(target);
+    }
+
+    cpu_interrupts_restore(ints);
+    return true;
+}
+
+// does the mask allow at least one CPU we actually have?
+bool scheduler_affinity_usable(const cpumask_t *mask)
+{
+    for (uint64_t i = 0; i < cpu_count; i++)
     {
-        thread_t *expected = NULL;
-        if (atomic_compare_exchange_strong(&scheduler_running_queue[i], &expected, thread))
+        if (cpumask_test(mask, i))
         {
-            thread->is_in_queue = true;
-
-            // wake up any idle CPUs
-            for (uint64_t i = 0; i < cpu_count; i++)
-            {
-                if (atomic_load(&local_cpus[i]->is_idle))
-                {
-                    lapic_send_ipi(local_cpus[i]->lapic_id, scheduler_vector);
-                    break;
-                }
-            }
-
-            // we did manage to enqueue this thread
             return true;
         }
     }
-
-    // we could not enqueue this thread
     return false;
 }
 
-thread_t *new_kernel_thread(void *ip, void *arg, bool autoenqueue)
+bool scheduler_set_affinity(thread_t *thread, const cpumask_t *mask)
+{
+    if (!scheduler_affinity_usable(mask))
+    {
+        return false;
+    }
+
+    bool ints = cpu_interrupts_disable();
+
+    // the run queue lock stops anyone stealing the thread while we're
+    // looking at where it is
+    run_queue_t *rq = scheduler_lock_run_queue(thread);
+    thread->affinity = *mask;
+    thread->pinned = true;
+    if (rq == NULL)
+    {
+        // not runnable, it'll be placed somewhere allowed when it wakes up
+        cpu_interrupts_restore(ints);
+        return true;
+    }
+
+    local_cpu_t *cpu = CONTAINER_OF(rq, local_cpu_t, run_queue);
+    if (scheduler_cpu_allowed(thread, cpu))
+    {
+        lock_release(&rq->lock);
+    }
+    else if (rq->current == thread)
+    {
+        // the scheduler on that CPU moves it elsewhere when it switches away
+        // from it, so make that happen now
+        lock_release(&rq->lock);
+        if (cpu == cpu_get_current())
+        {
+            scheduler_yield();
+        }
+        else
+        {
+            lapic_send_ipi(cpu->lapic_id, scheduler_vector);
+        }
+    }
+    else
+    {
+        // just sitting in the queue, so move it straight over
+        run_queue_dequeue(rq, thread);
+        atomic_store(&thread->is_in_queue, false);
+        lock_release(&rq->lock);
+        enqueue_thread(thread, atomic_load(&thread->enqueued_by_signal));
+    }
+
+    cpu_interrupts_restore(ints);
+    return true;
+}
+
+void scheduler_set_nice(thread_t *thread, int nice)
+{
+    bool ints = cpu_interrupts_disable();
+
+    // only lock the run queue if the thread is actually runnable on it,
+    // otherwise there's nothing to re-sort
+    run_queue_t *rq = scheduler_lock_run_queue(thread);
+    fair_reweight(rq, thread, nice);
+    if (rq != NULL)
+    {
+        lock_release(&rq->lock);
+    }
+
+    cpu_interrupts_restore(ints);
+}
+
+// pick the scheduling class for a thread that hasn't been queued yet
+bool scheduler_apply_attr(thread_t *thread, const sched_attr_t *attr)
+{
+    // checked first, so that we don't admit a deadline thread only to throw
+    // it away again
+    if (attr->affinity != NULL)
+    {
+        if (!scheduler_affinity_usable(attr->affinity))
+            return false;
+        thread->affinity = *attr->affinity;
+        thread->pinned = true;
+    }
+
+    switch (attr->policy)
+    {
+    case SCHED_POLICY_NORMAL:
+        if (attr->nice < FAIR_NICE_MIN || attr->nice > FAIR_NICE_MAX)
+            return false;
+        thread->sched_class = &fair_sched_class;
+        thread->nice = attr->nice;
+        thread->weight = fair_nice_to_weight(attr->nice);
+        break;
+    case SCHED_POLICY_FIFO:
+    case SCHED_POLICY_RR:
+        if (attr->rt_priority < SCHED_RT_PRIORITY_MIN || attr->rt_priority > SCHED_RT_PRIORITY_MAX)
+            return false;
+        thread->sched_class = &rt_sched_class;
+        thread->rt_priority = attr->rt_priority;
+        break;
+    case SCHED_POLICY_DEADLINE:
+        if (!dl_admit(attr))
+            return false;
+        thread->sched_class = &dl_sched_class;
+        thread->dl_runtime = attr->runtime_ns;
+        thread->dl_deadline = attr->deadline_ns;
+        thread->dl_period = attr->period_ns;
+        break;
+    default:
+        return false;
+    }
+
+    thread->policy = attr->policy;
+    return true;
+}
+
+thread_t *new_kernel_thread(void *ip, void *arg, bool autoenqueue, const sched_attr_t *attr)
 {
     klog("sched", "Queueing up new kernel thread");
     void *stacks[PROC_MAX_STACKS_PER_THREAD];
@@ -348,18 +1040,33 @@ thread_t *new_kernel_thread(void *ip, void *arg, bool autoenqueue)
     t->cpu_state = cpu_state;
     t->timeslice = 5000;
     t->cpuid = (uint64_t)-1;
+    t->last_cpu = (uint64_t)-1;
+    t->sched_class = &fair_sched_class;
+    t->policy = SCHED_POLICY_NORMAL;
+    t->nice = 0;
+    t->weight = FAIR_NICE_0_WEIGHT;
+    cpumask_set_all(&t->affinity);
+
+    if (attr != NULL && !scheduler_apply_attr(t, attr))
+    {
+        klog("sched", "Rejected scheduling parameters for new kernel thread");
+        pmm_free(stack_phys, STACK_SIZE / PAGE_SIZE);
+        free(t);
+        return NULL;
+    }
+
     memcpy(t->stacks, stacks, sizeof(stacks));
-    t->fpu_storage = (void *)((uint64_t)pmm_alloc(div_roundup(fpu_storage_size, PAGE_SIZE)) + HIGHER_HALF);
+    // kernel threads almost never touch the FPU, so they only get somewhere
+    // to save its state if and when they do
+    t->fpu_storage = NULL;
+    t->fpu_cpu = (uint64_t)-1;
     t->self = t;
-    t->gs_base = (uint64_t)t;
+    t->gs_base = 0;
 
 
     if (autoenqueue)
     {
-        if (!enqueue_thread(t, false))
-        {
-            panic("Kernel could not enqueue a thread, did we hit MAX_THREADS for kernel threads?");
-        }
+        enqueue_thread(t, false);
     }
 
     return t;
@@ -457,54 +1164,24 @@ thread_t* new_user_thread(
         .cpu_state = cpu_status,
         .timeslice = 5000,
         .cpuid = -1,
+        .last_cpu = -1,
+        .sched_class = &fair_sched_class,
+        .policy = SCHED_POLICY_NORMAL,
+        .nice = 0,
+        .weight = FAIR_NICE_0_WEIGHT,
         .kernel_stack = kernel_stack,
         .pf_stack = pf_stack,
         .stacks = {stacks}, // <-- this seems sus to me...
-        .fpu_storage = (void*)(uint64_t)(pmm_alloc(div_roundup(fpu_storage_size, PAGE_SIZE)) + HIGHER_HALF)
+        .fpu_storage = fpu_alloc_storage(),
+        .fpu_cpu = -1,
     };
 
     t->self = t;
     t->gs_base = 0;
     t->fs_base = 0;
+    cpumask_set_all(&t->affinity);
 
-    fpu_restore(t->fpu_storage);
-
-    // reference: https://www.felixcloutier.com/x86/fldcw
-    // this instruction loads the operand into the FPU control word,
-    // which is used to put the FPU into a special mode:
-    // reference for the bit layout: http://web.archive.org/web/20190506231051/https://software.intel.com/en-us/articles/x87-and-sse-floating-point-assists-in-ia-32-flush-to-zero-ftz-and-denormals-are-zero-daz/
-    // we want to mask the following exceptions:
-    //      - invalid operand
-    //      - denormal operand
-    //      - divide by zero
-    //      - overflow
-    //      - underflow
-    //      - precision
-    //  (basically, all exceptions get masked)
-    // bits 6 and 7 are unused
-    // bits 8 and 9 refer to the precision control,
-    // and the upper bits for controlling infinity and rounding are left alone
-    uint16_t cw = 0b1100111111;
-    asm volatile (
-        "fldcw %0"
-        ::  "m" (cw) 
-        : "memory"
-    );
-
-	// references: 
-    // - https://www.felixcloutier.com/x86/ldmxcsr 
-    // - https://help.totalview.io/previous_releases/2019/html/index.html#page/Reference_Guide/Intelx86MXSCRRegister.html
-    // this instruction loads the operand into the MXCSR control/status register
-    // which is used for SSE operations.  The bitmask we send in is just to
-    // basically reset everything and mask all the exceptions.
-    uint32_t mxcsr = 0b1111110000000;
-    asm volatile (
-        "ldmxcsr %0"
-        :: "m" (mxcsr)
-        : "memory"
-    );
-
-    fpu_save(t->fpu_storage);
+    fpu_init_storage(t->fpu_storage);
 
     for(size_t i = 0; i < PROC_NUM_SIGACTIONS_PER_THREAD; i++)
     {
@@ -564,6 +1241,12 @@ thread_t* new_user_thread(
         stack -= 2;
         stack[0] = ELF_AT_PHNUM;
         stack[1] = elf_info.num_headers;
+        if (elf_info.time_page_mapped)
+        {
+            stack -= 2;
+            stack[0] = ELF_AT_TIME_PAGE;
+            stack[1] = TIME_PAGE_USER_ADDRESS;
+        }
 
 		// pass through the environment table
         stack--;
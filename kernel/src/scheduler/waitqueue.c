@@ -0,0 +1,98 @@
+#include <scheduler/waitqueue.h>
+#include <scheduler/scheduler.h>
+#include <proc/proc.h>
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+void wait_queue_add(wait_queue_t* wq, wait_queue_entry_t* entry)
+{
+    entry->next = NULL;
+    entry->prev = wq->tail;
+    if (wq->tail != NULL)
+        wq->tail->next = entry;
+    else
+        wq->head = entry;
+    wq->tail = entry;
+    entry->queued = true;
+}
+
+void wait_queue_remove(wait_queue_t* wq, wait_queue_entry_t* entry)
+{
+    if (!entry->queued)
+        return;
+
+    if (entry->prev != NULL)
+        entry->prev->next = entry->next;
+    else
+        wq->head = entry->next;
+    if (entry->next != NULL)
+        entry->next->prev = entry->prev;
+    else
+        wq->tail = entry->prev;
+
+    entry->next = NULL;
+    entry->prev = NULL;
+    entry->queued = false;
+}
+
+uint64_t wait_queue_wake(wait_queue_t* wq, uint64_t max)
+{
+    uint64_t woken = 0;
+    wait_queue_entry_t* entry = wq->head;
+
+    while (entry != NULL && woken < max)
+    {
+        wait_queue_entry_t* next = entry->next;
+
+        // a thread waiting on several queues is only woken by whichever gets
+        // to it first
+        uint64_t expected = WAIT_NOT_WOKEN;
+        if (atomic_compare_exchange_strong(&entry->thread->which_event, &expected, entry->which))
+        {
+            wait_queue_remove(wq, entry);
+            enqueue_thread(entry->thread, false);
+            woken++;
+        }
+
+        entry = next;
+    }
+
+    return woken;
+}
+
+void wait_prepare(thread_t* thread)
+{
+    atomic_store(&thread->which_event, WAIT_NOT_WOKEN);
+    scheduler_dequeue_thread(thread);
+}
+
+void wait_cancel(thread_t* thread)
+{
+    // if the thread has been woken, whoever did it has already put it back
+    uint64_t expected = WAIT_NOT_WOKEN;
+    if (atomic_compare_exchange_strong(&thread->which_event, &expected, 0))
+    {
+        enqueue_thread(thread, false);
+    }
+}
+
+void wait_queue_wait(wait_queue_t* wq)
+{
+    thread_t* thread = get_current_thread();
+    wait_queue_entry_t entry = {
+        .thread = thread,
+        .which = 0,
+    };
+
+    wait_prepare(thread);
+    wait_queue_add(wq, &entry);
+    lock_release(&wq->lock);
+
+    scheduler_yield();
+
+    lock_acquire(&wq->lock);
+    // we may have been put back in a run queue by something other than this
+    // wait queue (e.g a signal)
+    wait_queue_remove(wq, &entry);
+}
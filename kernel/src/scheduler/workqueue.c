@@ -0,0 +1,274 @@
+#include <scheduler/workqueue.h>
+#include <scheduler/scheduler.h>
+#include <cpu/smp.h>
+#include <cpu/percpu.h>
+#include <cpu/cpu.h>
+#include <cpu/cpumask.h>
+#include <mem/malloc.h>
+#include <klog/klog.h>
+#include <macro.h>
+#include <panic.h>
+
+workqueue_t* system_wq = NULL;
+workqueue_t* system_unbound_wq = NULL;
+
+void work_init(work_t* work, work_fn_t fn)
+{
+    work->fn = fn;
+    work->next = NULL;
+    atomic_store(&work->pending, false);
+    atomic_store(&work->pool, NULL);
+}
+
+static void worker_thread(void* arg)
+{
+    worker_pool_t* pool = arg;
+    event_t* events[] = { &pool->more_work };
+
+    for (;;)
+    {
+        bool ints = lock_acquire_irqsave(&pool->lock);
+        work_t* work = pool->head;
+        if (work != NULL)
+        {
+            pool->head = work->next;
+            if (pool->head == NULL)
+            {
+                pool->tail = NULL;
+            }
+            work->next = NULL;
+            atomic_store(&work->pool, NULL);
+            // from here it can be queued again, even while it's running
+            atomic_store(&work->pending, false);
+        }
+        lock_release_irqrestore(&pool->lock, ints);
+
+        if (work == NULL)
+        {
+            event_await(events, 1, true);
+            continue;
+        }
+
+        // the work might free itself, so don't touch it afterwards
+        work->fn(work);
+    }
+}
+
+static worker_pool_t* worker_pool_create(int64_t cpu, uint64_t workers)
+{
+    worker_pool_t* pool = malloc(sizeof(worker_pool_t));
+    *pool = (worker_pool_t) {
+        .head = NULL,
+        .tail = NULL,
+        .cpu = cpu,
+    };
+
+    cpumask_t affinity;
+    sched_attr_t attr = {
+        .policy = SCHED_POLICY_NORMAL,
+        .nice = 0,
+        .affinity = NULL,
+    };
+    if (cpu >= 0)
+    {
+        cpumask_clear_all(&affinity);
+        cpumask_set(&affinity, cpu);
+        attr.affinity = &affinity;
+    }
+
+    for (uint64_t i = 0; i < workers; i++)
+    {
+        if (new_kernel_thread(worker_thread, pool, true, &attr) == NULL)
+        {
+            panic("Couldn't start workqueue worker");
+        }
+    }
+    return pool;
+}
+
+workqueue_t* workqueue_create(const char* name, uint64_t flags)
+{
+    workqueue_t* wq = malloc(sizeof(workqueue_t));
+    wq->name = name;
+    wq->flags = flags;
+
+    if (flags & WORKQUEUE_UNBOUND)
+    {
+        wq->pools = malloc(sizeof(worker_pool_t*));
+        wq->pools[0] = worker_pool_create(-1, cpu_count);
+    }
+    else
+    {
+        wq->pools = malloc(sizeof(worker_pool_t*) * cpu_count);
+        for (uint64_t i = 0; i < cpu_count; i++)
+        {
+            wq->pools[i] = worker_pool_create(i, WORKQUEUE_PERCPU_WORKERS);
+        }
+    }
+
+    klog("workqueue", "Created workqueue %s", name);
+    return wq;
+}
+
+// put work which has already been marked pending on the pool
+static void worker_pool_insert(worker_pool_t* pool, work_t* work)
+{
+    bool ints = lock_acquire_irqsave(&pool->lock);
+
+    work->next = NULL;
+    if (pool->tail == NULL)
+    {
+        pool->head = work;
+    }
+    else
+    {
+        pool->tail->next = work;
+    }
+    pool->tail = work;
+    atomic_store(&work->pool, pool);
+
+    lock_release_irqrestore(&pool->lock, ints);
+
+    event_trigger_one(&pool->more_work, false);
+}
+
+// must be called with interrupts disabled (or from a bottom half), so we
+// stay on the CPU
+static worker_pool_t* workqueue_local_pool(workqueue_t* wq)
+{
+    if (wq->flags & WORKQUEUE_UNBOUND)
+    {
+        return wq->pools[0];
+    }
+    return wq->pools[this_cpu_read(cpu_number)];
+}
+
+bool workqueue_queue(workqueue_t* wq, work_t* work)
+{
+    if (atomic_exchange(&work->pending, true))
+    {
+        return false;
+    }
+
+    bool ints = cpu_interrupts_disable();
+    worker_pool_t* pool = workqueue_local_pool(wq);
+    cpu_interrupts_restore(ints);
+
+    worker_pool_insert(pool, work);
+    return true;
+}
+
+bool workqueue_queue_on(workqueue_t* wq, work_t* work, uint64_t cpu)
+{
+    if (cpu >= cpu_count)
+    {
+        klog("workqueue", "Can't queue work on CPU %d of %d", cpu, cpu_count);
+        return false;
+    }
+    if (atomic_exchange(&work->pending, true))
+    {
+        return false;
+    }
+
+    worker_pool_t* pool = (wq->flags & WORKQUEUE_UNBOUND) ? wq->pools[0] : wq->pools[cpu];
+    worker_pool_insert(pool, work);
+    return true;
+}
+
+bool workqueue_cancel(work_t* work)
+{
+    for (;;)
+    {
+        if (!atomic_load(&work->pending))
+        {
+            return false;
+        }
+
+        worker_pool_t* pool = atomic_load(&work->pool);
+        if (pool == NULL)
+        {
+            // someone's in the middle of putting it on a pool
+            asm volatile ( "pause" ::: "memory" );
+            continue;
+        }
+
+        bool ints = lock_acquire_irqsave(&pool->lock);
+
+        // a worker got to it first, or it's moved on since
+        if (atomic_load(&work->pool) != pool)
+        {
+            lock_release_irqrestore(&pool->lock, ints);
+            continue;
+        }
+
+        work_t** link = &pool->head;
+        work_t* prev = NULL;
+        while (*link != work)
+        {
+            prev = *link;
+            link = &(*link)->next;
+        }
+        *link = work->next;
+        if (pool->tail == work)
+        {
+            pool->tail = prev;
+        }
+        work->next = NULL;
+        atomic_store(&work->pool, NULL);
+        atomic_store(&work->pending, false);
+
+        lock_release_irqrestore(&pool->lock, ints);
+        return true;
+    }
+}
+
+// runs in the timer bottom half
+static void delayed_work_timer(hpr_timer_t* timer)
+{
+    delayed_work_t* dwork = CONTAINER_OF(timer, delayed_work_t, timer);
+    worker_pool_insert(workqueue_local_pool(dwork->wq), &dwork->work);
+}
+
+void delayed_work_init(delayed_work_t* dwork, work_fn_t fn)
+{
+    work_init(&dwork->work, fn);
+    dwork->timer = (hpr_timer_t) {0};
+    dwork->timer.callback = delayed_work_timer;
+    dwork->wq = NULL;
+}
+
+bool workqueue_queue_delayed(workqueue_t* wq, delayed_work_t* dwork, uint64_t nanos)
+{
+    if (nanos == 0)
+    {
+        dwork->wq = wq;
+        return workqueue_queue(wq, &dwork->work);
+    }
+    if (atomic_exchange(&dwork->work.pending, true))
+    {
+        return false;
+    }
+
+    dwork->wq = wq;
+    timer_arm(&dwork->timer, timer_get_nanos() + nanos);
+    return true;
+}
+
+bool workqueue_cancel_delayed(delayed_work_t* dwork)
+{
+    if (timer_disarm(&dwork->timer))
+    {
+        atomic_store(&dwork->work.pending, false);
+        return true;
+    }
+
+    // either it was never queued, or the timer's already gone off and it's
+    // on (or on its way to) a pool
+    return workqueue_cancel(&dwork->work);
+}
+
+void workqueue_init()
+{
+    system_wq = workqueue_create("system", 0);
+    system_unbound_wq = workqueue_create("system_unbound", WORKQUEUE_UNBOUND);
+}
@@ -0,0 +1,57 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+static void sort_swap(uint8_t* a, uint8_t* b, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        uint8_t tmp = a[i];
+        a[i] = b[i];
+        b[i] = tmp;
+    }
+}
+
+// push the element at `root` down until it's bigger than both its children
+static void sort_sift_down(uint8_t* base, size_t root, size_t count, size_t size,
+    int (*compar)(const void*, const void*))
+{
+    for (;;)
+    {
+        size_t child = root * 2 + 1;
+        if (child >= count)
+        {
+            return;
+        }
+        if (child + 1 < count && compar(base + child * size, base + (child + 1) * size) < 0)
+        {
+            child++;
+        }
+        if (compar(base + root * size, base + child * size) >= 0)
+        {
+            return;
+        }
+        sort_swap(base + root * size, base + child * size, size);
+        root = child;
+    }
+}
+
+// a heapsort: no recursion and no extra memory, which is what we want in here
+void qsort(void* base, size_t nmemb, size_t size, int (*compar)(const void*, const void*))
+{
+    uint8_t* bytes = base;
+    if (nmemb < 2)
+    {
+        return;
+    }
+
+    for (size_t i = nmemb / 2; i > 0; i--)
+    {
+        sort_sift_down(bytes, i - 1, nmemb, size, compar);
+    }
+    for (size_t end = nmemb - 1; end > 0; end--)
+    {
+        sort_swap(bytes, bytes + end * size, size);
+        sort_sift_down(bytes, 0, end, size, compar);
+    }
+}
@@ -1,17 +1,27 @@
-#include "syscall.h"
+#include <sys/syscall.h>
+#include <cpu/smp.h>
+#include <proc/proc.h>
 #include <panic.h>
 #include <klog/klog.h>
+#include <futex/futex.h>
+#include <ioring/ioring.h>
 
-#define SYSCALL_NUM_ENTRIES 1
+#include <stddef.h>
 
-void* syscall_table[SYSCALL_NUM_ENTRIES];
+_Static_assert(offsetof(local_cpu_t, current_thread) == SYSCALL_PERCPU_CURRENT_THREAD, "syscall stub has the wrong current thread offset");
+_Static_assert(offsetof(local_cpu_t, user_rsp) == SYSCALL_PERCPU_USER_RSP, "syscall stub has the wrong user rsp offset");
+_Static_assert(offsetof(thread_t, errno) == SYSCALL_THREAD_ERRNO, "syscall stub has the wrong errno offset");
+_Static_assert(offsetof(thread_t, kernel_stack) == SYSCALL_THREAD_KERNEL_STACK, "syscall stub has the wrong kernel stack offset");
+// the stub leaves the stack 16 byte aligned for the call
+_Static_assert(sizeof(syscall_frame_t) % 16 == 0, "syscall frame breaks stack alignment");
 
-void syscall_entry()
-{
-    panic("Syscalls not yet implemented");
-}
+// anything left NULL fails with ENOSYS
+void* syscall_table[SYSCALL_NUM_ENTRIES];
 
 void syscall_init()
 {
-    syscall_table[0] = syscall_klog;
+    syscall_table[SYSCALL_KLOG] = syscall_klog;
+    syscall_table[SYSCALL_FUTEX] = syscall_futex;
+    syscall_table[SYSCALL_IORING_SETUP] = syscall_ioring_setup;
+    syscall_table[SYSCALL_IORING_ENTER] = syscall_ioring_enter;
 }
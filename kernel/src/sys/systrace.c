@@ -0,0 +1,472 @@
+#include <sys/systrace.h>
+#include <sys/errno.h>
+#include <cpu/cpu.h>
+#include <cpu/percpu.h>
+#include <proc/proc.h>
+#include <lock/lock.h>
+#include <lock/rcu.h>
+#include <scheduler/preempt.h>
+#include <resource/resource.h>
+#include <fs/devtmpfs.h>
+#include <klog/klog.h>
+#include <stat/stat.h>
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// a traced process's records.  Several of its threads can make syscalls at
+// once, so adding to it takes the lock.
+typedef struct systrace_ring_s {
+    lock_t lock;
+    uint64_t pid;
+    // free running, like the ioring's
+    uint64_t head;
+    uint64_t tail;
+    uint64_t dropped;
+    systrace_record_t records[SYSTRACE_RING_ENTRIES];
+    rcu_head_t rcu;
+} systrace_ring_t;
+
+typedef int64_t (*syscall_handler_t)(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t);
+
+_Atomic uint8_t syscall_trace_active = 0;
+
+static _Atomic bool systrace_counting = false;
+static DEFINE_PER_CPU(systrace_cpu_t, systrace_cpu);
+
+// every ring that's set up, for the reader to go through.  Changes to it
+// take systrace_rings_lock, and each ring is only freed once no syscall can
+// still be adding to it.
+static lock_t systrace_rings_lock;
+static systrace_ring_t* systrace_rings[SYSTRACE_MAX_TRACED];
+static uint64_t systrace_ring_count = 0;
+// where the last read left off, so one busy process can't starve the rest
+static uint64_t systrace_next_ring = 0;
+// triggered when a ring goes from empty to not
+static event_t systrace_event;
+
+static resource_t syscallstat_device;
+static resource_t systrace_device;
+
+static const char* systrace_names[SYSCALL_NUM_ENTRIES] = {
+    [SYSCALL_KLOG] = "klog",
+    [SYSCALL_FUTEX] = "futex",
+    [SYSCALL_IORING_SETUP] = "ioring_setup",
+    [SYSCALL_IORING_ENTER] = "ioring_enter",
+};
+
+// must be called with systrace_rings_lock held
+static void systrace_update_active()
+{
+    atomic_store(&syscall_trace_active, atomic_load(&systrace_counting) || systrace_ring_count != 0);
+}
+
+static void systrace_count(uint64_t number, uint64_t cycles, bool failed)
+{
+    uint64_t bucket = cycles == 0 ? 0 : 64 - __builtin_clzll(cycles);
+    if (bucket >= SYSTRACE_HISTOGRAM_BUCKETS)
+    {
+        bucket = SYSTRACE_HISTOGRAM_BUCKETS - 1;
+    }
+
+    // only syscalls touch these, so keeping them on this CPU for the
+    // duration is all it takes
+    preempt_disable();
+    systrace_counters_t* counters = &this_cpu_ptr(systrace_cpu)->syscalls[number];
+    counters->calls++;
+    counters->errors += failed;
+    counters->cycles += cycles;
+    if (cycles > counters->cycles_max)
+    {
+        counters->cycles_max = cycles;
+    }
+    counters->histogram[bucket]++;
+    preempt_enable();
+}
+
+static void systrace_record(systrace_ring_t* ring, const systrace_record_t* record)
+{
+    lock_acquire(&ring->lock);
+    bool was_empty = ring->head == ring->tail;
+    if (ring->tail - ring->head == SYSTRACE_RING_ENTRIES)
+    {
+        ring->dropped++;
+        lock_release(&ring->lock);
+        return;
+    }
+    ring->records[ring->tail % SYSTRACE_RING_ENTRIES] = *record;
+    ring->tail++;
+    lock_release(&ring->lock);
+
+    // the reader only goes to sleep once it's emptied every ring
+    if (was_empty)
+    {
+        event_trigger(&systrace_event, false);
+    }
+}
+
+int64_t syscall_trace_dispatch(syscall_frame_t* frame)
+{
+    thread_t* thread = get_current_thread();
+    uint64_t number = frame->rax;
+    syscall_handler_t handler = number < SYSCALL_NUM_ENTRIES ? syscall_table[number] : NULL;
+
+    uint64_t start = cpu_rdtsc();
+    int64_t result = -1;
+    if (handler != NULL)
+    {
+        result = handler(frame->rdi, frame->rsi, frame->rdx, frame->r10, frame->r8, frame->r9);
+    }
+    else
+    {
+        thread->errno = ENOSYS;
+    }
+    uint64_t cycles = cpu_rdtsc() - start;
+
+    if (atomic_load_explicit(&systrace_counting, memory_order_relaxed))
+    {
+        systrace_count(number < SYSCALL_NUM_ENTRIES ? number : SYSCALL_NUM_ENTRIES, cycles, result < 0);
+    }
+
+    rcu_read_lock();
+    systrace_ring_t* ring = rcu_dereference(thread->process->systrace);
+    if (ring != NULL)
+    {
+        systrace_record_t record = {
+            .pid = thread->process->pid,
+            .tid = thread->tid,
+            .number = number,
+            .args = { frame->rdi, frame->rsi, frame->rdx, frame->r10, frame->r8, frame->r9 },
+            .result = result,
+            .errno = thread->errno,
+            .cycles = cycles,
+        };
+        systrace_record(ring, &record);
+    }
+    rcu_read_unlock();
+
+    return result;
+}
+
+// everything on a line but the name
+#define SYSCALLSTAT_LINE_MAX 128
+#define SYSCALLSTAT_HEADER "calls errors cycles-total cycles-max syscall\n"
+
+// add up every CPU's counts and render them as text, returning its length.
+// *out is NULL if there wasn't the memory for it.
+static uint64_t syscallstat_render(char** out)
+{
+    uint64_t capacity = sizeof(SYSCALLSTAT_HEADER)
+        + (SYSCALL_NUM_ENTRIES + 1) * SYSCALLSTAT_LINE_MAX * (SYSTRACE_HISTOGRAM_BUCKETS + 1);
+    char* text = malloc(capacity);
+    *out = text;
+    if (text == NULL)
+    {
+        return 0;
+    }
+    uint64_t length = snprintf(text, capacity, SYSCALLSTAT_HEADER);
+
+    for (uint64_t number = 0; number <= SYSCALL_NUM_ENTRIES; number++)
+    {
+        systrace_counters_t total = {0};
+        for (uint64_t cpu = 0; cpu < cpu_count; cpu++)
+        {
+            // the counts can change under us, but each of them is only ever
+            // written whole
+            systrace_counters_t* counters = &per_cpu_ptr(systrace_cpu, cpu)->syscalls[number];
+            total.calls += counters->calls;
+            total.errors += counters->errors;
+            total.cycles += counters->cycles;
+            if (counters->cycles_max > total.cycles_max)
+            {
+                total.cycles_max = counters->cycles_max;
+            }
+            for (uint64_t i = 0; i < SYSTRACE_HISTOGRAM_BUCKETS; i++)
+            {
+                total.histogram[i] += counters->histogram[i];
+            }
+        }
+        if (total.calls == 0)
+        {
+            continue;
+        }
+
+        length += snprintf(text + length, capacity - length, "%lu %lu %lu %lu ",
+            total.calls, total.errors, total.cycles, total.cycles_max);
+        if (number < SYSCALL_NUM_ENTRIES && systrace_names[number] != NULL)
+            length += snprintf(text + length, capacity - length, "%s\n", systrace_names[number]);
+        else if (number < SYSCALL_NUM_ENTRIES)
+            length += snprintf(text + length, capacity - length, "%lu\n", number);
+        else
+            length += snprintf(text + length, capacity - length, "invalid\n");
+
+        // the histogram, one bucket per line, leaving out the empty ones
+        for (uint64_t i = 0; i < SYSTRACE_HISTOGRAM_BUCKETS; i++)
+        {
+            if (total.histogram[i] == 0)
+                continue;
+            length += snprintf(text + length, capacity - length, "  <2^%lu %lu\n", i, total.histogram[i]);
+        }
+    }
+
+    *out = text;
+    return length;
+}
+
+static int64_t syscallstat_read(__attribute__((unused)) resource_t* self, __attribute__((unused)) void* handle,
+    void* buf, uint64_t loc, uint64_t count)
+{
+    char* text = NULL;
+    uint64_t length = syscallstat_render(&text);
+    if (text == NULL)
+    {
+        get_current_thread()->errno = ENOMEM;
+        return -1;
+    }
+    if (loc >= length)
+    {
+        free(text);
+        return 0;
+    }
+    if (count > length - loc)
+    {
+        count = length - loc;
+    }
+    memcpy(buf, text + loc, count);
+    free(text);
+    return count;
+}
+
+// "1" clears the counts and starts counting, "0" stops
+static int64_t syscallstat_write(__attribute__((unused)) resource_t* self, __attribute__((unused)) void* handle,
+    void* buf, __attribute__((unused)) uint64_t loc, uint64_t count)
+{
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    bool on = ((char*)buf)[0] == '1';
+    if (on)
+    {
+        // anything still counting from before is about to stop anyway,
+        // since counting is off until we're done
+        atomic_store(&systrace_counting, false);
+        for (uint64_t cpu = 0; cpu < cpu_count; cpu++)
+        {
+            memset(per_cpu_ptr(systrace_cpu, cpu), 0, sizeof(systrace_cpu_t));
+        }
+    }
+
+    lock_acquire(&systrace_rings_lock);
+    atomic_store(&systrace_counting, on);
+    systrace_update_active();
+    lock_release(&systrace_rings_lock);
+    return count;
+}
+
+static int syscallstat_ioctl(__attribute__((unused)) resource_t* self, void* handle, uint64_t request, void* argp)
+{
+    return resource_default_ioctl(handle, request, argp);
+}
+
+static void systrace_free_ring(rcu_head_t* head)
+{
+    free(CONTAINER_OF(head, systrace_ring_t, rcu));
+}
+
+static int systrace_trace(uint64_t pid)
+{
+    systrace_ring_t* ring = malloc(sizeof(systrace_ring_t));
+    if (ring == NULL)
+    {
+        return -1;
+    }
+    ring->pid = pid;
+
+    lock_acquire(&systrace_rings_lock);
+    rcu_read_lock();
+    process_t* process = proc_find(pid);
+    bool ok = process != NULL && process->systrace == NULL && systrace_ring_count < SYSTRACE_MAX_TRACED;
+    if (ok)
+    {
+        systrace_rings[systrace_ring_count++] = ring;
+        rcu_assign_pointer(process->systrace, ring);
+        systrace_update_active();
+    }
+    rcu_read_unlock();
+    lock_release(&systrace_rings_lock);
+
+    if (!ok)
+    {
+        free(ring);
+        return -1;
+    }
+    return 0;
+}
+
+static int systrace_untrace(uint64_t pid)
+{
+    systrace_ring_t* ring = NULL;
+
+    lock_acquire(&systrace_rings_lock);
+    for (uint64_t i = 0; i < systrace_ring_count; i++)
+    {
+        if (systrace_rings[i]->pid == pid)
+        {
+            ring = systrace_rings[i];
+            systrace_rings[i] = systrace_rings[--systrace_ring_count];
+            break;
+        }
+    }
+    if (ring != NULL)
+    {
+        rcu_read_lock();
+        process_t* process = proc_find(pid);
+        if (process != NULL)
+        {
+            rcu_assign_pointer(process->systrace, NULL);
+        }
+        rcu_read_unlock();
+        systrace_update_active();
+    }
+    lock_release(&systrace_rings_lock);
+
+    if (ring == NULL)
+    {
+        return -1;
+    }
+    // whatever hadn't been read yet goes with it
+    call_rcu(&ring->rcu, systrace_free_ring);
+    return 0;
+}
+
+static int systrace_ioctl(__attribute__((unused)) resource_t* self, void* handle, uint64_t request, void* argp)
+{
+    switch (request)
+    {
+        case SYSTRACE_IOCTL_TRACE:
+            return systrace_trace((uint64_t)argp);
+        case SYSTRACE_IOCTL_UNTRACE:
+            return systrace_untrace((uint64_t)argp);
+        default:
+            return resource_default_ioctl(handle, request, argp);
+    }
+}
+
+// take up to `max` records off the rings, starting where the last read left
+// off
+static uint64_t systrace_take(systrace_record_t* out, uint64_t max)
+{
+    uint64_t taken = 0;
+
+    lock_acquire(&systrace_rings_lock);
+    for (uint64_t n = 0; n < systrace_ring_count && taken < max; n++)
+    {
+        systrace_ring_t* ring = systrace_rings[(systrace_next_ring + n) % systrace_ring_count];
+        lock_acquire(&ring->lock);
+        while (ring->head != ring->tail && taken < max)
+        {
+            out[taken++] = ring->records[ring->head % SYSTRACE_RING_ENTRIES];
+            ring->head++;
+        }
+        // whatever was dropped came after everything that was kept
+        if (ring->dropped != 0 && ring->head == ring->tail && taken < max)
+        {
+            out[taken++] = (systrace_record_t) {
+                .pid = ring->pid,
+                .number = SYSTRACE_DROPPED,
+                .result = ring->dropped,
+            };
+            ring->dropped = 0;
+        }
+        lock_release(&ring->lock);
+    }
+    if (systrace_ring_count != 0)
+    {
+        systrace_next_ring = (systrace_next_ring + 1) % systrace_ring_count;
+    }
+    lock_release(&systrace_rings_lock);
+
+    return taken;
+}
+
+static int64_t systrace_read(__attribute__((unused)) resource_t* self, __attribute__((unused)) void* handle,
+    void* buf, __attribute__((unused)) uint64_t loc, uint64_t count)
+{
+    uint64_t max = count / sizeof(systrace_record_t);
+    if (max == 0)
+    {
+        return 0;
+    }
+    if (max > SYSTRACE_RING_ENTRIES)
+    {
+        max = SYSTRACE_RING_ENTRIES;
+    }
+
+    // copied out through a buffer of our own, so we're not touching the
+    // caller's memory with the locks held
+    systrace_record_t* records = malloc(max * sizeof(systrace_record_t));
+    if (records == NULL)
+    {
+        get_current_thread()->errno = ENOMEM;
+        return -1;
+    }
+    uint64_t taken = 0;
+    while ((taken = systrace_take(records, max)) == 0)
+    {
+        event_t* events[] = { &systrace_event };
+        if (event_await(events, 1, true) < 0)
+        {
+            free(records);
+            get_current_thread()->errno = EINTR;
+            return -1;
+        }
+    }
+
+    memcpy(buf, records, taken * sizeof(systrace_record_t));
+    free(records);
+    return taken * sizeof(systrace_record_t);
+}
+
+// nothing can be written to the trace
+static int64_t systrace_write(__attribute__((unused)) resource_t* self, __attribute__((unused)) void* handle,
+    __attribute__((unused)) void* buf, __attribute__((unused)) uint64_t loc, __attribute__((unused)) uint64_t count)
+{
+    get_current_thread()->errno = EINVAL;
+    return -1;
+}
+
+static bool systrace_unref(__attribute__((unused)) resource_t* self, __attribute__((unused)) void* handle)
+{
+    return true;
+}
+
+static void systrace_add_device(resource_t* device, const char* name)
+{
+    device->stat.size = 0;
+    device->stat.blocks = 0;
+    device->stat.block_size = 4096;
+    device->stat.rdev = resource_create_dev_id();
+    device->stat.mode = 0644 | STAT_IFCHR;
+    devtmpfs_add_device(device, name);
+}
+
+void systrace_init()
+{
+    syscallstat_device.read = syscallstat_read;
+    syscallstat_device.write = syscallstat_write;
+    syscallstat_device.ioctl = syscallstat_ioctl;
+    syscallstat_device.unref = systrace_unref;
+    systrace_add_device(&syscallstat_device, "syscallstat");
+
+    systrace_device.read = systrace_read;
+    systrace_device.write = systrace_write;
+    systrace_device.ioctl = systrace_ioctl;
+    systrace_device.unref = systrace_unref;
+    systrace_add_device(&systrace_device, "systrace");
+
+    klog("systrace", "Syscall statistics available from /dev/syscallstat, traces from /dev/systrace");
+}
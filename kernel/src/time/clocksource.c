@@ -0,0 +1,138 @@
+#include <time/clocksource.h>
+#include <time/timer.h>
+#include <cpu/cpu.h>
+#include <klog/klog.h>
+#include <lock/seqlock.h>
+#include <mem/pmm.h>
+#include <mem/mmap.h>
+
+// NULL until clocksource_init, in which case the clock is the HPET
+static time_page_t* time_page = NULL;
+static uint64_t time_page_phys = 0;
+// serialises writers, readers only go by time_page->seq.  That count is part
+// of the page userland sees, so it's a bare seqcount rather than a seqlock_t.
+static lock_t time_page_lock;
+static bool have_tsc_deadline = false;
+// ticks per second
+uint64_t tsc_frequency = 0;
+
+void clocksource_init()
+{
+    uint32_t a = 0, b = 0, c = 0, d = 0;
+
+    // a page of its own, since it's shared with userland
+    time_page_phys = (uint64_t)pmm_alloc(1);
+    time_page = (time_page_t*)(time_page_phys + HIGHER_HALF);
+    time_page->hpet_period = hpet_get_period();
+
+    if (cpu_id(1, 0, &a, &b, &c, &d) && (c & (1 << 24)) != 0)
+    {
+        have_tsc_deadline = true;
+    }
+
+    if (!cpu_id(0x80000007, 0, &a, &b, &c, &d) || (d & (1 << 8)) == 0)
+    {
+        klog("clock", "TSC isn't invariant, using the HPET as the clock");
+        have_tsc_deadline = false;
+        return;
+    }
+
+    // take each TSC reading as close to its HPET reading as we can
+    uint64_t tsc_start = time_page_rdtsc();
+    uint64_t hpet_start = hpet_get_nanos();
+    uint64_t hpet_end = hpet_start;
+    while (hpet_end - hpet_start < CLOCKSOURCE_CALIBRATION_NANOS)
+    {
+        asm volatile ("pause" ::: "memory");
+        hpet_end = hpet_get_nanos();
+    }
+    uint64_t tsc_end = time_page_rdtsc();
+
+    // there's no 128-bit division without libgcc, but neither of these can
+    // overflow for any TSC running under ~300GHz
+    tsc_frequency = ((tsc_end - tsc_start) * 1000000000) / (hpet_end - hpet_start);
+    if (tsc_frequency == 0)
+    {
+        klog("clock", "TSC didn't tick during calibration, using the HPET as the clock");
+        have_tsc_deadline = false;
+        return;
+    }
+
+    bool ints = lock_acquire_irqsave(&time_page_lock);
+    seqcount_write_begin(&time_page->seq);
+    time_page->mult = ((uint64_t)1000000000 << TIME_PAGE_SHIFT) / tsc_frequency;
+    // carry on from where the HPET got to, so the clock doesn't jump
+    time_page->tsc_base = tsc_end;
+    time_page->nanos_base = hpet_end;
+    time_page->use_tsc = true;
+    seqcount_write_end(&time_page->seq);
+    lock_release_irqrestore(&time_page_lock, ints);
+
+    klog("clock", "Invariant TSC runs at %d kHz, TSC deadline timer %s",
+        tsc_frequency / 1000, have_tsc_deadline ? "available" : "unavailable");
+}
+
+uint64_t clocksource_read_nanos()
+{
+    uint64_t nanos = 0;
+    int64_t offset = 0;
+    if (time_page == NULL || !time_page_read(time_page, &nanos, &offset))
+    {
+        return hpet_get_nanos();
+    }
+    return nanos;
+}
+
+int64_t clocksource_read_realtime()
+{
+    uint64_t nanos = 0;
+    int64_t offset = 0;
+    if (time_page == NULL)
+    {
+        return hpet_get_nanos();
+    }
+    if (!time_page_read(time_page, &nanos, &offset))
+    {
+        nanos = hpet_get_nanos();
+    }
+    return (int64_t)nanos + offset;
+}
+
+void clocksource_set_realtime(int64_t nanos)
+{
+    bool ints = lock_acquire_irqsave(&time_page_lock);
+    int64_t offset = nanos - (int64_t)clocksource_read_nanos();
+    seqcount_write_begin(&time_page->seq);
+    time_page->realtime_offset = offset;
+    seqcount_write_end(&time_page->seq);
+    lock_release_irqrestore(&time_page_lock, ints);
+}
+
+bool clocksource_have_tsc_deadline()
+{
+    return have_tsc_deadline;
+}
+
+uint64_t clocksource_nanos_to_tsc(uint64_t nanos)
+{
+    return (nanos / 1000000000) * tsc_frequency + ((nanos % 1000000000) * tsc_frequency) / 1000000000;
+}
+
+bool clocksource_map_time_page(pagemap_t* pagemap)
+{
+    if (time_page == NULL)
+    {
+        return false;
+    }
+
+    // shared, so that forked children keep it
+    if (!mmap_map_range(pagemap, TIME_PAGE_USER_ADDRESS, time_page_phys, PAGE_SIZE, MMAP_PROT_READ, MMAP_MAP_SHARED))
+    {
+        return false;
+    }
+    if (!time_page->use_tsc)
+    {
+        return mmap_map_range(pagemap, TIME_PAGE_USER_ADDRESS + TIME_PAGE_HPET_OFFSET, hpet_get_address(), PAGE_SIZE, MMAP_PROT_READ, MMAP_MAP_SHARED);
+    }
+    return true;
+}
@@ -1,11 +1,5 @@
 #include <time/pit.h>
 #include <io/io.h>
-#include <interrupt/apic.h>
-#include <interrupt/idt.h>
-#include <interrupt/isr.h>
-#include <cpu/smp.h>
-#include <time/timer.h>
-#include <klog/klog.h>
 
 void pit_set_frequency(uint64_t freq)
 {
@@ -32,19 +26,3 @@ void pit_set_reload_value(uint16_t new_count)
     outb(0x40, (uint8_t)new_count);
     outb(0x40, (uint8_t)new_count >> 8);
 }
-
-void pit_handler(__attribute__((unused)) uint32_t num, __attribute__((unused)) cpu_status_t* status)
-{
-    timer_handler();
-    lapic_eoi();
-}
-
-void pit_init()
-{
-    pit_set_frequency(TIMER_FREQUENCY);
-
-    uint8_t vector = idt_allocate_vector();
-    klog("timer", "PIT Vector is 0x%x", vector);
-    interrupt_table[vector] = (void*)pit_handler;
-    io_apic_set_irq_redirect(local_cpus[0]->lapic_id, vector, 0, true);
-}
@@ -1,4 +1,6 @@
 #include <time/timer.h>
+#include <time/clocksource.h>
+#include <uapi/time/timepage.h>
 #include <acpi/acpi.h>
 #include <lai/include/acpispec/tables.h>
 #include <mem/pagemap.h>
@@ -6,16 +8,57 @@
 #include <mem/pmm.h>
 #include <debug/debug.h>
 #include <lock/lock.h>
-#include <time/pit.h>
+#include <cpu/kio.h>
+#include <cpu/cpu.h>
+#include <proc/proc.h>
+#include <scheduler/scheduler.h>
+#include <interrupt/softirq.h>
+#include <cpu/smp.h>
+#include <cpu/percpu.h>
 
 extern pagemap_t g_kernel_pagemap;
 
 static hpet_t* hpet = 0;
-timespec_t monotonic_clock;
-timespec_t realtime_clock;
-lock_t timers_lock;
-hpr_timer_t* armed_timers;
-size_t armed_timers_count;
+
+// each level of the wheel has 64 buckets, so that a level's worth of
+// pending bits fits in a word
+#define WHEEL_LEVEL_BITS 6
+#define WHEEL_LEVEL_SIZE (1 << WHEEL_LEVEL_BITS)
+#define WHEEL_LEVEL_MASK (WHEEL_LEVEL_SIZE - 1)
+#define WHEEL_BUCKETS (TIMER_WHEEL_LEVELS * WHEEL_LEVEL_SIZE)
+// each level's buckets are 8 times wider than the level below's
+#define WHEEL_CLK_SHIFT 3
+#define WHEEL_CLK_MASK ((1 << WHEEL_CLK_SHIFT) - 1)
+#define WHEEL_LEVEL_SHIFT(n) ((n) * WHEEL_CLK_SHIFT)
+#define WHEEL_LEVEL_GRAN(n) (1ull << WHEEL_LEVEL_SHIFT(n))
+// timers due fewer than this many ticks away go on a level below n
+#define WHEEL_LEVEL_START(n) ((uint64_t)WHEEL_LEVEL_MASK << WHEEL_LEVEL_SHIFT((n) - 1))
+// timers further away than the wheel reaches are parked at the far end, and
+// put back when that comes round
+#define WHEEL_MAX_DELTA (WHEEL_LEVEL_START(TIMER_WHEEL_LEVELS) - 1)
+// the bucket a timer is in once it has been taken off the wheel to be fired
+#define WHEEL_BUCKET_EXPIRING UINT32_MAX
+
+typedef struct timer_base_s {
+    // taken with interrupts disabled, since timers are fired from the timer
+    // bottom half
+    lock_t lock;
+    // the next tick to be expired
+    uint64_t clk;
+    // which buckets have timers in them, a word for each level
+    uint64_t pending[TIMER_WHEEL_LEVELS];
+    hpr_timer_t* buckets[WHEEL_BUCKETS];
+    // timers taken off the wheel, about to be fired.  They can still be
+    // disarmed until they are.
+    hpr_timer_t* expiring;
+    // the timer whose callback is being run, with the lock dropped
+    hpr_timer_t* _Atomic running;
+    uint64_t cpu_number;
+} timer_base_t;
+
+// one for each CPU, each on the CPU's own lines
+static DEFINE_PER_CPU(timer_base_t, timer_base);
+static bool timer_bases_ready = false;
 
 void hpet_init()
 {
@@ -37,31 +80,43 @@ void hpet_init()
 
 void timer_init(int64_t epoch)
 {
-    monotonic_clock = (timespec_t) {
-        .tv_sec = epoch,
-        .tv_nsec = 0
-    };
-    realtime_clock = (timespec_t) {
-        .tv_sec = epoch,
-        .tv_nsec = 0,
-    };
+    // there's no periodic interrupt keeping the time, every clock is read
+    // straight from the clocksource instead
+    clocksource_set_realtime(epoch * 1000000000);
 
-    pit_init();
+    uint64_t now_tick = timer_get_nanos() >> TIMER_WHEEL_TICK_SHIFT;
+    for (uint64_t i = 0; i < cpu_count; i++)
+    {
+        timer_base_t* base = per_cpu_ptr(timer_base, i);
+        base->clk = now_tick;
+        base->cpu_number = i;
+    }
+    timer_bases_ready = true;
+
+    softirq_register(SOFTIRQ_TIMER, timer_run_expired);
 }
 
 void sleep(uint32_t millis)
 {
-    millis /= 8;
-    uint64_t deadline = hpet->counter_value + 
-        // convert millis to ticks (might be better to use get_ticks_per_second?)
-        (millis * 10000000000000)  
-        / 
-        ((hpet->capabilities >> 32) & 0xffffffff)
-        ;
+    uint64_t deadline = timer_get_nanos() + (uint64_t)millis * 1000000;
+
+    // before there are any threads, there's nothing else we could be doing
+    // anyway, so just spin
+    if (!atomic_load(&scheduler_ready) || get_current_thread() == NULL)
+    {
+        while (timer_get_nanos() < deadline)
+            asm volatile ("pause" : : : "memory");
+        return;
+    }
 
-    // wait for deadline to pass
-    while(hpet->counter_value < deadline)
-        asm volatile ("pause" : : : "memory");
+    hpr_timer_t timer = {0};
+    event_t* event = &timer.event;
+    timer_arm(&timer, deadline);
+    while (event_await(&event, 1, true) < 0)
+    {
+        // woken up by something else, go back to sleep
+    }
+    timer_disarm(&timer);
 }
 
 uint64_t get_ticks_per_second()
@@ -74,80 +129,468 @@ uint64_t get_ticks()
     return hpet->counter_value;
 }
 
-void add_interval(timespec_t* dest, timespec_t src)
+// nanoseconds since the HPET was switched on, straight from the HPET.  Each
+// read goes out over MMIO, so this is only for calibrating the TSC, or if it
+// can't be used.
+uint64_t hpet_get_nanos()
+{
+    if (hpet == NULL)
+    {
+        return 0;
+    }
+
+    return time_page_hpet_nanos(mmin64((uint64_t)&hpet->counter_value), hpet_get_period());
+}
+
+uint64_t hpet_get_period()
+{
+    return (hpet->capabilities >> 32) & 0xffffffff;
+}
+
+uint64_t hpet_get_address()
 {
-    // handle rolling over nanoseconds
-    if(dest->tv_nsec + src.tv_nsec > 999999999)
+    // it's identity mapped
+    return (uint64_t)hpet;
+}
+
+// the monotonic clock in nanoseconds, from the clocksource: the calibrated
+// TSC, or the HPET where the TSC can't be trusted (see time/clocksource.h).
+// It usually only has to read the TSC, so it's cheap enough to be used by
+// the scheduler for runtime accounting.
+uint64_t timer_get_nanos()
+{
+    return clocksource_read_nanos();
+}
+
+static timespec_t nanos_to_timespec(uint64_t nanos)
+{
+    return (timespec_t) {
+        .tv_sec = nanos / 1000000000,
+        .tv_nsec = nanos % 1000000000,
+    };
+}
+
+timespec_t timer_get_monotonic()
+{
+    return nanos_to_timespec(timer_get_nanos());
+}
+
+timespec_t timer_get_realtime()
+{
+    return nanos_to_timespec(clocksource_read_realtime());
+}
+
+// the tick a timer should go off on.  If its slack leaves a choice, pick the
+// one with the most trailing zero bits, so that timers due around the same
+// time pick the same tick (which also tends to be a bucket boundary on the
+// coarser levels).
+static uint64_t timer_expiry_tick(hpr_timer_t* timer)
+{
+    uint64_t gran = 1ull << TIMER_WHEEL_TICK_SHIFT;
+    if (timer->deadline > UINT64_MAX - gran - timer->slack)
     {
-       int64_t diff = (dest->tv_nsec + src.tv_nsec) - 1000000000;
-       dest->tv_nsec = diff;
-       dest->tv_sec++;
-    } else {
-        dest->tv_nsec += src.tv_nsec;
+        return UINT64_MAX >> TIMER_WHEEL_TICK_SHIFT;
     }
-    dest->tv_sec += src.tv_sec;
+
+    uint64_t earliest = (timer->deadline + gran - 1) >> TIMER_WHEEL_TICK_SHIFT;
+    uint64_t latest = (timer->deadline + timer->slack) >> TIMER_WHEEL_TICK_SHIFT;
+    if (latest <= earliest)
+    {
+        return earliest;
+    }
+
+    uint64_t bit = 63 - __builtin_clzll(earliest ^ latest);
+    return latest & ~((1ull << bit) - 1);
 }
 
-bool sub_interval(timespec_t* dest, timespec_t src)
+// the caller must hold the base's lock
+static void timer_enqueue(timer_base_t* base, hpr_timer_t* timer)
 {
-    // if we're subtracting more than 1 second worth of nanoseconds,
-    // handle the rollover
-    if (src.tv_nsec > dest->tv_nsec)
+    uint64_t expires = timer_expiry_tick(timer);
+    if (expires < base->clk)
+    {
+        expires = base->clk;
+    }
+    if (expires - base->clk > WHEEL_MAX_DELTA)
     {
-        int64_t diff = src.tv_nsec - dest->tv_nsec;
-        dest->tv_nsec = 999999999 - diff;
-        // if we have 0 seconds left and have rolled over,
-        // we are at 0 and the timer is finished
-        if (dest->tv_sec == 0)
+        expires = base->clk + WHEEL_MAX_DELTA;
+    }
+
+    uint64_t delta = expires - base->clk;
+    uint64_t level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= WHEEL_LEVEL_START(level + 1))
+    {
+        level++;
+    }
+
+    // round up to the level's granularity, so we never go off early.  Each
+    // level only reaches 63 of its buckets ahead, so the bucket is never one
+    // that's due to be expired before this one.
+    uint64_t unit = (expires + WHEEL_LEVEL_GRAN(level) - 1) >> WHEEL_LEVEL_SHIFT(level);
+    uint64_t slot = unit & WHEEL_LEVEL_MASK;
+    uint32_t bucket = level * WHEEL_LEVEL_SIZE + slot;
+
+    timer->next = base->buckets[bucket];
+    if (timer->next != NULL)
+    {
+        timer->next->pprev = &timer->next;
+    }
+    base->buckets[bucket] = timer;
+    timer->pprev = &base->buckets[bucket];
+    timer->bucket = bucket;
+    base->pending[level] |= 1ull << slot;
+    atomic_store(&timer->base, base);
+}
+
+// the caller must hold the base's lock
+static void timer_unlink(timer_base_t* base, hpr_timer_t* timer)
+{
+    *timer->pprev = timer->next;
+    if (timer->next != NULL)
+    {
+        timer->next->pprev = timer->pprev;
+    }
+
+    if (timer->bucket != WHEEL_BUCKET_EXPIRING && base->buckets[timer->bucket] == NULL)
+    {
+        base->pending[timer->bucket / WHEEL_LEVEL_SIZE] &= ~(1ull << (timer->bucket & WHEEL_LEVEL_MASK));
+    }
+
+    timer->next = NULL;
+    timer->pprev = NULL;
+    atomic_store(&timer->base, NULL);
+}
+
+// the first tick on which anything on the wheel is due, or UINT64_MAX.  The
+// caller must hold the base's lock.
+static uint64_t timer_base_next_tick(timer_base_t* base)
+{
+    uint64_t next = UINT64_MAX;
+    for (uint64_t level = 0; level < TIMER_WHEEL_LEVELS; level++)
+    {
+        uint64_t pending = base->pending[level];
+        if (pending == 0)
         {
-            dest->tv_sec = 0;
-            dest->tv_nsec = 0;
-            return true;
+            continue;
+        }
+
+        // the first of this level's buckets still to be expired, and how far
+        // round from it the first one with anything in is
+        uint64_t unit = (base->clk + WHEEL_LEVEL_GRAN(level) - 1) >> WHEEL_LEVEL_SHIFT(level);
+        uint64_t start = unit & WHEEL_LEVEL_MASK;
+        uint64_t rotated = start == 0 ? pending : (pending >> start) | (pending << (WHEEL_LEVEL_SIZE - start));
+
+        uint64_t tick = (unit + __builtin_ctzll(rotated)) << WHEEL_LEVEL_SHIFT(level);
+        if (tick < next)
+        {
+            next = tick;
+        }
+    }
+    return next;
+}
+
+// move everything due on tick base->clk onto the expiring list.  Level n's
+// buckets are only due when the tick is a multiple of their width.
+static void timer_base_collect(timer_base_t* base)
+{
+    uint64_t clk = base->clk;
+    for (uint64_t level = 0; level < TIMER_WHEEL_LEVELS; level++)
+    {
+        uint64_t slot = clk & WHEEL_LEVEL_MASK;
+        if (base->pending[level] & (1ull << slot))
+        {
+            base->pending[level] &= ~(1ull << slot);
+
+            uint32_t bucket = level * WHEEL_LEVEL_SIZE + slot;
+            hpr_timer_t* head = base->buckets[bucket];
+            base->buckets[bucket] = NULL;
+
+            hpr_timer_t* tail = head;
+            for (;;)
+            {
+                tail->bucket = WHEEL_BUCKET_EXPIRING;
+                if (tail->next == NULL)
+                {
+                    break;
+                }
+                tail = tail->next;
+            }
+
+            tail->next = base->expiring;
+            if (tail->next != NULL)
+            {
+                tail->next->pprev = &tail->next;
+            }
+            base->expiring = head;
+            head->pprev = &base->expiring;
+        }
+
+        if (clk & WHEEL_CLK_MASK)
+        {
+            break;
         }
-        dest->tv_sec--;
-    } else {
-        dest->tv_nsec -= src.tv_nsec;
+        clk >>= WHEEL_CLK_SHIFT;
     }
-    // if the number of seconds left on the timer is less than
-    // the number we are trying to subtract, we are at zero and
-    // the timer is finished
-    if (src.tv_sec > dest->tv_sec)
+}
+
+// where a timer armed on this CPU goes.  Isolated CPUs don't take a tick just
+// for timers, so theirs go to the first housekeeping CPU instead.  Must be
+// called with interrupts disabled.
+static timer_base_t* timer_local_base()
+{
+    local_cpu_t* cpu = cpu_get_current();
+    if (!atomic_load(&cpu->isolated))
     {
-        dest->tv_sec = 0;
-        dest->tv_nsec = 0;
-        return true;
+        return per_cpu_ptr(timer_base, cpu->cpu_number);
     }
-    dest->tv_sec -= src.tv_sec;
-    if (dest->tv_sec == 0 && dest->tv_nsec == 0)
+
+    for (uint64_t i = 0; i < cpu_count; i++)
     {
-        return true;
+        if (!atomic_load(&local_cpus[i]->isolated))
+        {
+            return per_cpu_ptr(timer_base, i);
+        }
     }
-    return false;
+    return per_cpu_ptr(timer_base, cpu->cpu_number);
 }
 
-void timer_handler()
+// wait for the timer's callback to finish, if it's being run.  The callback
+// itself may disarm or re-arm its timer, so the CPU running it doesn't wait.
+// Must be called with interrupts disabled.
+static void timer_wait_running(hpr_timer_t* timer)
 {
-    timespec_t interval = {
-        .tv_sec = 0,
-        .tv_nsec = 1000000000 / TIMER_FREQUENCY
-    };
-
-    add_interval(&monotonic_clock, interval);
-    add_interval(&realtime_clock, interval);
+    timer_base_t* local = this_cpu_ptr(timer_base);
+    for (uint64_t i = 0; i < cpu_count; i++)
+    {
+        timer_base_t* base = per_cpu_ptr(timer_base, i);
+        if (base == local)
+            continue;
+        while (atomic_load(&base->running) == timer)
+            asm volatile ("pause" : : : "memory");
+    }
+}
 
-    if (lock_test_and_acquire(&timers_lock))
+// take a timer off whichever wheel it's on.  Must be called with interrupts
+// disabled.
+static bool timer_detach(hpr_timer_t* timer)
+{
+    for (;;)
     {
-        for(size_t i = 0; i < armed_timers_count; i++)
+        timer_base_t* base = atomic_load(&timer->base);
+        if (base == NULL)
         {
-            hpr_timer_t t = armed_timers[i];
-            if (t.fired) continue;
-            if (sub_interval(&t.when, interval))
+            // it may have been taken off to be fired, in which case it's
+            // only done with once the callback is
+            if (timer_bases_ready)
             {
-                event_trigger(&t.event, false);
-                t.fired = true;
+                timer_wait_running(timer);
             }
+            return false;
+        }
+
+        lock_acquire(&base->lock);
+        // it might have been migrated or fired while we were getting the lock
+        if (atomic_load(&timer->base) == base)
+        {
+            timer_unlink(base, timer);
+            lock_release(&base->lock);
+            return true;
         }
+        lock_release(&base->lock);
+    }
+}
+
+void timer_arm(hpr_timer_t* timer, uint64_t deadline)
+{
+    bool ints = cpu_interrupts_disable();
+    timer_detach(timer);
+
+    timer_base_t* base = timer_local_base();
+    lock_acquire(&base->lock);
+
+    // the clock only moves on when the wheel is run, which a CPU with the
+    // tick stopped, or an idle one taking isolated CPUs' timers, may not
+    // have done for a long time.  The level is picked by how far the
+    // deadline is from the clock, so bring it up to date first, or a short
+    // timer would land on a level as coarse as the time since.
+    uint64_t next = timer_base_next_tick(base);
+    uint64_t now_tick = timer_get_nanos() >> TIMER_WHEEL_TICK_SHIFT;
+    uint64_t forward = next < now_tick ? next : now_tick;
+    if (forward > base->clk)
+    {
+        base->clk = forward;
+    }
+
+    timer->deadline = deadline;
+    timer->fired = false;
+    timer_enqueue(base, timer);
+    bool earliest = timer_base_next_tick(base) < next;
+
+    lock_release(&base->lock);
+
+    // make sure the CPU isn't going to sleep straight through it
+    if (earliest)
+    {
+        scheduler_kick_timer(local_cpus[base->cpu_number]);
+    }
+    cpu_interrupts_restore(ints);
+}
+
+bool timer_disarm(hpr_timer_t* timer)
+{
+    bool ints = cpu_interrupts_disable();
+    bool disarmed = timer_detach(timer);
+    cpu_interrupts_restore(ints);
+    return disarmed;
+}
 
-        lock_release(&timers_lock);
+uint64_t timer_next_deadline()
+{
+    if (!timer_bases_ready)
+    {
+        return TIMER_NO_DEADLINE;
+    }
+
+    bool ints = cpu_interrupts_disable();
+    timer_base_t* base = this_cpu_ptr(timer_base);
+    lock_acquire(&base->lock);
+    uint64_t tick = timer_base_next_tick(base);
+    lock_release(&base->lock);
+    cpu_interrupts_restore(ints);
+
+    if (tick == UINT64_MAX)
+    {
+        return TIMER_NO_DEADLINE;
+    }
+    return tick << TIMER_WHEEL_TICK_SHIFT;
+}
+
+void timer_run_expired()
+{
+    if (!timer_bases_ready)
+    {
+        return;
+    }
+
+    // bottom halves run with interrupts enabled, and interrupt handlers
+    // arm timers too
+    bool ints = cpu_interrupts_disable();
+    timer_base_t* base = this_cpu_ptr(timer_base);
+    lock_acquire(&base->lock);
+
+    uint64_t now = timer_get_nanos();
+    uint64_t now_tick = now >> TIMER_WHEEL_TICK_SHIFT;
+    while (base->clk <= now_tick)
+    {
+        // skip straight over ticks with nothing due, in case we've been
+        // idle for a while
+        uint64_t next = timer_base_next_tick(base);
+        if (next > now_tick)
+        {
+            base->clk = now_tick + 1;
+            break;
+        }
+        if (next > base->clk)
+        {
+            base->clk = next;
+        }
+
+        timer_base_collect(base);
+        base->clk++;
+    }
+
+    while (base->expiring != NULL)
+    {
+        hpr_timer_t* t = base->expiring;
+
+        // parked at the far end of the wheel, and not actually due yet
+        if (t->deadline > now)
+        {
+            timer_unlink(base, t);
+            timer_enqueue(base, t);
+            continue;
+        }
+
+        t->fired = true;
+
+        void (*callback)(hpr_timer_t*) = t->callback;
+        if (callback != NULL)
+        {
+            // the callback is free to arm timers of its own, so it can't be
+            // called with the lock held.  Anything else on the expiring
+            // list can be disarmed in the meantime, but disarming this one
+            // waits until we're done with it.
+            atomic_store(&base->running, t);
+            timer_unlink(base, t);
+            lock_release(&base->lock);
+            cpu_interrupts_restore(ints);
+            callback(t);
+            ints = cpu_interrupts_disable();
+            lock_acquire(&base->lock);
+            atomic_store(&base->running, NULL);
+            continue;
+        }
+        // still on the expiring list, so whoever disarms it waits for the
+        // lock, and the timer is still there for the whole trigger
+        event_trigger(&t->event, false);
+        timer_unlink(base, t);
+    }
+
+    lock_release(&base->lock);
+    cpu_interrupts_restore(ints);
+}
+
+void timer_migrate(uint64_t cpu_number)
+{
+    if (!timer_bases_ready)
+    {
+        return;
+    }
+
+    bool ints = cpu_interrupts_disable();
+
+    timer_base_t* from = per_cpu_ptr(timer_base, cpu_number);
+    timer_base_t* to = NULL;
+    for (uint64_t i = 0; i < cpu_count; i++)
+    {
+        if (i != cpu_number && !atomic_load(&local_cpus[i]->isolated))
+        {
+            to = per_cpu_ptr(timer_base, i);
+            break;
+        }
+    }
+    if (to == NULL)
+    {
+        cpu_interrupts_restore(ints);
+        return;
+    }
+
+    // always take the locks in the same order, so two CPUs migrating to
+    // each other can't deadlock
+    timer_base_t* first = from < to ? from : to;
+    timer_base_t* second = from < to ? to : from;
+    lock_acquire(&first->lock);
+    lock_acquire(&second->lock);
+
+    uint64_t moved = 0;
+    for (uint32_t bucket = 0; bucket < WHEEL_BUCKETS; bucket++)
+    {
+        while (from->buckets[bucket] != NULL)
+        {
+            hpr_timer_t* t = from->buckets[bucket];
+            timer_unlink(from, t);
+            timer_enqueue(to, t);
+            moved++;
+        }
+    }
+
+    lock_release(&second->lock);
+    lock_release(&first->lock);
+
+    if (moved > 0)
+    {
+        klog("timer", "Moved %d timers from CPU %d to CPU %d", moved, cpu_number, to->cpu_number);
+        scheduler_kick_timer(local_cpus[to->cpu_number]);
     }
+    cpu_interrupts_restore(ints);
 }
@@ -7,6 +7,7 @@
 #include <file/file.h>
 #include <debug/debug.h>
 #include <klog/klog.h>
+#include <time/clocksource.h>
 
 // standard headers
 #include <string.h>
@@ -96,6 +97,14 @@ process_t* userland_start_program(
             // errno should already be set at this point, with the relevant error
             return NULL;
         }
+        // so the program can read the clock without a syscall, see
+        // uapi/time/timepage.h.  If it isn't there, the program isn't told
+        // where to find it.
+        elf_info.time_page_mapped = clocksource_map_time_page(pagemap);
+        if (!elf_info.time_page_mapped)
+        {
+            klog("userland", "Couldn't map the time page for %s", path);
+        }
         void* entry_point = NULL;
         if(elf_info.ld_path == NULL)
         {